@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "testutil.h"
+
+//Check that the specialised data processing handlers the decoder picks leave the registers and flags
+//exactly as the general ALUInstruction (which works out the operand with OperandShift) does, for every
+//opcode, operand form and shift type, with the awkward shift amounts and both values of the carry going in.
+//As they share their body with ALUInstruction, the results are also checked against what the architecture
+//says they should be, worked out here from scratch
+
+//Values that the shifter and the adder treat specially
+static const uint32_t interesting_values[] = {0,1,2,0x7fffffff,0x80000000,0x80000001,0xfffffffe,0xffffffff};
+//Shift amounts held in rs, where 0 means no shift at all and anything 32 or over is a special case
+static const uint32_t interesting_amounts[] = {0,1,16,31,32,33,63,64,255,0x100,0xffffff20};
+
+static uint32_t RandomValue(void) {
+    if(Random()&1) {
+        return interesting_values[Random()%(sizeof(interesting_values)/sizeof(interesting_values[0]))];
+    }
+    return Random();
+}
+
+static void RandomRegs(regs_t *regs, uint32_t mode, uint32_t nzcv) {
+    for(uint32_t i=0;i<NUMREGS;i++) {
+        regs->actual[i] = RandomValue();
+    }
+    regs->actual[PC] = (nzcv<<28) | (Random()&0x0c000000) | (Random()&0x03fffffc) | mode;
+}
+
+static uint32_t referenced = 0;
+
+//Operand 2 and the shifter's carry out, where c is the carry going in
+static uint32_t ReferenceOperand(const regs_t *regs, uint32_t instruction, uint32_t c, uint32_t *carry_out) {
+    uint32_t value = regs->actual[instruction&0xf];
+    uint32_t type  = (instruction>>5)&3;
+    uint32_t amount;
+
+    if(instruction&0x02000000) {
+        uint32_t rotate = (instruction>>7)&0x1e;
+        value      = instruction&0xff;
+        value      = rotate ? (value>>rotate) | (value<<(32-rotate)) : value;
+        *carry_out = rotate ? value>>31 : c;
+        return value;
+    }
+    if(instruction&0x10) {
+        //A register amount of 0 leaves the value and the carry alone, whatever the type
+        amount = regs->actual[(instruction>>8)&0xf]&0xff;
+        if(0 == amount) {
+            *carry_out = c;
+            return value;
+        }
+    }
+    else {
+        amount = (instruction>>7)&0x1f;
+        if(0 == amount) {
+            switch(type) {
+            case 0: //LSL #0 is no shift at all
+                *carry_out = c;
+                return value;
+            case 1: //LSR #32
+            case 2: //ASR #32
+                amount = 32;
+                break;
+            case 3: //RRX
+                *carry_out = value&1;
+                return (value>>1) | (c<<31);
+            }
+        }
+    }
+    switch(type) {
+    case 0:
+        *carry_out = amount > 32 ? 0 : amount == 32 ? value&1 : (value>>(32-amount))&1;
+        return amount >= 32 ? 0 : value<<amount;
+    case 1:
+        *carry_out = amount > 32 ? 0 : amount == 32 ? value>>31 : (value>>(amount-1))&1;
+        return amount >= 32 ? 0 : value>>amount;
+    case 2:
+        *carry_out = amount >= 32 ? value>>31 : (value>>(amount-1))&1;
+        return amount >= 32 ? (value&0x80000000 ? 0xffffffff : 0) : (uint32_t)(((int32_t)value)>>amount);
+    default:
+        //Rotating by a multiple of 32 leaves the value, with bit 31 as the carry
+        amount &= 0x1f;
+        *carry_out = amount ? (value>>(amount-1))&1 : value>>31;
+        return amount ? (value>>amount) | (value<<(32-amount)) : value;
+    }
+}
+
+//The registers the instruction should leave, for the ones that don't write the pc or read it
+static int Reference(const regs_t *before, uint32_t instruction, regs_t *after) {
+    uint32_t opcode = (instruction>>21)&0xf;
+    uint32_t rn     = before->actual[(instruction>>16)&0xf];
+    uint32_t psr    = before->actual[PC];
+    uint32_t c      = (psr>>29)&1;
+    uint32_t n_c    = c^1;
+    uint32_t shift_c, op2, result;
+    uint32_t carry  = 0;
+    uint32_t over   = (psr>>28)&1;
+
+    if(((instruction>>12)&0xf) == PC || ((instruction>>16)&0xf) == PC ||
+       (!(instruction&0x02000000) && ((instruction&0xf) == PC || ((instruction&0x10) && ((instruction>>8)&0xf) == PC)))) {
+        return 0;
+    }
+    op2   = ReferenceOperand(before,instruction,c,&shift_c);
+    carry = shift_c;
+    switch(opcode) {
+    case 0x0: case 0x8: result = rn & op2; break;
+    case 0x1: case 0x9: result = rn ^ op2; break;
+    case 0xc:           result = rn | op2; break;
+    case 0xd:           result = op2; break;
+    case 0xe:           result = rn & ~op2; break;
+    case 0xf:           result = ~op2; break;
+    case 0x2: case 0xa: //SUB, CMP: the carry is not borrow
+        result = rn - op2;
+        carry  = rn >= op2;
+        over   = ((rn^op2)&(rn^result))>>31;
+        break;
+    case 0x3: //RSB
+        result = op2 - rn;
+        carry  = op2 >= rn;
+        over   = ((op2^rn)&(op2^result))>>31;
+        break;
+    case 0x4: case 0xb: //ADD, CMN
+        result = rn + op2;
+        carry  = result < rn;
+        over   = (~(rn^op2)&(rn^result))>>31;
+        break;
+    case 0x5: //ADC
+        result = rn + op2 + c;
+        carry  = ((uint64_t)rn + op2 + c)>>32;
+        over   = (~(rn^op2)&(rn^result))>>31;
+        break;
+    case 0x6: //SBC
+        result = rn - op2 - n_c;
+        carry  = (uint64_t)rn >= (uint64_t)op2 + n_c;
+        over   = ((rn^op2)&(rn^result))>>31;
+        break;
+    default: //RSC
+        result = op2 - rn - n_c;
+        carry  = (uint64_t)op2 >= (uint64_t)rn + n_c;
+        over   = ((op2^rn)&(op2^result))>>31;
+        break;
+    }
+    *after = *before;
+    if((opcode&0xc) != 0x8) {
+        after->actual[(instruction>>12)&0xf] = result;
+    }
+    if(instruction&0x00100000) {
+        after->actual[PC] = (psr&0x0fffffff) | (result&FLAG_N) | (result ? 0 : FLAG_Z) | (carry ? FLAG_C : 0) |
+            (over ? FLAG_V : 0);
+    }
+    return 1;
+}
+
+static void Compare(armv2_t *cpu, const regs_t *before, uint32_t instruction) {
+    decoded_instruction_t decoded = {0};
+    regs_t specialised, expected;
+    uint32_t specialised_pc;
+    enum armv2_exception specialised_result, general_result;
+
+    DecodeInstruction(&decoded,instruction);
+    if(decoded.type != INSTRUCTION_ALU) {
+        printf("%08x decoded as type %d\n",instruction,decoded.type);
+        failures++;
+        return;
+    }
+
+    cpu->regs                = *before;
+    cpu->lazy_flags.kind     = FLAGS_RESOLVED;
+    cpu->pc                  = before->actual[PC]&0x03fffffc;
+    specialised_result       = decoded.handler(cpu,instruction);
+    RESOLVE_FLAGS(cpu);
+    specialised              = cpu->regs;
+    specialised_pc           = cpu->pc;
+
+    cpu->regs                = *before;
+    cpu->lazy_flags.kind     = FLAGS_RESOLVED;
+    cpu->pc                  = before->actual[PC]&0x03fffffc;
+    general_result           = ALUInstruction(cpu,instruction);
+    RESOLVE_FLAGS(cpu);
+
+    if(specialised_result != general_result || specialised_pc != cpu->pc ||
+       memcmp(&specialised,&cpu->regs,sizeof(specialised)) != 0) {
+        printf("%08x differs with psr %08x:\n",instruction,before->actual[PC]);
+        for(uint32_t i=0;i<NUMREGS;i++) {
+            if(specialised.actual[i] != cpu->regs.actual[i]) {
+                printf("    reg %u specialised %08x general %08x\n",i,specialised.actual[i],cpu->regs.actual[i]);
+            }
+        }
+        if(specialised_pc != cpu->pc) {
+            printf("    pc specialised %08x general %08x\n",specialised_pc,cpu->pc);
+        }
+        failures++;
+    }
+    if(Reference(before,instruction,&expected)) {
+        referenced++;
+        if(memcmp(&specialised,&expected,sizeof(specialised)) != 0) {
+            printf("%08x isn't what the architecture says with psr %08x:\n",instruction,before->actual[PC]);
+            for(uint32_t i=0;i<NUMREGS;i++) {
+                if(specialised.actual[i] != expected.actual[i]) {
+                    printf("    reg %u got %08x expected %08x\n",i,specialised.actual[i],expected.actual[i]);
+                }
+            }
+            failures++;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    armv2_t cpu;
+    uint32_t checked = 0;
+
+    SetupCpu(&cpu,NULL,0);
+
+    for(uint32_t opcode=0;opcode<16;opcode++) {
+        for(uint32_t s=0;s<2;s++) {
+            for(uint32_t rd_pc=0;rd_pc<2;rd_pc++) {
+                for(uint32_t nzcv=0;nzcv<16;nzcv++) {
+                    for(uint32_t mode=0;mode<4;mode++) {
+                        //condition AL, with a random rn and one of the others or the pc as rd
+                        uint32_t base = 0xe0000000 | (opcode<<21) | (s<<20) | ((Random()&0xf)<<16) |
+                            ((rd_pc ? PC : Random()%PC)<<12);
+                        regs_t regs;
+
+                        //rotated immediates, including no rotation at all
+                        for(uint32_t rotate=0;rotate<16;rotate++) {
+                            RandomRegs(&regs,mode,nzcv);
+                            Compare(&cpu,&regs,base | 0x02000000 | (rotate<<8) | (Random()&0xff));
+                            checked++;
+                        }
+                        //every shift type by every immediate amount, where 0 means LSL #0, LSR #32, ASR #32
+                        //and RRX
+                        for(uint32_t type=0;type<4;type++) {
+                            for(uint32_t amount=0;amount<32;amount++) {
+                                RandomRegs(&regs,mode,nzcv);
+                                Compare(&cpu,&regs,base | (amount<<7) | (type<<5) | (Random()&0xf));
+                                checked++;
+                            }
+                        }
+                        //every shift type by a register, with the amounts that aren't ordinary shifts
+                        for(uint32_t type=0;type<4;type++) {
+                            for(uint32_t i=0;i<sizeof(interesting_amounts)/sizeof(interesting_amounts[0]);i++) {
+                                uint32_t rs = Random()&0xf;
+                                uint32_t rm = Random()&0xf;
+                                RandomRegs(&regs,mode,nzcv);
+                                if(rs != PC) {
+                                    regs.actual[rs] = interesting_amounts[i];
+                                }
+                                Compare(&cpu,&regs,base | (rs<<8) | (type<<5) | 0x10 | rm);
+                                checked++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    cleanup_armv2(&cpu);
+    printf("%s: %u instructions checked, %u against the reference, %d failures\n",argv[0],checked,referenced,failures);
+    return failures ? 1 : 0;
+}
@@ -10,11 +10,11 @@ int main(int argc, char *argv[]) {
     enum armv2_status result = ARMV2STATUS_OK;
 
     if(ARMV2STATUS_OK != (result = init(&armv2,(1<<20)))) {
-        LOG("Error %d creating\n",result);
+        LOG_ERROR("Error %d creating\n",result);
         return result;
     }
     if(ARMV2STATUS_OK != (result = load_rom(&armv2,"boot.rom"))) {
-        LOG("Error loading rom %d\n",result);
+        LOG_ERROR("Error loading rom %d\n",result);
         return result;
     }
     run_armv2(&armv2,-1);
@@ -1,4 +1,7 @@
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
 #include "hw_manager.h"
 #include "common.h"
 
@@ -25,27 +28,48 @@
 #define R12_F 24
 #define R13_F 25
 #define R14_F 26
-
-#define NUMREGS              (27)
+//The user mode registers that other modes bank, while we're in one of those modes
+#define R8_U  27
+#define R9_U  28
+#define R10_U 29
+#define R11_U 30
+#define R12_U 31
+#define R13_U 32
+#define R14_U 33
+
+#define NUMREGS              (34)
 #define NUM_EFFECTIVE_REGS   (16)
 
 #define PAGE_SIZE_BITS       (12)
 #define PAGE_SIZE            (1<<PAGE_SIZE_BITS)
 #define PAGE_MASK            (PAGE_SIZE-1)
 #define NUM_PAGE_TABLES      (1<<(26 - PAGE_SIZE_BITS))
+//The page table is two levels, a directory of tables of PAGE_TABLE_SIZE pages each
+#define PAGE_TABLE_BITS      (7)
+#define PAGE_TABLE_SIZE      (1<<PAGE_TABLE_BITS)
+#define PAGE_DIRECTORY_SIZE  (NUM_PAGE_TABLES>>PAGE_TABLE_BITS)
 #define WORDS_PER_PAGE       (1<<(PAGE_SIZE_BITS-2))
 #define MAX_MEMORY           (1<<26)
 #define HW_DEVICES_MAX       (64)
 
+//One bit per page, set when the page is written
+#define DIRTY_WORDS          (NUM_PAGE_TABLES/64)
+
+#define TLB_SIZE_BITS        (8)
+#define TLB_SIZE             (1<<TLB_SIZE_BITS)
+#define TLB_INVALID          (0xffffffff)
+
 #define PAGEOF(addr)         ((addr)>>PAGE_SIZE_BITS)
 #define INPAGE(addr)         ((addr)&PAGE_MASK)
 #define WORDINPAGE(addr)     (INPAGE(addr)>>2)
-#define DEREF(cpu,addr)      (cpu->page_tables[PAGEOF(addr)]->memory[WORDINPAGE(addr)])
+#define DEREF(cpu,addr)      (GetPage((cpu),PAGEOF(addr))->memory[WORDINPAGE(addr)])
 #define SETPC(cpu,newpc)     ((cpu)->regs.actual[PC] = (((cpu)->regs.actual[PC]&0xfc000003) | ((newpc)&0x03fffffc)))
 #define GETPC(cpu)           ((cpu)->regs.actual[PC]&0x03fffffc)
-#define GETREG(cpu,rn)       (*(cpu)->regs.effective[(rn)])
-#define GETUSERREG(cpu,rn)   ((cpu)->regs.actual[(rn)])
+#define GETREG(cpu,rn)       ((cpu)->regs.actual[(rn)])
+#define GETUSERREG(cpu,rn)   (*UserRegister((cpu),(rn)))
 #define SETMODE(cpu,newmode) ((cpu)->regs.actual[PC] = (((cpu)->regs.actual[PC]&0xfffffffc) | (newmode)))
+//Use this rather than SETMODE unless the registers are going to be swapped some other way
+#define SWITCHMODE(cpu,newmode) do { SwapBanks((cpu),GETMODE(cpu),(newmode)); SETMODE((cpu),(newmode)); } while(0)
 #define GETMODE(cpu)         ((cpu)->regs.actual[PC]&0x3)
 #define GETPSR(cpu)          ((cpu)->regs.actual[PC]&0xfc000000)
 #define SETPSR(cpu,newpsr)   ((cpu)->regs.actual[PC] = (((cpu)->regs.actual[PC]&0x03ffffff) | (newpsr)))
@@ -55,6 +79,8 @@
 #define PERM_READ    4
 #define PERM_WRITE   2
 #define PERM_EXECUTE 1
+#define PAGE_COW     8 //RAM that has to be saved for the newest snapshot before it's written
+#define PAGE_SHARED 16 //decoded belongs to a ROM loaded by load_shared_rom, see UnsharePage
 
 #define FLAG_N 0x80000000
 #define FLAG_Z 0x40000000
@@ -68,12 +94,18 @@
 
 #define PIN_F  0x00000001
 #define PIN_I  0x00000002
+//Not a real pin. Raised when an event is scheduled during a run so the cpu stops after the current
+//instruction, see armv2_schedule. Also raised while recording when a pin or line is waiting to change, see
+//ReplayInput
+#define PIN_RESCHEDULE 0x00000004
 
 #define SWI_BREAKPOINT 0x00beeeef
 
 #define FLAG_SET(cpu,flag) ((cpu)->regs.actual[PC]&FLAG_##flag)
 #define FLAG_CLEAR(cpu,flag) (!FLAG_SET(cpu,flag))
-#define PIN_ON(cpu,pin) ((cpu)->pins&PIN_##pin)
+//Other threads can change the pins at any time (see armv2_raise_pins)
+#define PINS(cpu) __atomic_load_n(&(cpu)->pins,__ATOMIC_RELAXED)
+#define PIN_ON(cpu,pin) (PINS(cpu)&PIN_##pin)
 #define PING_OFF(cpu,pin) (!PIN_ON(cpu,pin))
 
 #define COND_EQ 0x0
@@ -94,13 +126,50 @@
 #define COND_NV 0xf
 
 #define CONDITION_BITS(x) ((x)>>28)
+#define CONDITION_PASSED(cpu,mask) (((mask)>>((cpu)->regs.actual[PC]>>28))&1)
+
+#define DECODED_TRANSLATED  1
+#define DECODED_NEEDS_FLAGS 2 //reads NZCV, so any pending flags have to be resolved before it runs
+
+//What the last flag setting instruction did, when its NZCV haven't been written into the PSR yet
+#define FLAGS_RESOLVED 0 //The PSR is up to date
+#define FLAGS_LOGIC    1 //N and Z from result, C from carry, V unchanged
+#define FLAGS_ARITH    2 //result = op1 + op2 + carry, N Z C and V from that
+
+#define RESOLVE_FLAGS(cpu) do { if((cpu)->lazy_flags.kind != FLAGS_RESOLVED) { ResolveFlags(cpu); } } while(0)
+
+//Pages sharing a ROM's decoded instructions get their own copy before anything in it changes
+#define UNSHARE_DECODED(page) do { if((page)->flags&PAGE_SHARED) { UnsharePage(page); } } while(0)
+
+#ifdef ARMV2_JIT
+#define INVALIDATE_DECODED(cpu,page,addr) do {                                    \
+        UNSHARE_DECODED(page);                                                    \
+        if((page)->decoded) {                                                     \
+            decoded_instruction_t *_decoded = &(page)->decoded[WORDINPAGE(addr)]; \
+            if(_decoded->flags&DECODED_TRANSLATED) {                              \
+                jit_invalidate((cpu),(addr));                                     \
+                _decoded->flags &= ~DECODED_TRANSLATED;                           \
+            }                                                                     \
+            _decoded->handler = NULL;                                             \
+        }                                                                         \
+    } while(0)
+#else
+#define INVALIDATE_DECODED(cpu,page,addr) do { UNSHARE_DECODED(page); if((page)->decoded) { (page)->decoded[WORDINPAGE(addr)].handler = NULL; } } while(0)
+#endif
 
 #define MODE_USR 0
 #define MODE_FIQ 1
 #define MODE_IRQ 2
 #define MODE_SUP 3
 
-#define FLAG_INIT 1
+#define FLAG_INIT     1
+#define FLAG_JIT_EXIT 2
+#define FLAG_RUNNING  4 //inside one of the cores
+#define FLAG_RUN_FOREVER 8 //run_armv2 was given -1, so it runs forever with breakpoints treated as SWIs
+#define FLAG_HALTED   16 //the guest is idle and only an interrupt can get it going again
+#define FLAG_RECORDING 32 //saving the cpu's inputs, see replay.c
+#define FLAG_REPLAYING 64 //taking them from a recording instead of the devices
+#define FLAG_WAITING  128 //the last slice ran out with the guest waiting for an interrupt
 #define CPU_INITIALISED(cpu) ( (((cpu)->flags)&FLAG_INIT) )
 
 enum armv2_exception {
@@ -114,6 +183,7 @@ enum armv2_exception {
     EXCEPT_FIQ                   = 7,
     EXCEPT_NONE                  = 8,
     EXCEPT_BREAKPOINT            = 9,
+    EXCEPT_IDLE                  = 10, //the guest is spinning until something interrupts it
     EXCEPT_MAX,
 };
 
@@ -124,29 +194,236 @@ typedef struct {
     uint32_t save_reg;
 } exception_handler_t;
 
+//The first NUM_EFFECTIVE_REGS are the registers as the current mode sees them. The rest hold the banked
+//registers of the other modes, and get swapped in by SwapBanks when the mode changes
 typedef struct {
     uint32_t  actual[NUMREGS];
-    uint32_t *effective[NUM_EFFECTIVE_REGS];
 } regs_t;
 
 typedef uint32_t (*access_callback_t)(void *extra, uint32_t addr, uint32_t value);
+//Transfers count consecutive words starting at addr to or from buffer in one go
+typedef void (*block_callback_t)(void *extra, uint32_t addr, uint32_t count, uint32_t *buffer);
+
+typedef struct _armv2_t armv2_t;
+typedef struct _armv2_snapshot_t armv2_snapshot_t;
+typedef struct _armv2_rom_t armv2_rom_t;
+typedef struct _armv2_replay_t armv2_replay_t;
+typedef enum armv2_exception (*instruction_handler_t)(armv2_t *cpu,uint32_t instruction);
+
+//The class of an instruction, which picks its handler
+enum instruction_type {
+    INSTRUCTION_ALU                             = 0,
+    INSTRUCTION_MULTIPLY                        = 1,
+    INSTRUCTION_SWAP                            = 2,
+    INSTRUCTION_SINGLE_DATA_TRANSFER            = 3,
+    INSTRUCTION_BRANCH                          = 4,
+    INSTRUCTION_MULTI_DATA_TRANSFER             = 5,
+    INSTRUCTION_SOFTWARE_INTERRUPT              = 6,
+    INSTRUCTION_COPROCESSOR_DATA_TRANSFER       = 7,
+    INSTRUCTION_COPROCESSOR_REGISTER_TRANSFER   = 8,
+    INSTRUCTION_COPROCESSOR_DATA_OPERATION      = 9,
+    INSTRUCTION_MAX,
+};
+
+//One of these is kept for every word of a page that has been executed from, so we only have to decode
+//each instruction once. A NULL handler means the word hasn't been decoded (or has been written to since)
+typedef struct {
+    instruction_handler_t handler;
+    uint32_t              instruction;
+    uint16_t              condition_mask; //bit n is set if the condition passes with NZCV == n
+    uint8_t               type;           //an instruction_type
+    uint8_t               flags;
+} decoded_instruction_t;
 
 typedef struct {
-    uint32_t          *memory;
-    void              *mapped_device;
-    access_callback_t  read_callback;
-    access_callback_t  write_callback;
-    uint32_t           flags;
+    uint32_t              *memory;
+    decoded_instruction_t *decoded;
+    void                  *mapped_device;
+    access_callback_t      read_callback;
+    access_callback_t      write_callback;
+    access_callback_t      read_byte_callback;
+    access_callback_t      write_byte_callback;
+    block_callback_t       read_block_callback;
+    block_callback_t       write_block_callback;
+    uint32_t               flags;
 } page_info_t;
 
+//A direct mapped cache of the pages that loads and stores can go straight to. A tag holds the page number
+//when that kind of access to the page is plain memory the current mode is allowed to touch (no callback,
+//and for writes nothing decoded from it that would need invalidating), and TLB_INVALID otherwise
+typedef struct {
+    uint32_t  read_tag;
+    uint32_t  write_tag;
+    uint32_t *memory;
+} tlb_entry_t;
+
+//Native devices are shared objects that export a const armv2_device_plugin_t called armv2_device_plugin. They're
+//loaded with load_device and their callbacks are called directly from the cpu with the state create returned,
+//so an access to one of their pages never leaves C. frame is optional and is called by frame_devices, which
+//the host calls between runs (once a video frame, say). It returns non-zero if the host should be told
+//about something, like the screen having changed.
+//
+//The word callbacks are required. The byte and block ones are optional: with them a byte access or an
+//LDM/STM of a device page is one call to the device rather than a read-modify-write or a call per word.
+//Version 1 stopped at frame, so its plugins aren't loaded as we'd read past the end of them
+#define ARMV2_DEVICE_ABI_VERSION 2
+#define ARMV2_DEVICE_PLUGIN_SYMBOL "armv2_device_plugin"
+
+typedef struct {
+    uint32_t          abi_version; //ARMV2_DEVICE_ABI_VERSION
+    uint32_t          device_id;
+    const char       *name;
+    void           *(*create)(const char *args);
+    void            (*destroy)(void *extra);
+    access_callback_t read_callback;
+    access_callback_t write_callback;
+    uint32_t        (*frame)(void *extra);
+    access_callback_t read_byte_callback;
+    access_callback_t write_byte_callback;
+    block_callback_t  read_block_callback;
+    block_callback_t  write_block_callback;
+} armv2_device_plugin_t;
+
 typedef struct {
     uint32_t device_id;
     uint32_t interrupt_flag_addr;
     access_callback_t read_callback;
     access_callback_t write_callback;
     void *extra;
+    //Only set for devices from load_device or add_timer, which belong to the cpu and are unloaded by
+    //cleanup_armv2. handle is NULL for the built in ones
+    const armv2_device_plugin_t *plugin;
+    void *handle;
+    //Optional, see armv2_device_plugin_t
+    access_callback_t read_byte_callback;
+    access_callback_t write_byte_callback;
+    block_callback_t  read_block_callback;
+    block_callback_t  write_block_callback;
 } hardware_device_t;
 
+typedef struct {
+    uint32_t kind; //one of the FLAGS_ values
+    uint32_t result;
+    uint32_t op1;
+    uint32_t op2;
+    uint32_t carry;
+} lazy_flags_t;
+
+//A branch back over a few instructions might be closing a loop that only waits for an interrupt. We
+//watch the most recent one, and if the registers are the same every IDLE_CHECK_INTERVAL times round and
+//nothing in between could have changed what the loop reads, it's never going to get anywhere. Anything
+//that could leave the loop or make its loads see something new (a different branch, a write to the pc,
+//an exception or a device read) stops the watch with IDLE_RESET
+#define IDLE_NO_BRANCH       (0xffffffff)
+#define IDLE_CHECK_INTERVAL  (64)
+#define IDLE_MAX_LOOP        (16) //instructions in the loop body, not counting the branch
+#define IDLE_RESET(cpu)      ((cpu)->idle.branch = IDLE_NO_BRANCH)
+
+typedef struct {
+    uint32_t branch;   //address of the branch we're watching, or IDLE_NO_BRANCH
+    uint32_t count;    //times it's been taken since we started watching
+    uint32_t recorded; //non-zero once regs holds the registers from the last check
+    uint32_t period;   //once it's idle, the number of instructions after which it's back where it started
+    uint32_t regs[NUM_EFFECTIVE_REGS];
+} idle_watch_t;
+
+//Time is counted in cycles, one per instruction (including the ones skipped while the guest is idle), and
+//devices schedule events for a number of cycles in the future. run_armv2 runs straight up to the next
+//deadline rather than checking at every instruction. The events are kept in a hierarchical timer wheel:
+//one goes in the level of the highest group of EVENT_WHEEL_BITS bits in which its deadline differs from
+//the current time, in the slot for its deadline's bits in that group. Everything in a level is due before
+//anything in the levels above, and the slots of a level are in order, so the next deadline is always in
+//the first occupied slot. As time passes the events in a slot that's been reached move down a level
+#define EVENT_WHEEL_BITS    (6)
+#define EVENT_WHEEL_SLOTS   (1<<EVENT_WHEEL_BITS)
+#define EVENT_WHEEL_LEVELS  ((64 + EVENT_WHEEL_BITS - 1)/EVENT_WHEEL_BITS)
+#define EVENT_NOT_SCHEDULED (0xffffffff)
+#define EVENT_PENDING       (EVENT_WHEEL_LEVELS*EVENT_WHEEL_SLOTS) //scheduled during a run
+
+typedef struct _armv2_event_t armv2_event_t;
+typedef void (*event_callback_t)(armv2_t *cpu, void *extra);
+
+//Belongs to whoever schedules it, who has to cancel it before freeing it. Set up with armv2_init_event
+struct _armv2_event_t {
+    uint64_t          deadline;
+    event_callback_t  callback;
+    void             *extra;
+    armv2_event_t    *next;
+    armv2_event_t   **prev;
+    uint32_t          bucket; //level*EVENT_WHEEL_SLOTS + slot, EVENT_PENDING or EVENT_NOT_SCHEDULED
+};
+
+typedef struct {
+    armv2_event_t *slots[EVENT_WHEEL_LEVELS][EVENT_WHEEL_SLOTS];
+    uint64_t       occupied[EVENT_WHEEL_LEVELS]; //bit n is set if slot n of that level has anything in it
+    armv2_event_t *pending; //deadline holds the delay until run_armv2 gets to them
+} event_wheel_t;
+
+//The built in timer, see timer.c
+#define TIMER_DEVICE_ID 0x41414143
+#define TIMER_INTERVAL  0x0 //cycles between ticks, writing starts it counting from now and 0 stops it
+#define TIMER_TICKS     0x4 //ticks since the last write to it, which lowers the timer's interrupt line
+
+//The interrupt controller on coprocessor 3 gives every hardware device an interrupt line, line n belonging
+//to hardware_devices[n]. Whenever a line that's enabled is up the controller raises IRQ, and when the last
+//one goes down it lowers it, so anything that uses lines shouldn't raise PIN_I itself. The guest's handler
+//finds out which line to service with a single MRC: the one with the highest priority, and of those the
+//lowest numbered
+#define INTERRUPT_LINES      (HW_DEVICES_MAX)
+#define INTERRUPT_PRIORITIES (16)
+#define INTERRUPT_NONE       (0xffffffff)
+
+typedef struct {
+    uint64_t pending;                          //changed under cpu->wakeup_lock, read with atomics
+    uint64_t enabled;
+    uint64_t by_priority[INTERRUPT_PRIORITIES]; //the lines at each priority
+    uint8_t  priority[INTERRUPT_LINES];
+    uint32_t vectors[INTERRUPT_LINES];
+    uint32_t default_vector;
+    uint32_t select;
+} interrupt_controller_t;
+
+//An executor runs many cpus on a pool of worker threads. Each worker has a queue of jobs, and runs the
+//one at the front for EXECUTOR_SLICE instructions before putting it on the back, so every cpu gets its
+//turn. A worker with nothing to do steals from the front of the others' queues. A job that's running
+//until a breakpoint and whose guest has halted waiting for an interrupt is parked off the queues until a pin or
+//line is raised, see ExecutorWake
+#define EXECUTOR_SLICE (1<<16)
+
+//The kinds of record in a recording of the cpu's inputs, see replay.c
+#define REPLAY_READ       0 //a word from a device's read_callback
+#define REPLAY_READ_BYTE  1 //from its read_byte_callback
+#define REPLAY_READ_BLOCK 2 //words from its read_block_callback
+#define REPLAY_RAISE_PINS 3
+#define REPLAY_LOWER_PINS 4
+#define REPLAY_RAISE_LINE 5
+#define REPLAY_LOWER_LINE 6
+#define REPLAY_WAKE       7 //a slice ran out while the guest was waiting, which ends the wait
+#define REPLAY_END        0xffffffff //not in the file, there's nothing left
+
+//How far through its recording (or replay) the cpu was, saved with each snapshot so that restoring one
+//carries on from the same place, see ReplayRewind
+typedef struct {
+    uint64_t serial; //of the recording, or 0 if there wasn't one
+    uint64_t read_pos;
+    uint64_t input_pos;
+    uint64_t last;
+} replay_position_t;
+
+typedef struct _armv2_executor_t armv2_executor_t;
+typedef struct _armv2_job_t armv2_job_t;
+
+//Belongs to whoever submits it, and has to stay around until it's been awaited
+struct _armv2_job_t {
+    armv2_t           *cpu;
+    armv2_executor_t  *executor;
+    armv2_job_t       *next;
+    int32_t            remaining; //instructions still to run, -1 to run until a breakpoint
+    enum armv2_status  result;
+    uint32_t           parked;
+    uint32_t           done;
+};
+
 typedef struct _hardware_mapping_t {
     hardware_device_t *device;
     struct _hardware_mapping_t *next;
@@ -155,15 +432,18 @@ typedef struct _hardware_mapping_t {
     uint32_t flags;
 } hardware_mapping_t;
 
-typedef struct {
+struct _armv2_t {
     regs_t               regs;  //storage for all the registers
     uint32_t            *physical_ram;
     uint32_t             physical_ram_size;
+    page_info_t         *ram_pages; //the page_info for each page of physical_ram, filled in by FillRamPage
     uint32_t             num_hardware_devices;
-    page_info_t         *page_tables[NUM_PAGE_TABLES];
+    //Unused parts of the address space share empty_page_table, so lookups never have to check for NULL
+    page_info_t        **page_directory[PAGE_DIRECTORY_SIZE];
     exception_handler_t  exception_handlers[EXCEPT_MAX];
     hardware_device_t   *hardware_devices[HW_DEVICES_MAX];
     hw_manager_t         hardware_manager;
+    interrupt_controller_t interrupts;
     hardware_mapping_t  *hw_mappings;
     //the pc is broken out for efficiency, when needed accessed r15 is updated from them
     uint32_t pc;
@@ -171,16 +451,120 @@ typedef struct {
     uint32_t flags;
     //simulating hardware pins:
     uint32_t pins;
-} armv2_t;
+    tlb_entry_t tlb[TLB_SIZE];
+    //NZCV aren't calculated until something needs them
+    lazy_flags_t lazy_flags;
+    //translated code, only used when built with ARMV2_JIT
+    struct _jit_t *jit;
+    //the newest snapshot, which pages written for the first time get saved to
+    armv2_snapshot_t *snapshot;
+    //Pages written since their bit was last cleared. Clean pages aren't write mapped in the TLB so the first
+    //write to one always comes the slow way and can set it
+    uint64_t dirty[DIRTY_WORDS];
+    idle_watch_t idle;
+    //instructions of the budget we didn't bother running because the guest was idle
+    uint64_t idle_skipped;
+    //signalled when a pin is raised, for a guest that's waiting for an interrupt
+    pthread_mutex_t wakeup_lock;
+    pthread_cond_t  wakeup;
+    //Cycles run so far. This only moves when a core stops, so during a run it's where the run started
+    uint64_t cycles;
+    event_wheel_t events;
+    //What was left of its budget when a core stopped early, so run_armv2 knows how far it got
+    int32_t budget_left;
+    //The executor running us, if we've been submitted to one
+    armv2_executor_t *executor;
+    //The ROM from load_shared_rom, if any
+    armv2_rom_t *rom;
+    //Set while recording or replaying
+    armv2_replay_t *replay;
+};
 
-typedef enum armv2_exception (*instruction_handler_t)(armv2_t *cpu,uint32_t instruction);
 enum armv2_status init(armv2_t *cpu, uint32_t memsize);
 enum armv2_status load_rom(armv2_t *cpu, const char *filename);
+enum armv2_status load_shared_rom(armv2_t *cpu, const char *filename);
+void release_rom(armv2_rom_t *rom);
+void UnsharePage(page_info_t *page);
 enum armv2_status cleanup_armv2(armv2_t *cpu);
 enum armv2_status run_armv2(armv2_t *cpu, int32_t instructions);
 enum armv2_status add_hardware(armv2_t *cpu, hardware_device_t *device);
+enum armv2_status load_device(armv2_t *cpu, const char *filename, const char *args);
+void unload_device(hardware_device_t *device);
+uint64_t frame_devices(armv2_t *cpu);
+enum armv2_status armv2_snapshot(armv2_t *cpu, armv2_snapshot_t **out);
+enum armv2_status armv2_restore(armv2_t *cpu, armv2_snapshot_t *snapshot);
+enum armv2_status armv2_rewind(armv2_t *cpu, uint64_t cycle);
+void armv2_free_snapshot(armv2_snapshot_t *snapshot);
+void release_snapshots(armv2_t *cpu);
+enum armv2_status prepare_page_write(armv2_t *cpu, uint32_t page_num);
+void armv2_raise_pins(armv2_t *cpu, uint32_t pins);
+void armv2_lower_pins(armv2_t *cpu, uint32_t pins);
+void WaitForInterrupt(armv2_t *cpu);
+void armv2_raise_line(armv2_t *cpu, uint32_t line);
+void armv2_lower_line(armv2_t *cpu, uint32_t line);
+void RaisePins(armv2_t *cpu, uint32_t pins);
+void LowerPins(armv2_t *cpu, uint32_t pins);
+void RaiseLine(armv2_t *cpu, uint32_t line);
+void LowerLine(armv2_t *cpu, uint32_t line);
+void ResetInterruptController(armv2_t *cpu);
+void armv2_init_event(armv2_event_t *event, event_callback_t callback, void *extra);
+void armv2_schedule(armv2_t *cpu, armv2_event_t *event, uint64_t delay);
+void armv2_cancel(armv2_t *cpu, armv2_event_t *event);
+uint64_t NextDeadline(armv2_t *cpu);
+void AdvanceEvents(armv2_t *cpu, uint64_t cycles);
+void RewindEvents(armv2_t *cpu, uint64_t cycles);
+enum armv2_status add_timer(armv2_t *cpu);
+enum armv2_status armv2_executor_create(armv2_executor_t **out, uint32_t num_workers);
+void armv2_executor_destroy(armv2_executor_t *executor);
+enum armv2_status armv2_submit(armv2_executor_t *executor, armv2_job_t *job, armv2_t *cpu, int32_t instructions);
+enum armv2_status armv2_await(armv2_job_t *job);
+void ExecutorWake(armv2_t *cpu);
+enum armv2_status armv2_run_batch(armv2_t **cpus, uint32_t count, int32_t instructions, enum armv2_status *results);
+enum armv2_status armv2_record(armv2_t *cpu, const char *filename);
+enum armv2_status armv2_replay(armv2_t *cpu, const char *filename);
+enum armv2_status armv2_stop_replay(armv2_t *cpu);
+uint32_t ReplayRead(armv2_t *cpu, page_info_t *page, access_callback_t callback, uint32_t addr, uint32_t kind);
+void ReplayReadBlock(armv2_t *cpu, page_info_t *page, uint32_t addr, uint32_t count, uint32_t *buffer);
+void ReplayInput(armv2_t *cpu, uint32_t kind, uint32_t value);
+void RecordInputs(armv2_t *cpu);
+void ReplayPosition(armv2_t *cpu, replay_position_t *position);
+enum armv2_status ReplayPrepareRewind(armv2_t *cpu, const replay_position_t *position);
+void ReplayRewind(armv2_t *cpu, const replay_position_t *position, uint64_t live);
+uint32_t query_dirty(armv2_t *cpu, uint32_t start_page, uint32_t num_pages, uint64_t *out, uint32_t clear);
+enum armv2_status SnapshotPage(armv2_t *cpu, page_info_t *page);
 enum armv2_status map_memory(armv2_t *cpu, uint32_t device_num, uint32_t start, uint32_t end);
 enum armv2_status add_mapping(hardware_mapping_t **head, hardware_mapping_t *item);
+enum armv2_status invalidate_instruction(armv2_t *cpu, uint32_t addr);
+void invalidate_page(armv2_t *cpu, uint32_t page_num);
+enum armv2_status interpret_armv2(armv2_t *cpu, int32_t instructions);
+enum armv2_status take_exception(armv2_t *cpu, enum armv2_exception exception, int32_t *instructions);
+enum armv2_status allocate_decoded(armv2_t *cpu, uint32_t page_num);
+enum armv2_status set_page(armv2_t *cpu, uint32_t page_num, page_info_t *page);
+page_info_t *FillRamPage(armv2_t *cpu, uint32_t page_num);
+void flush_tlb(armv2_t *cpu);
+void flush_tlb_page(armv2_t *cpu, uint32_t page_num);
+uint32_t *TlbFill(armv2_t *cpu, uint32_t addr, uint32_t write);
+void DecodeInstruction(decoded_instruction_t *decoded, uint32_t instruction);
+void ResolveFlags(armv2_t *cpu);
+void SwapBanks(armv2_t *cpu, uint32_t old_mode, uint32_t new_mode);
+
+#ifdef ARMV2_THREADED
+enum armv2_status threaded_armv2(armv2_t *cpu, int32_t instructions);
+#endif
+
+#ifdef ARMV2_JIT
+enum armv2_status jit_run_armv2(armv2_t *cpu, int32_t instructions);
+void jit_invalidate(armv2_t *cpu, uint32_t addr);
+void jit_cleanup(armv2_t *cpu);
+#endif
+
+//The three ways a data processing instruction can get its second operand
+#define ALU_FORM_IMMEDIATE      0 //rotated 8 bit immediate
+#define ALU_FORM_SHIFT          1 //register shifted by an immediate amount
+#define ALU_FORM_REGISTER_SHIFT 2 //register shifted by an amount in another register
+#define ALU_FORM_MAX            3
+#define ALU_FORM(instruction) (((instruction)&0x02000000) ? ALU_FORM_IMMEDIATE : \
+                               (((instruction)&0x10) ? ALU_FORM_REGISTER_SHIFT : ALU_FORM_SHIFT))
 
 //instruction handlers
 enum armv2_exception ALUInstruction                         (armv2_t *cpu,uint32_t instruction);
@@ -194,10 +578,183 @@ enum armv2_exception CoprocessorDataTransferInstruction     (armv2_t *cpu,uint32
 enum armv2_exception CoprocessorRegisterTransferInstruction (armv2_t *cpu,uint32_t instruction);
 enum armv2_exception CoprocessorDataOperationInstruction    (armv2_t *cpu,uint32_t instruction);
 
+//specialised data processing handlers, indexed by [opcode][form][S bit][rd == PC]
+extern const instruction_handler_t alu_handlers[16][ALU_FORM_MAX][2][2];
+
+extern page_info_t *empty_page_table[PAGE_TABLE_SIZE];
+
+//These are shared by the interpreter cores, and small enough that we want them inlined into each
+
+//The page_info for page_num (which must be less than NUM_PAGE_TABLES), or NULL if it's not mapped. RAM pages
+//only go in the page table the first time they're looked up, so init doesn't have to touch all of them
+static inline page_info_t *GetPage(armv2_t *cpu, uint32_t page_num) {
+    page_info_t *page = cpu->page_directory[page_num>>PAGE_TABLE_BITS][page_num&(PAGE_TABLE_SIZE-1)];
+    if(__builtin_expect(NULL == page,0) && page_num < (cpu->physical_ram_size>>PAGE_SIZE_BITS)) {
+        return FillRamPage(cpu,page_num);
+    }
+    return page;
+}
+
+static inline void MarkDirty(armv2_t *cpu, uint32_t page_num) {
+    cpu->dirty[page_num>>6] |= ((uint64_t)1)<<(page_num&63);
+}
+
+static inline uint32_t PageDirty(armv2_t *cpu, uint32_t page_num) {
+    return (cpu->dirty[page_num>>6]>>(page_num&63))&1;
+}
+
+//Enter FIQ or IRQ mode if one is pending and not masked. Returns 1 if an interrupt was taken
+static inline int TakeInterrupt(armv2_t *cpu) {
+    uint32_t saved_pc;
+    if(FLAG_CLEAR(cpu,F) && PIN_ON(cpu,F)) {
+        //crumbs, time to do an FIQ!
+        RESOLVE_FLAGS(cpu);
+        IDLE_RESET(cpu);
+        cpu->flags &= ~FLAG_HALTED;
+        saved_pc = cpu->regs.actual[PC];
+        SWITCHMODE(cpu,MODE_FIQ);
+        cpu->regs.actual[LR] = saved_pc;
+        SETFLAG(cpu,F);
+        SETFLAG(cpu,I);
+        cpu->pc = 0x1c-4;
+        return 1;
+    }
+    if(FLAG_CLEAR(cpu,I) && PIN_ON(cpu,I)) {
+        RESOLVE_FLAGS(cpu);
+        IDLE_RESET(cpu);
+        cpu->flags &= ~FLAG_HALTED;
+        saved_pc = cpu->regs.actual[PC];
+        //set the mode to IRQ mode, and then the new LR
+        SWITCHMODE(cpu,MODE_IRQ);
+        cpu->regs.actual[LR] = saved_pc;
+        //mask interrupts so they won't be taken next time.
+        SETFLAG(cpu,I);
+        cpu->pc = 0x18-4;
+        return 1;
+    }
+    return 0;
+}
+
+//Could an interrupt be taken right now?
+static inline int InterruptPending(armv2_t *cpu) {
+    uint32_t pins = PINS(cpu);
+    return ((pins&PIN_F) && FLAG_CLEAR(cpu,F)) || ((pins&PIN_I) && FLAG_CLEAR(cpu,I));
+}
+
+//Something was scheduled during the run. The cores call this in place of running the instruction at
+//cpu->pc, which we put back along with its part of the budget before stopping so that run_armv2 can
+//schedule it as of exactly here
+static inline enum armv2_status Reschedule(armv2_t *cpu, int32_t instructions) {
+    cpu->pc          = (cpu->pc-4)&0x3ffffff;
+    cpu->budget_left = instructions + 1;
+    return ARMV2STATUS_RESCHEDULE;
+}
+
+//Where the user mode version of a register is, for the LDM and STM variants that transfer those
+static inline uint32_t *UserRegister(armv2_t *cpu, uint32_t rn) {
+    uint32_t mode = GETMODE(cpu);
+    if(rn < 8 || rn == PC || mode == MODE_USR || (rn < 13 && mode != MODE_FIQ)) {
+        return &cpu->regs.actual[rn];
+    }
+    return &cpu->regs.actual[R8_U+(rn-8)];
+}
+
+//Find the decoded form of the instruction at cpu->pc, decoding it first if need be. Returns
+//ARMV2STATUS_INVALID_PAGE if there's nothing there to execute
+static inline enum armv2_status FetchInstruction(armv2_t *cpu, decoded_instruction_t **out) {
+    page_info_t *page = GetPage(cpu,PAGEOF(cpu->pc));
+    if(NULL == page || NULL == page->memory) {
+        return ARMV2STATUS_INVALID_PAGE;
+    }
+    if(NULL == page->decoded) {
+        //First time we've executed from this page
+        enum armv2_status result = allocate_decoded(cpu,PAGEOF(cpu->pc));
+        if(ARMV2STATUS_OK != result) {
+            return result;
+        }
+    }
+    decoded_instruction_t *decoded = &page->decoded[WORDINPAGE(cpu->pc)];
+    if(NULL == decoded->handler) {
+        DecodeInstruction(decoded,page->memory[WORDINPAGE(cpu->pc)]);
+    }
+    *out = decoded;
+    return ARMV2STATUS_OK;
+}
+
+//Where in host memory a load from (or store to) addr can go, or NULL if it has to take the slow path
+//through the page tables
+static inline uint32_t *TlbRead(armv2_t *cpu, uint32_t addr) {
+    tlb_entry_t *entry = &cpu->tlb[PAGEOF(addr)&(TLB_SIZE-1)];
+    if(entry->read_tag == PAGEOF(addr)) {
+        return &entry->memory[WORDINPAGE(addr)];
+    }
+    return TlbFill(cpu,addr,0);
+}
+
+static inline uint32_t *TlbWrite(armv2_t *cpu, uint32_t addr) {
+    tlb_entry_t *entry = &cpu->tlb[PAGEOF(addr)&(TLB_SIZE-1)];
+    if(entry->write_tag == PAGEOF(addr)) {
+        return &entry->memory[WORDINPAGE(addr)];
+    }
+    return TlbFill(cpu,addr,1);
+}
+
+//The cores access devices through these, so that what the devices give the cpu can be recorded, and
+//replayed without calling them at all
+static inline uint32_t DeviceRead(armv2_t *cpu, page_info_t *page, access_callback_t callback, uint32_t addr, uint32_t kind) {
+    if(cpu->flags&(FLAG_RECORDING|FLAG_REPLAYING)) {
+        return ReplayRead(cpu,page,callback,addr,kind);
+    }
+    return callback(page->mapped_device,addr,0);
+}
+
+static inline void DeviceWrite(armv2_t *cpu, page_info_t *page, access_callback_t callback, uint32_t addr, uint32_t value) {
+    if(!(cpu->flags&FLAG_REPLAYING)) {
+        callback(page->mapped_device,addr,value);
+    }
+}
+
+static inline void DeviceReadBlock(armv2_t *cpu, page_info_t *page, uint32_t addr, uint32_t count, uint32_t *buffer) {
+    if(cpu->flags&(FLAG_RECORDING|FLAG_REPLAYING)) {
+        ReplayReadBlock(cpu,page,addr,count,buffer);
+        return;
+    }
+    page->read_block_callback(page->mapped_device,addr,count,buffer);
+}
+
+static inline void DeviceWriteBlock(armv2_t *cpu, page_info_t *page, uint32_t addr, uint32_t count, uint32_t *buffer) {
+    if(!(cpu->flags&FLAG_REPLAYING)) {
+        page->write_block_callback(page->mapped_device,addr,count,buffer);
+    }
+}
+
 #define COPROCESSOR_HW_MANAGER (1)
 #define COPROCESSOR_MMU        (2)
 #define COPROCESSOR_INTERRUPT_CONTROLLER (3)
 
+typedef enum {
+    INTERRUPT_WAIT = 0, //CDP p3,0: halt until an interrupt can be taken
+} interrupt_controller_opcode_t;
+
+//MRC/MCR p3,opcode,rd,crn
+typedef enum {
+    INTERRUPT_REGISTER = 0, //move to or from controller register crn
+    INTERRUPT_VECTOR   = 1, //MRC only: the vector of the line to service next, or the default vector if none
+    INTERRUPT_NEXT     = 2, //MRC only: the number of the line to service next, or INTERRUPT_NONE
+} interrupt_register_opcode_t;
+
+typedef enum {
+    INTERRUPT_PENDING_LO     = 0, //lines 0-31 that are up, read only
+    INTERRUPT_PENDING_HI     = 1, //lines 32-63
+    INTERRUPT_ENABLE_LO      = 2, //lines 0-31 that can raise IRQ
+    INTERRUPT_ENABLE_HI      = 3, //lines 32-63
+    INTERRUPT_SELECT         = 4, //the line that INTERRUPT_PRIORITY and INTERRUPT_LINE_VECTOR refer to
+    INTERRUPT_PRIORITY       = 5, //of the selected line
+    INTERRUPT_LINE_VECTOR    = 6, //of the selected line
+    INTERRUPT_DEFAULT_VECTOR = 7,
+    INTERRUPT_NUMREGS,
+} interrupt_controller_register_t;
+
 typedef enum armv2_status (*coprocessor_data_operation_t)(armv2_t*,uint32_t,uint32_t,uint32_t,uint32_t,uint32_t);
 
 enum armv2_status HwManagerDataOperation       (armv2_t *cpu, uint32_t crm, uint32_t aux, uint32_t crd, uint32_t crn, uint32_t opcode);
@@ -211,5 +768,70 @@ enum armv2_status InterruptControllerTransfer  (armv2_t *cpu, uint32_t crm, uint
 
 void flog(char* fmt, ...);
 
-//#define LOG(...) printf(__VA_ARGS__)
-#define LOG(...) flog(__VA_ARGS__)
+//Logging is chosen at compile time (make LOG_LEVEL=n) so that the levels we aren't building cost nothing,
+//not even the evaluation of their arguments. Errors are rare and go straight to the text log, everything
+//else is recorded into the binary trace ring below and only formatted when someone drains it
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef ARMV2_LOG_LEVEL
+#define ARMV2_LOG_LEVEL LOG_LEVEL_ERROR
+#endif
+
+#if ARMV2_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) flog(__VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while(0)
+#endif
+
+#if ARMV2_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) TRACE(__VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while(0)
+#endif
+
+#if ARMV2_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) TRACE(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while(0)
+#endif
+
+//The trace ring is a fixed array of fixed size records that any number of threads can write to without
+//locking. A writer claims a slot by bumping the head and publishes it by storing the slot's sequence
+//number last, so a reader can tell a finished record from one that's being written or was overwritten.
+//When the ring is full the oldest records are lost rather than the writer waiting
+#define TRACE_RING_BITS 12
+#define TRACE_RING_SIZE (1<<TRACE_RING_BITS)
+#define TRACE_RING_MASK (TRACE_RING_SIZE-1)
+#define TRACE_MAX_ARGS  5
+
+typedef struct trace_record {
+    uint64_t    sequence; //position in the stream plus one, 0 while the record is being written
+    const char *fmt;      //must be a string literal as it's only read when the record is formatted
+    uint32_t    num_args;
+    uint32_t    pad;
+    uint64_t    args[TRACE_MAX_ARGS];
+} trace_record_t;
+
+void     trace_record(const char *fmt, uint32_t num_args, uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e);
+uint32_t trace_drain(trace_record_t *out, uint32_t max);
+uint64_t trace_dropped(void);
+int      trace_format(const trace_record_t *record, char *buffer, size_t size);
+void     trace_dump(FILE *f);
+
+//TRACE(fmt,...) takes a format string and up to TRACE_MAX_ARGS integer or pointer arguments. Pointer
+//arguments for %s must outlive the ring, __func__ is fine
+#define TRACE_ARG(x) ((uint64_t)(uintptr_t)(x))
+#define TRACE_NARGS(...) TRACE_NARGS_(__VA_ARGS__,5,4,3,2,1,0,-1)
+#define TRACE_NARGS_(fmt,a,b,c,d,e,n,...) n
+#define TRACE_CAT_(a,b) a##b
+#define TRACE_CAT(a,b) TRACE_CAT_(a,b)
+#define TRACE_0(fmt)             trace_record(fmt,0,0,0,0,0,0)
+#define TRACE_1(fmt,a)           trace_record(fmt,1,TRACE_ARG(a),0,0,0,0)
+#define TRACE_2(fmt,a,b)         trace_record(fmt,2,TRACE_ARG(a),TRACE_ARG(b),0,0,0)
+#define TRACE_3(fmt,a,b,c)       trace_record(fmt,3,TRACE_ARG(a),TRACE_ARG(b),TRACE_ARG(c),0,0)
+#define TRACE_4(fmt,a,b,c,d)     trace_record(fmt,4,TRACE_ARG(a),TRACE_ARG(b),TRACE_ARG(c),TRACE_ARG(d),0)
+#define TRACE_5(fmt,a,b,c,d,e)   trace_record(fmt,5,TRACE_ARG(a),TRACE_ARG(b),TRACE_ARG(c),TRACE_ARG(d),TRACE_ARG(e))
+#define TRACE(...) TRACE_CAT(TRACE_,TRACE_NARGS(__VA_ARGS__))(__VA_ARGS__)
@@ -1,7 +1,9 @@
 cimport carmv2
-from libc.stdint cimport uint32_t, int64_t
-from libc.stdlib cimport malloc, free
+from libc.stdint cimport uint32_t, int32_t, int64_t, uint64_t
+from libc.stdlib cimport malloc, calloc, free
+from cpython.buffer cimport PyBuffer_FillInfo
 import itertools
+import struct
 import threading
 import thread
 
@@ -21,6 +23,15 @@ class CpuExceptions:
     Fiq                  = carmv2.EXCEPT_FIQ
     Breakpoint           = carmv2.EXCEPT_BREAKPOINT
 
+class Pins:
+    Fiq = carmv2.PIN_F
+    Irq = carmv2.PIN_I
+
+class Timer:
+    Id       = carmv2.TIMER_DEVICE_ID
+    Interval = carmv2.TIMER_INTERVAL
+    Ticks    = carmv2.TIMER_TICKS
+
 class Status:
     Ok              = carmv2.ARMV2STATUS_OK
     InvalidCpuState = carmv2.ARMV2STATUS_INVALID_CPUSTATE
@@ -84,6 +95,14 @@ class Registers(object):
     def __repr__(self):
         return repr(self[:])
 
+def RamView(cpu,start,end):
+    #A view of guest memory from start up to end if it's all RAM we can go to directly, otherwise None and
+    #it has to go through the cpu a byte or word at a time
+    try:
+        return cpu.MemoryView(start,end)
+    except (AccessError,IndexError):
+        return None
+
 class ByteMemory(object):
     def __init__(self,cpu):
         self.cpu    = cpu
@@ -92,16 +111,28 @@ class ByteMemory(object):
 
     def __getitem__(self,index):
         if isinstance(index,slice):
-            indices = index.indices(MAX_26BIT)
-            indices = xrange(*indices)
+            start,stop,step = index.indices(MAX_26BIT)
+            view = RamView(self.cpu,start,stop) if step == 1 else None
+            if view is not None:
+                #All in RAM so we can copy it straight out
+                return view.tobytes()
+            indices = xrange(start,stop,step)
         else:
             indices = (index,)
         return ''.join(chr(self.getter(index)) for index in indices)
 
     def __setitem__(self,index,values):
         if isinstance(index,slice):
-            indices = index.indices(MAX_26BIT)
-            indices = xrange(*indices)
+            start,stop,step = index.indices(MAX_26BIT)
+            view = RamView(self.cpu,start,stop) if step == 1 and isinstance(values,str) else None
+            if view is not None:
+                if len(values) != len(view):
+                    raise ValueError('Wrong values sequence length')
+                self.cpu.PrepareWrite(start,stop)
+                view[:] = values
+                self.cpu.Invalidate(start,stop)
+                return
+            indices = xrange(start,stop,step)
         else:
             indices = (index,)
             values  = (values,)
@@ -122,8 +153,13 @@ class WordMemory(object):
 
     def __getitem__(self,index):
         if isinstance(index,slice):
-            indices = index.indices(MAX_26BIT)
-            indices = xrange(*indices)
+            start,stop,step = index.indices(MAX_26BIT)
+            count = len(xrange(start,stop,step))
+            view = RamView(self.cpu,start,start+count*4) if step == 4 and (start&3) == 0 else None
+            if view is not None:
+                #All aligned words in RAM so we can unpack them in one go
+                return list(struct.unpack('<%dI' % count,view.tobytes()))
+            indices = xrange(start,stop,step)
         else:
             indices = (index,)
         if len(indices) == 1:
@@ -148,8 +184,49 @@ class WordMemory(object):
         return MAX_26BIT>>2
 
 
-#cdef void readCallback(void *device,uint32_t addr, uint32_t value):
+cdef class MemoryRegion:
+    """A run of guest RAM that's contiguous in host memory, exported through the buffer protocol.
+
+    Wrap it in a memoryview (or hand it to numpy.frombuffer, struct.unpack_from, pygame and so on) to read
+    and write guest memory in bulk without a python call per byte or word. It's little endian, like the
+    guest. Writes go straight to RAM, so call Armv2.Invalidate on anything written that might be code, and
+    Armv2.PrepareWrite before writing if there are snapshots. The region keeps the cpu alive for as long as
+    it's around."""
+    cdef object owner
+    cdef char *data
+    cdef Py_ssize_t size
+    cdef readonly uint32_t start
 
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        PyBuffer_FillInfo(buffer, self, self.data, self.size, 0, flags)
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+    def __len__(self):
+        return self.size
+
+cdef MemoryRegion NewMemoryRegion(object owner, char *data, Py_ssize_t size, uint32_t start):
+    cdef MemoryRegion region = MemoryRegion.__new__(MemoryRegion)
+    region.owner = owner
+    region.data  = data
+    region.size  = size
+    region.start = start
+    return region
+
+#Mapped pages of python devices call these with the Device as extra. Native devices from LoadDevice don't
+#come anywhere near here or the GIL
+cdef uint32_t DeviceRead(void *extra, uint32_t addr, uint32_t value) noexcept with gil:
+    device = <object>extra
+    if device.readCallback:
+        return device.readCallback(addr,value)
+    return 0
+
+cdef uint32_t DeviceWrite(void *extra, uint32_t addr, uint32_t value) noexcept with gil:
+    device = <object>extra
+    if device.writeCallback:
+        return device.writeCallback(addr,value)
+    return 0
 
 cdef class Device:
     id            = None
@@ -158,29 +235,12 @@ cdef class Device:
     cdef carmv2.hardware_device_t *cdevice
 
     def __cinit__(self, *args, **kwargs):
-        self.cdevice = <carmv2.hardware_device_t*>malloc(sizeof(carmv2.hardware_device_t))
-        self.cdevice.device_id = self.id
-        self.cdevice.read_callback = <carmv2.access_callback_t>self.read;
-        self.cdevice.write_callback = <carmv2.access_callback_t>self.write;
+        self.cdevice = <carmv2.hardware_device_t*>calloc(1,sizeof(carmv2.hardware_device_t))
         if self.cdevice == NULL:
             raise MemoryError()
-
-    cdef uint32_t read(self,uint32_t addr, uint32_t value) nogil:
-        with gil:
-            with open('/tmp/xxx.bin','wb') as f:
-                f.write(str(type(self)) + '\n' + str(self.readCallback))
-            if self.readCallback:
-                return self.readCallback(addr,value)
-            return 0
-
-    cdef uint32_t write(self,uint32_t addr, uint32_t value) nogil:
-        with gil:
-            with open('/tmp/yyy.bin','wb') as f:
-                f.write(str(type(self)) + '\n' + str(self.writeCallback) + '\n' + str(addr) + ',' + str(value) + '\n')
-            if self.writeCallback:
-                return self.writeCallback(int(addr),int(value))
-
-            return 0
+        self.cdevice.device_id = self.id
+        self.cdevice.read_callback = DeviceRead
+        self.cdevice.write_callback = DeviceWrite
 
     def __dealloc__(self):
         if self.cdevice != NULL:
@@ -196,6 +256,38 @@ cdef class Device:
     cdef carmv2.hardware_device_t *GetDevice(self):
         return self.cdevice
 
+cdef CheckRestore(carmv2.armv2_status result):
+    if result == carmv2.ARMV2STATUS_INVALID_ARGS:
+        raise ValueError('Snapshot is no longer valid')
+    if result == carmv2.ARMV2STATUS_INVALID_CPUSTATE:
+        raise ValueError('Snapshot is from before the recording started')
+    if result == carmv2.ARMV2STATUS_IO_ERROR:
+        raise IOError()
+    if result != carmv2.ARMV2STATUS_OK:
+        raise MemoryError()
+
+cdef class Snapshot:
+    """The state of an Armv2 at some point, from Armv2.Snapshot. Pass it to Armv2.Restore to go back there.
+
+    Restoring a snapshot invalidates any taken after it. The snapshot keeps the cpu alive for as long as
+    it's around, and is freed with it."""
+    cdef carmv2.armv2_snapshot_t *snapshot
+    cdef object cpu
+
+    def __dealloc__(self):
+        if self.snapshot != NULL:
+            carmv2.armv2_free_snapshot(self.snapshot)
+            self.snapshot = NULL
+
+class NativeDevice(object):
+    """A device loaded from a shared object by Armv2.LoadDevice. Guest accesses to it are handled entirely in C.
+    Set notify to a callable to be called from FrameDevices whenever the device's frame function asks for it"""
+    def __init__(self,index,id,name):
+        self.index  = index
+        self.id     = id
+        self.name   = name
+        self.notify = None
+
 cdef class Armv2:
     cdef carmv2.armv2_t *cpu
     cdef public regs
@@ -203,6 +295,8 @@ cdef class Armv2:
     cdef public memw
     cdef public memsize
     cdef public hardware
+    cdef public physical
+    cdef public dirty
 
     def __cinit__(self, *args, **kwargs):
         self.cpu = <carmv2.armv2_t*>malloc(sizeof(carmv2.armv2_t))
@@ -218,13 +312,17 @@ cdef class Armv2:
     def getregs(self,index):
         if index >= NUM_EFFECTIVE_REGS:
             raise IndexError()
-        return int(self.cpu.regs.effective[index][0])
+        return int(self.cpu.regs.actual[index])
 
     def setregs(self,index,value):
         if index >= NUM_EFFECTIVE_REGS:
             raise IndexError()
-        self.cpu.regs.effective[index][0] = value
+        cdef uint32_t old_mode = self.cpu.regs.actual[carmv2.PC]&3
+        self.cpu.regs.actual[index] = value
         if index == carmv2.PC:
+            #A new mode means a different set of banked registers
+            if (value&3) != old_mode:
+                carmv2.SwapBanks(self.cpu,old_mode,value&3)
             self.cpu.pc = int((0xfffffffc + (value&0x3ffffffc))&0xffffffff)
 
     def getbyte(self,addr):
@@ -243,10 +341,15 @@ cdef class Armv2:
         if addr >= MAX_26BIT:
             raise IndexError()
 
-        cdef carmv2.page_info_t *page = self.cpu.page_tables[PAGEOF(addr)]
+        cdef carmv2.page_info_t *page = carmv2.GetPage(self.cpu,PAGEOF(addr))
         if NULL == page:
             #raise AccessError()
             return 0
+        if NULL != page.read_callback:
+            #There's a device mapped here, so ask it like the cpu would
+            return page.read_callback(page.mapped_device,INPAGE(addr),0)
+        if NULL == page.memory:
+            return 0
 
         return page.memory[WORDINPAGE(addr)]
 
@@ -254,11 +357,116 @@ cdef class Armv2:
         if addr >= MAX_26BIT:
             raise IndexError()
 
-        cdef carmv2.page_info_t *page = self.cpu.page_tables[PAGEOF(addr)]
+        cdef carmv2.page_info_t *page = carmv2.GetPage(self.cpu,PAGEOF(addr))
         if NULL == page:
             raise AccessError()
+        if NULL != page.write_callback:
+            page.write_callback(page.mapped_device,INPAGE(addr),int(value))
+            return
+        if NULL == page.memory:
+            raise AccessError()
 
+        if carmv2.prepare_page_write(self.cpu,PAGEOF(addr)) != carmv2.ARMV2STATUS_OK:
+            raise MemoryError()
         page.memory[WORDINPAGE(addr)] = int(value)
+        #The debugger patches breakpoints in this way, so make sure the cpu sees the new instruction
+        carmv2.invalidate_instruction(self.cpu,addr)
+
+    def Snapshot(self):
+        """Capture the registers, RAM and device mappings. Memory isn't copied until it's next written"""
+        cdef carmv2.armv2_status result
+        cdef carmv2.armv2_snapshot_t *csnapshot = NULL
+        cdef Snapshot snapshot
+        result = carmv2.armv2_snapshot(self.cpu,&csnapshot)
+        if result != carmv2.ARMV2STATUS_OK:
+            raise MemoryError()
+        snapshot = Snapshot.__new__(Snapshot)
+        snapshot.snapshot = csnapshot
+        snapshot.cpu = self
+        return snapshot
+
+    def Restore(self,Snapshot snapshot):
+        """Put the cpu back to how it was when snapshot was taken, copying back only the pages written since.
+        The cycle count goes back too, and while recording the cpu replays the recording from there until it's
+        caught up with where it was"""
+        cdef carmv2.armv2_status result
+        if snapshot.cpu is not self:
+            raise ValueError()
+        with nogil:
+            result = carmv2.armv2_restore(self.cpu,snapshot.snapshot)
+        CheckRestore(result)
+
+    def Rewind(self,cycle):
+        """Restore the newest snapshot taken at or before cycle. Step(cycle - cycles) then gets the cpu back
+        to exactly where it was at cycle, stopping at any breakpoints on the way, as long as the devices give
+        it the same things, which recording makes sure of"""
+        cdef carmv2.armv2_status result
+        cdef uint64_t value = cycle
+        with nogil:
+            result = carmv2.armv2_rewind(self.cpu,value)
+        if result == carmv2.ARMV2STATUS_VALUE_ERROR:
+            raise ValueError('No snapshot from that far back')
+        CheckRestore(result)
+
+    def DirtyPages(self,start = 0,end = MAX_26BIT,clear = True):
+        """The dirty bits for the pages from start up to end as a bytearray, bit n being the page n after
+        the one start is in, laid out like the dirty attribute. They're cleared unless clear is False"""
+        cdef uint32_t start_page
+        cdef uint32_t num_pages
+        cdef uint64_t *bits
+        if end <= start or end > MAX_26BIT:
+            raise IndexError()
+        start_page = PAGEOF(start)
+        num_pages  = PAGEOF(end-1) + 1 - start_page
+        bits = <uint64_t*>malloc(((num_pages+63)//64)*8)
+        if bits == NULL:
+            raise MemoryError()
+        try:
+            carmv2.query_dirty(self.cpu,start_page,num_pages,bits,1 if clear else 0)
+            return bytearray((<char*>bits)[:(num_pages+7)//8])
+        finally:
+            free(bits)
+
+    def PrepareWrite(self,start,end):
+        """Call before writing to guest memory from start up to end through a view, so snapshots and dirty
+        tracking still work"""
+        cdef uint32_t page_num
+        if end <= start:
+            return
+        for page_num in xrange(PAGEOF(start),PAGEOF(min(end,MAX_26BIT)-1)+1):
+            if carmv2.prepare_page_write(self.cpu,page_num) != carmv2.ARMV2STATUS_OK:
+                raise MemoryError()
+
+    def MemoryView(self,start,end):
+        """A writable memoryview of guest memory from start up to end.
+
+        The whole range has to be backed by RAM that's contiguous in host memory, with no device mapped over
+        it, otherwise AccessError is raised. Use the physical attribute for a view of all of physical RAM,
+        including what's underneath any devices."""
+        cdef uint32_t page_num
+        cdef carmv2.page_info_t *page
+        cdef uint32_t *expected = NULL
+        cdef uint32_t *first = NULL
+        if start < 0 or end > MAX_26BIT or end <= start:
+            raise IndexError()
+        for page_num in xrange(PAGEOF(start),PAGEOF(end-1)+1):
+            page = carmv2.GetPage(self.cpu,page_num)
+            if NULL == page or NULL == page.memory or NULL != page.read_callback or NULL != page.write_callback:
+                raise AccessError()
+            if NULL == first:
+                first = page.memory
+            elif page.memory != expected:
+                raise AccessError()
+            expected = page.memory + carmv2.WORDS_PER_PAGE
+        return memoryview(NewMemoryRegion(self,(<char*>first) + <uint32_t>INPAGE(start),end-start,start))
+
+    def Invalidate(self,start,end):
+        """Throw away anything the cpu has decoded from start up to end, after writing code through a view"""
+        cdef uint32_t page_num
+        if end <= start:
+            return
+        for page_num in xrange(PAGEOF(start),PAGEOF(min(end,MAX_26BIT)-1)+1):
+            carmv2.invalidate_page(self.cpu,page_num)
 
     @property
     def pc(self):
@@ -270,6 +478,16 @@ cdef class Armv2:
     def mode(self):
         return self.regs.pc&3
 
+    @property
+    def cycles(self):
+        """How many instructions have run since the cpu was created, including the ones skipped while idle"""
+        return self.cpu.cycles
+
+    @property
+    def idle_skipped(self):
+        """How many instructions Step has skipped over because the guest was spinning waiting for an interrupt"""
+        return self.cpu.idle_skipped
+
     def __init__(self,size,filename = None):
         cdef carmv2.armv2_status result
         cdef uint32_t mem = size
@@ -281,6 +499,10 @@ cdef class Armv2:
         self.hardware = []
         if result != carmv2.ARMV2STATUS_OK:
             raise ValueError()
+        self.physical = memoryview(NewMemoryRegion(self,<char*>self.cpu.physical_ram,self.cpu.physical_ram_size,0))
+        #The live dirty bitmap, one bit per page with page n in bit n%8 of byte n/8. numpy.unpackbits with
+        #bitorder='little' turns it into one entry per page. Use DirtyPages to clear it
+        self.dirty = memoryview(NewMemoryRegion(self,<char*>self.cpu.dirty,carmv2.DIRTY_WORDS*8,0))
         if filename != None:
             self.LoadROM(filename)
 
@@ -289,6 +511,13 @@ cdef class Armv2:
         if result != carmv2.ARMV2STATUS_OK:
             raise ValueError()
 
+    def LoadSharedROM(self,filename):
+        """As LoadROM, but every cpu that loads the same file shares one copy of it, and of what's been
+        decoded from it, until they write to it"""
+        result = carmv2.load_shared_rom(self.cpu,filename)
+        if result != carmv2.ARMV2STATUS_OK:
+            raise ValueError()
+
     def Step(self,number = None):
         cdef uint32_t result
         cdef carmv2.armv2_t *cpu = self.cpu
@@ -307,6 +536,189 @@ cdef class Armv2:
             raise ValueError
         self.hardware.append(device)
 
+    def LoadDevice(self,filename,args = None):
+        """Load a native device plugin and add it to the cpu, returning a NativeDevice for it"""
+        cdef carmv2.armv2_status result
+        cdef carmv2.hardware_device_t *cdevice
+        cdef const char *c_args = NULL
+        if args != None:
+            c_args = args
+        result = carmv2.load_device(self.cpu,filename,c_args)
+        if result != carmv2.ARMV2STATUS_OK:
+            raise ValueError()
+        index   = self.cpu.num_hardware_devices - 1
+        cdevice = self.cpu.hardware_devices[index]
+        name    = cdevice.plugin.name if cdevice.plugin.name != NULL else filename
+        device  = NativeDevice(index,cdevice.device_id,name)
+        self.hardware.append(device)
+        return device
+
+    def AddTimer(self):
+        """Add the built in interval timer, returning a NativeDevice for it. The guest maps it like any other
+        device, see Timer for its registers"""
+        cdef carmv2.armv2_status result
+        result = carmv2.add_timer(self.cpu)
+        if result != carmv2.ARMV2STATUS_OK:
+            raise ValueError()
+        index  = self.cpu.num_hardware_devices - 1
+        device = NativeDevice(index,carmv2.TIMER_DEVICE_ID,'timer')
+        self.hardware.append(device)
+        return device
+
+    def RaiseInterrupt(self,pins):
+        """Raise the given Pins. This is safe to call from any thread while Step is running, and wakes the guest
+        if it's halted waiting for an interrupt"""
+        cdef uint32_t value = pins
+        with nogil:
+            carmv2.armv2_raise_pins(self.cpu,value)
+
+    def LowerInterrupt(self,pins):
+        cdef uint32_t value = pins
+        with nogil:
+            carmv2.armv2_lower_pins(self.cpu,value)
+
+    def RaiseLine(self,line):
+        """Raise the interrupt controller line of the hardware device with index line. Like RaiseInterrupt this
+        can be called from any thread"""
+        cdef uint32_t value = line
+        with nogil:
+            carmv2.armv2_raise_line(self.cpu,value)
+
+    def LowerLine(self,line):
+        cdef uint32_t value = line
+        with nogil:
+            carmv2.armv2_lower_line(self.cpu,value)
+
+    def Record(self,filename):
+        """Save everything the devices give the cpu from now on to filename, until StopReplay. Run the same
+        recording through Replay on a cpu in the same state, with the same devices mapped, and it runs the same
+        way without the devices being called"""
+        result = carmv2.armv2_record(self.cpu,filename)
+        if result == carmv2.ARMV2STATUS_IO_ERROR:
+            raise IOError()
+        if result != carmv2.ARMV2STATUS_OK:
+            raise ValueError()
+
+    def Replay(self,filename):
+        """Take the values of device reads and the changes to pins and lines from a recording made by Record,
+        rather than from the devices, until StopReplay"""
+        result = carmv2.armv2_replay(self.cpu,filename)
+        if result == carmv2.ARMV2STATUS_IO_ERROR:
+            raise IOError()
+        if result != carmv2.ARMV2STATUS_OK:
+            raise ValueError()
+
+    def StopReplay(self):
+        """Finish recording or replaying"""
+        result = carmv2.armv2_stop_replay(self.cpu)
+        if result == carmv2.ARMV2STATUS_IO_ERROR:
+            raise IOError()
+        if result == carmv2.ARMV2STATUS_VALUE_ERROR:
+            raise ValueError('The replay went somewhere the recording did not')
+
+    def FrameDevices(self):
+        """Run the frame functions of the native devices, and pass on any notifications they ask for"""
+        cdef uint64_t notify
+        with nogil:
+            notify = carmv2.frame_devices(self.cpu)
+        if notify == 0:
+            return
+        for device in self.hardware:
+            if isinstance(device,NativeDevice) and notify&(1<<device.index) and device.notify:
+                device.notify()
+
+cdef class Job:
+    """A cpu running on an Executor, from Executor.Submit. Until it's done the cpu mustn't be touched from
+    Python other than to raise or lower its pins and lines"""
+    cdef carmv2.armv2_job_t *job
+    cdef object executor
+    cdef object cpu
+
+    def __cinit__(self, *args, **kwargs):
+        self.job = <carmv2.armv2_job_t*>calloc(1,sizeof(carmv2.armv2_job_t))
+        if self.job == NULL:
+            raise MemoryError()
+        #Until it's submitted there's nothing to wait for, and waiting says it ran fine
+        self.job.result = carmv2.ARMV2STATUS_OK
+        self.job.done   = 1
+
+    def __dealloc__(self):
+        if self.job != NULL:
+            #The executor and the cpu can't go away before us, so if it's still running we have to wait for it
+            with nogil:
+                carmv2.armv2_await(self.job)
+            free(self.job)
+            self.job = NULL
+
+    def Wait(self):
+        """Block until the job's finished, returning Status.Ok if it ran all its instructions or
+        Status.Breakpoint if it stopped at a breakpoint"""
+        cdef carmv2.armv2_status result
+        with nogil:
+            result = carmv2.armv2_await(self.job)
+        return result
+
+    property done:
+        def __get__(self):
+            return bool(self.job.done)
+
+cdef class Executor:
+    """Runs many cpus at once, sharing them out over a pool of threads, one per processor if threads is 0"""
+    cdef carmv2.armv2_executor_t *executor
+
+    def __cinit__(self, threads = 0):
+        cdef uint32_t num_workers = threads
+        cdef carmv2.armv2_status result
+        result = carmv2.armv2_executor_create(&self.executor,num_workers)
+        if result != carmv2.ARMV2STATUS_OK:
+            self.executor = NULL
+            raise MemoryError()
+
+    def __dealloc__(self):
+        if self.executor != NULL:
+            with nogil:
+                carmv2.armv2_executor_destroy(self.executor)
+            self.executor = NULL
+
+    def Submit(self,Armv2 cpu,number = None):
+        """Run the cpu for number instructions, or until it hits a breakpoint if number is None, returning a
+        Job to wait on. Unlike Armv2.Step(None), which treats breakpoints as SWIs, a job stops at them"""
+        cdef int32_t instructions = -1 if number == None else number
+        cdef carmv2.armv2_status result
+        cdef Job job = Job()
+        job.executor = self
+        job.cpu      = cpu
+        result = carmv2.armv2_submit(self.executor,job.job,cpu.cpu,instructions)
+        if result != carmv2.ARMV2STATUS_OK:
+            raise ValueError()
+        return job
+
+def RunBatch(cpus,number):
+    """Run every Armv2 in cpus for number instructions, returning a list of what Step would have returned
+    for each. Much faster than stepping them one at a time when they're running the same code"""
+    cdef uint32_t count = len(cpus)
+    cdef int32_t instructions = number
+    cdef carmv2.armv2_t **ccpus
+    cdef carmv2.armv2_status *results
+    cdef carmv2.armv2_status result
+    cdef Armv2 cpu
+    ccpus   = <carmv2.armv2_t**>malloc(count*sizeof(carmv2.armv2_t*))
+    results = <carmv2.armv2_status*>malloc(count*sizeof(carmv2.armv2_status))
+    if ccpus == NULL or results == NULL:
+        free(ccpus)
+        free(results)
+        raise MemoryError()
+    try:
+        for i,cpu in enumerate(cpus):
+            ccpus[i] = cpu.cpu
+        with nogil:
+            result = carmv2.armv2_run_batch(ccpus,count,instructions,results)
+        if result != carmv2.ARMV2STATUS_OK:
+            raise ValueError()
+        return [results[i] for i in xrange(count)]
+    finally:
+        free(ccpus)
+        free(results)
 
 debugf = None
 log_lock = threading.Lock()
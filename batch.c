@@ -0,0 +1,678 @@
+#include <string.h>
+#include "armv2.h"
+
+//Lockstep execution for batches of cpus running the same code on different data, such as one ROM run over
+//many inputs. Up to BATCH_LANES cpus at a time have their registers held across vectors, one lane per cpu,
+//and while they're at the same pc each instruction is fetched and decoded once and run on all of them
+//together: data processing, multiplies and branches with the vector extensions, loads and stores lane by
+//lane through each cpu's TLB. The condition is checked per lane, so lanes whose flags differ just don't
+//take part. A branch that goes different ways in different lanes splits them up, and we always carry on
+//with the lanes at the lowest pc, which brings the others back in when the ones behind catch up to them at
+//the end of an if or a loop. Anything else (a TLB miss, an LDM, a write to the pc, a SWI, an interrupt or an
+//event that's due) runs that instruction on each lane in turn with run_armv2, and one that idles (a wait for
+//interrupt or a branch to itself) runs on to where the slice would have ended running that cpu by itself,
+//so the end result is always the same as running each cpu by itself.
+//
+//The vectors are as wide as the target's: eight lanes with AVX2 (build with -mavx2 or -march=native),
+//four with SSE or NEON
+
+#ifdef __AVX2__
+#define BATCH_LANES 8
+#else
+#define BATCH_LANES 4
+#endif
+
+typedef uint32_t lanes_t  __attribute__((vector_size(BATCH_LANES*sizeof(uint32_t))));
+typedef int32_t  slanes_t __attribute__((vector_size(BATCH_LANES*sizeof(int32_t))));
+
+typedef struct {
+    lanes_t            regs[NUM_EFFECTIVE_REGS]; //r15 whole, with the psr and mode, and NZCV always resolved
+    armv2_t           *cpus[BATCH_LANES];
+    uint32_t           pc[BATCH_LANES];          //cpu->pc for each lane
+    int32_t            remaining[BATCH_LANES];
+    int32_t            budget[BATCH_LANES];      //how far the lane can go before something's due
+    uint32_t           executed[BATCH_LANES];    //instructions run in lockstep since it was last written back
+    uint32_t           live;                     //bit per lane that still has instructions to run
+    enum armv2_status *results;
+} batch_t;
+
+//What Lockstep stopped for
+#define LOCKSTEP_DONE     0 //ran all it was asked to, or the lanes went different ways
+#define LOCKSTEP_SLOW     1 //the next instruction has to be run a lane at a time
+
+static inline lanes_t Splat(uint32_t value) {
+    lanes_t lanes = {0};
+    return lanes + value;
+}
+
+static inline lanes_t Select(lanes_t mask, lanes_t a, lanes_t b) {
+    return (a&mask) | (b&~mask);
+}
+
+//The lanes in bits as a vector mask
+static inline lanes_t Mask(uint32_t bits) {
+    lanes_t mask = {0};
+    for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+        mask[lane] = (bits>>lane)&1 ? 0xffffffff : 0;
+    }
+    return mask;
+}
+
+static inline uint32_t Bits(lanes_t mask) {
+    uint32_t bits = 0;
+    for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+        bits |= (mask[lane]&1)<<lane;
+    }
+    return bits;
+}
+
+static void Gather(batch_t *batch, uint32_t lane) {
+    armv2_t *cpu = batch->cpus[lane];
+    uint64_t next;
+    RESOLVE_FLAGS(cpu);
+    for(uint32_t i=0;i<NUM_EFFECTIVE_REGS;i++) {
+        batch->regs[i][lane] = cpu->regs.actual[i];
+    }
+    batch->pc[lane]       = cpu->pc;
+    batch->executed[lane] = 0;
+    batch->budget[lane]   = batch->remaining[lane];
+    next = NextDeadline(cpu);
+    if(next - cpu->cycles < (uint64_t)batch->budget[lane]) {
+        batch->budget[lane] = next - cpu->cycles;
+    }
+}
+
+//Write the lane back to its cpu, and bring its clock up to date
+static void Scatter(batch_t *batch, uint32_t lane) {
+    armv2_t *cpu = batch->cpus[lane];
+    for(uint32_t i=0;i<NUM_EFFECTIVE_REGS;i++) {
+        cpu->regs.actual[i] = batch->regs[i][lane];
+    }
+    cpu->pc = batch->pc[lane];
+    //We don't watch for idle loops, so whatever it was watching is out of date
+    IDLE_RESET(cpu);
+    if(batch->executed[lane]) {
+        AdvanceEvents(cpu,batch->executed[lane]);
+        batch->executed[lane] = 0;
+    }
+}
+
+static void Finish(batch_t *batch, uint32_t lane, enum armv2_status result) {
+    batch->results[lane] = result;
+    batch->live &= ~(1<<lane);
+}
+
+//Run instructions on one lane the ordinary way
+static void ScalarStep(batch_t *batch, uint32_t lane, int32_t instructions) {
+    enum armv2_status result;
+    Scatter(batch,lane);
+    result = run_armv2(batch->cpus[lane],instructions);
+    if(ARMV2STATUS_OK != result) {
+        Finish(batch,lane,result);
+        return;
+    }
+    batch->remaining[lane] -= instructions;
+    if(0 == batch->remaining[lane]) {
+        Finish(batch,lane,ARMV2STATUS_OK);
+        return;
+    }
+    Gather(batch,lane);
+}
+
+//Could the instruction at the lane's pc idle? That's a wait for interrupt, or a branch to itself
+static int AtIdle(armv2_t *cpu) {
+    uint32_t addr = (cpu->pc+4)&0x3ffffff;
+    page_info_t *page = GetPage(cpu,PAGEOF(addr));
+    uint32_t instruction;
+    if(NULL == page || NULL == page->memory || NULL != page->read_callback) {
+        return 0;
+    }
+    instruction = page->memory[WORDINPAGE(addr)];
+    if((instruction&0x0f000010) == 0x0e000000) {
+        return ((instruction>>8)&0xf) == COPROCESSOR_INTERRUPT_CONTROLLER && ((instruction>>20)&0xf) == INTERRUPT_WAIT;
+    }
+    return (instruction&0x0effffff) == 0x0afffffe;
+}
+
+//Run the lane's next instruction the ordinary way. An instruction that idles does so until the end of the
+//slice, and a wait for interrupt carries on past itself from there, so that has to be run up to where the
+//slice would have ended running the cpu by itself: the next event, or the end of what it was asked to run
+static void SlowStep(batch_t *batch, uint32_t lane) {
+    armv2_t *cpu = batch->cpus[lane];
+    int32_t instructions = 1;
+    //Catch up with the events that are due first, as they might move the next one or raise an interrupt
+    Scatter(batch,lane);
+    if(!InterruptPending(cpu) && AtIdle(cpu)) {
+        uint64_t next = NextDeadline(cpu);
+        instructions = batch->remaining[lane];
+        if(next - cpu->cycles < (uint64_t)instructions) {
+            instructions = next - cpu->cycles;
+        }
+        if(0 == instructions) {
+            instructions = 1;
+        }
+    }
+    ScalarStep(batch,lane,instructions);
+}
+
+//The lanes in group have each run steps more instructions in lockstep
+static void Account(batch_t *batch, uint32_t group, int32_t steps) {
+    for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+        if(!(group&(1<<lane))) {
+            continue;
+        }
+        batch->remaining[lane] -= steps;
+        batch->budget[lane]    -= steps;
+        batch->executed[lane]  += steps;
+        if(0 == batch->remaining[lane]) {
+            Scatter(batch,lane);
+            Finish(batch,lane,ARMV2STATUS_OK);
+        }
+    }
+}
+
+//Operand 2 for an immediate or a register shifted by an immediate, and the carry out of the shifter, all
+//exactly as OperandShift does it
+static lanes_t ShiftOperand(lanes_t *regs, uint32_t instruction, lanes_t carry_in, lanes_t *carry_out) {
+    lanes_t value  = regs[instruction&0xf];
+    uint32_t amount = (instruction>>7)&0x1f;
+    switch((instruction>>5)&3) {
+    case 0: //LSL
+        if(0 == amount) {
+            *carry_out = carry_in;
+            return value;
+        }
+        *carry_out = (value>>(32-amount))&1;
+        return value<<amount;
+    case 1: //LSR, where 0 means 32
+        if(0 == amount) {
+            *carry_out = value>>31;
+            return Splat(0);
+        }
+        *carry_out = (value>>(amount-1))&1;
+        return value>>amount;
+    case 2: //ASR, where 0 means 32
+        if(0 == amount) {
+            *carry_out = value>>31;
+            return (lanes_t)(((slanes_t)value)>>31);
+        }
+        *carry_out = (value>>(amount-1))&1;
+        return (lanes_t)(((slanes_t)value)>>amount);
+    default: //ROR, where 0 means RRX
+        if(0 == amount) {
+            *carry_out = value&1;
+            return (value>>1) | (carry_in<<31);
+        }
+        *carry_out = (value>>(amount-1))&1;
+        return (value>>amount) | (value<<(32-amount));
+    }
+}
+
+static lanes_t ImmediateOperand(uint32_t instruction, lanes_t carry_in, lanes_t *carry_out) {
+    uint32_t rotate = (instruction>>7)&0x1e;
+    uint32_t value  = instruction&0xff;
+    if(0 == rotate) {
+        *carry_out = carry_in;
+        return Splat(value);
+    }
+    value      = (value<<(32-rotate)) | (value>>rotate);
+    *carry_out = Splat(value>>31);
+    return Splat(value);
+}
+
+//Can AluStep do it? It doesn't do register shifts, the pc as an operand or anything that writes r15
+static int AluSupported(uint32_t instruction) {
+    uint32_t opcode = (instruction>>21)&0xf;
+    uint32_t form   = ALU_FORM(instruction);
+    if(form == ALU_FORM_REGISTER_SHIFT || ((instruction>>12)&0xf) == PC) {
+        return 0;
+    }
+    if(form == ALU_FORM_SHIFT && (instruction&0xf) == PC) {
+        return 0;
+    }
+    //MOV and MVN are the only ones that don't read rn
+    return opcode == 0xd || opcode == 0xf || ((instruction>>16)&0xf) != PC;
+}
+
+static void AluStep(lanes_t *regs, uint32_t instruction, lanes_t exec) {
+    uint32_t opcode   = (instruction>>21)&0xf;
+    uint32_t rd       = (instruction>>12)&0xf;
+    lanes_t  rn       = regs[(instruction>>16)&0xf];
+    lanes_t  carry_in = (regs[PC]>>29)&1;
+    lanes_t  shift_c  = carry_in;
+    lanes_t  source   = ALU_FORM(instruction) == ALU_FORM_IMMEDIATE ? ImmediateOperand(instruction,carry_in,&shift_c) :
+                                                                     ShiftOperand(regs,instruction,carry_in,&shift_c);
+    lanes_t  op1      = {0};
+    lanes_t  op2      = {0};
+    lanes_t  carry    = carry_in;
+    lanes_t  result   = {0};
+    uint32_t kind     = FLAGS_LOGIC;
+
+    switch(opcode) {
+    case 0x0: //AND
+    case 0x8: //TST
+        result = rn & source;
+        break;
+    case 0x1: //EOR
+    case 0x9: //TEQ
+        result = rn ^ source;
+        break;
+    case 0x2: //SUB
+    case 0xa: //CMP
+        op1   = rn;
+        op2   = ~source;
+        carry = Splat(1);
+        kind  = FLAGS_ARITH;
+        break;
+    case 0x3: //RSB
+        op1   = source;
+        op2   = ~rn;
+        carry = Splat(1);
+        kind  = FLAGS_ARITH;
+        break;
+    case 0x4: //ADD
+    case 0xb: //CMN
+        op1   = rn;
+        op2   = source;
+        carry = Splat(0);
+        kind  = FLAGS_ARITH;
+        break;
+    case 0x5: //ADC
+        op1  = rn;
+        op2  = source;
+        kind = FLAGS_ARITH;
+        break;
+    case 0x6: //SBC
+        op1  = rn;
+        op2  = ~source;
+        kind = FLAGS_ARITH;
+        break;
+    case 0x7: //RSC
+        op1  = ~rn;
+        op2  = source;
+        kind = FLAGS_ARITH;
+        break;
+    case 0xc: //ORR
+        result = rn | source;
+        break;
+    case 0xd: //MOV
+        result = source;
+        break;
+    case 0xe: //BIC
+        result = rn & ~source;
+        break;
+    case 0xf: //MVN
+        result = ~source;
+        break;
+    }
+    if(kind != FLAGS_LOGIC) {
+        result = op1 + op2 + carry;
+    }
+    if(instruction&0x00100000) {
+        //The same as ResolveFlags would come up with
+        lanes_t psr   = regs[PC];
+        lanes_t flags = (result&FLAG_N) | ((lanes_t)(result == 0)&FLAG_Z);
+        if(kind == FLAGS_LOGIC) {
+            flags |= ((lanes_t)(shift_c != 0)&FLAG_C) | (psr&FLAG_V);
+        }
+        else {
+            lanes_t partial = op1 + op2;
+            flags |= (lanes_t)((partial < op1) | (result < partial))&FLAG_C;
+            flags |= ((op1^op2^0x80000000)&(op1^result)&0x80000000)>>3;
+        }
+        regs[PC] = Select(exec,(psr&0x0fffffff) | flags,psr);
+    }
+    if((opcode&0xc) != 0x8) {
+        regs[rd] = Select(exec,result,regs[rd]);
+    }
+}
+
+static int MultiplySupported(uint32_t instruction) {
+    if(((instruction>>16)&0xf) == PC || (instruction&0xf) == PC || ((instruction>>8)&0xf) == PC) {
+        return 0;
+    }
+    return !(instruction&0x00200000) || ((instruction>>12)&0xf) != PC;
+}
+
+static void MultiplyStep(lanes_t *regs, uint32_t instruction, lanes_t exec) {
+    uint32_t rd    = (instruction>>16)&0xf;
+    lanes_t result = regs[instruction&0xf]*regs[(instruction>>8)&0xf];
+    if(instruction&0x00200000) {
+        //MLA
+        result += regs[(instruction>>12)&0xf];
+    }
+    regs[rd] = Select(exec,result,regs[rd]);
+    if(instruction&0x00100000) {
+        //Only N and Z, see MultiplyInstruction
+        lanes_t psr   = regs[PC];
+        lanes_t flags = (result&FLAG_N) | ((lanes_t)(result == 0)&FLAG_Z);
+        regs[PC] = Select(exec,(psr&0x3fffffff) | flags,psr);
+    }
+}
+
+//Loads and stores of words and bytes, returning 0 without having touched anything if any of the lanes
+//can't go straight to memory through its TLB
+static int TransferStep(batch_t *batch, uint32_t instruction, lanes_t exec) {
+    lanes_t  *regs    = batch->regs;
+    uint32_t  rd      = (instruction>>12)&0xf;
+    uint32_t  rn      = (instruction>>16)&0xf;
+    uint32_t  load    = instruction&0x00100000;
+    uint32_t  byte    = instruction&0x00400000;
+    uint32_t  lanes   = Bits(exec);
+    uint32_t *host[BATCH_LANES];
+    lanes_t   offset;
+    lanes_t   address;
+    lanes_t   value;
+    lanes_t   ignored;
+
+    if(rn == PC || rd == PC) {
+        return 0;
+    }
+    if(instruction&0x02000000) {
+        if((instruction&0xf) == PC) {
+            return 0;
+        }
+        offset = ShiftOperand(regs,instruction,(regs[PC]>>29)&1,&ignored);
+    }
+    else {
+        offset = Splat(instruction&0xfff);
+    }
+    if(!(instruction&0x00800000)) {
+        offset = -offset;
+    }
+    address = regs[rn];
+    if(instruction&0x01000000) {
+        address += offset;
+    }
+    for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+        uint32_t addr = address[lane];
+        if(!(lanes&(1<<lane))) {
+            continue;
+        }
+        if((addr&0xfc000000) || (!byte && (addr&3))) {
+            return 0;
+        }
+        host[lane] = load ? TlbRead(batch->cpus[lane],addr) : TlbWrite(batch->cpus[lane],addr);
+        if(NULL == host[lane]) {
+            return 0;
+        }
+    }
+    value = regs[rd];
+    for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+        uint32_t shift = (address[lane]&3)<<3;
+        if(!(lanes&(1<<lane))) {
+            continue;
+        }
+        if(load) {
+            value[lane] = byte ? (*host[lane]>>shift)&0xff : *host[lane];
+        }
+        else if(byte) {
+            *host[lane] = (*host[lane]&~(0xff<<shift)) | ((value[lane]&0xff)<<shift);
+        }
+        else {
+            *host[lane] = value[lane];
+        }
+    }
+    if(load) {
+        regs[rd] = value;
+    }
+    if(!(instruction&0x01000000)) {
+        regs[rn] = Select(exec,address + offset,regs[rn]);
+    }
+    else if(instruction&0x00200000) {
+        regs[rn] = Select(exec,address,regs[rn]);
+    }
+    return 1;
+}
+
+//Run the lanes in group, which are all at pc, together for up to steps instructions
+static int Lockstep(batch_t *batch, uint32_t group, uint32_t pc, int32_t steps) {
+    lanes_t   *regs = batch->regs;
+    lanes_t    mask = Mask(group);
+    uint32_t   lead = __builtin_ctz(group);
+    uint32_t  *code[BATCH_LANES] = {NULL};
+    uint32_t   code_page = 0xffffffff;
+    page_info_t *lead_page = NULL;
+    uint32_t   shared = 0;
+    int32_t    done = 0;
+    int        stopped = LOCKSTEP_DONE;
+
+    for(;done < steps;done++) {
+        uint32_t next = (pc+4)&0x3ffffff;
+        uint32_t instruction;
+        decoded_instruction_t *decoded;
+        lanes_t exec = mask;
+        uint32_t active;
+
+        //The lead lane's decoded copy stands for everyone's, once we've checked they've all got the same there
+        batch->cpus[lead]->pc = next;
+        if(ARMV2STATUS_OK != FetchInstruction(batch->cpus[lead],&decoded)) {
+            stopped = LOCKSTEP_SLOW;
+            break;
+        }
+        instruction = decoded->instruction;
+        if(PAGEOF(next) != code_page) {
+            code_page = PAGEOF(next);
+            shared    = 1;
+            for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+                page_info_t *page;
+                if(!(group&(1<<lane))) {
+                    continue;
+                }
+                page = GetPage(batch->cpus[lane],code_page);
+                code[lane] = page ? page->memory : NULL;
+                //Pages still sharing the same ROM's decoded instructions haven't been written to, so they
+                //hold the same code even though each cpu has its own copy of the memory
+                if(lane == lead) {
+                    lead_page = page;
+                }
+                shared &= code[lane] == code[lead] ||
+                    (NULL != page && (page->flags&PAGE_SHARED) && (lead_page->flags&PAGE_SHARED) &&
+                     page->decoded == lead_page->decoded);
+            }
+        }
+        if(!shared) {
+            uint32_t split = 0;
+            for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+                if((group&(1<<lane)) && (NULL == code[lane] || code[lane][WORDINPAGE(next)] != instruction)) {
+                    split |= 1<<lane;
+                }
+            }
+            if(split) {
+                //Different code here, so they'll have to wait their turn
+                for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+                    if(split&(1<<lane)) {
+                        batch->pc[lane] = pc;
+                    }
+                }
+                Account(batch,group,done);
+                group &= ~split;
+                mask   = Mask(group);
+                exec   = mask;
+                steps -= done;
+                done   = 0;
+            }
+        }
+
+        if(decoded->condition_mask != 0xffff) {
+            lanes_t passed = (Splat(decoded->condition_mask)>>(regs[PC]>>28))&1;
+            exec &= (lanes_t)(passed != 0);
+        }
+        active = Bits(exec);
+        if(active) {
+            switch(decoded->type) {
+            case INSTRUCTION_ALU:
+                if(!AluSupported(instruction)) {
+                    stopped = LOCKSTEP_SLOW;
+                }
+                break;
+            case INSTRUCTION_MULTIPLY:
+                if(!MultiplySupported(instruction)) {
+                    stopped = LOCKSTEP_SLOW;
+                }
+                break;
+            case INSTRUCTION_SINGLE_DATA_TRANSFER:
+                break;
+            case INSTRUCTION_BRANCH:
+                //A branch to itself is an idle loop, which is better skipped by run_armv2
+                if((instruction&0xffffff) == 0xfffffe) {
+                    stopped = LOCKSTEP_SLOW;
+                }
+                break;
+            default:
+                stopped = LOCKSTEP_SLOW;
+                break;
+            }
+            if(stopped == LOCKSTEP_SLOW) {
+                break;
+            }
+        }
+        //The pc the instruction sees, which is all of r15 that the cores update as they go
+        regs[PC] = Select(mask,(regs[PC]&0xfc000003) | ((next+8)&0x03fffffc),regs[PC]);
+        if(!active) {
+            pc = next;
+            continue;
+        }
+
+        switch(decoded->type) {
+        case INSTRUCTION_ALU:
+            AluStep(regs,instruction,exec);
+            break;
+        case INSTRUCTION_MULTIPLY:
+            MultiplyStep(regs,instruction,exec);
+            break;
+        case INSTRUCTION_SINGLE_DATA_TRANSFER:
+            if(!TransferStep(batch,instruction,exec)) {
+                //Nothing's been done apart from the pc, which run_armv2 will set again
+                stopped = LOCKSTEP_SLOW;
+            }
+            break;
+        case INSTRUCTION_BRANCH: {
+            //As BranchInstruction leaves cpu->pc, the word before the one it goes to
+            uint32_t target = (next + 8 + ((instruction&0xffffff)<<2) - 4)&0xffffff;
+            if(instruction&0x01000000) {
+                regs[LR] = Select(exec,Splat(next+4),regs[LR]);
+            }
+            if(active != group) {
+                //They've gone different ways. The pcs go in first, as a lane that's finished is written
+                //back to its cpu when it's accounted for
+                for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+                    if(group&(1<<lane)) {
+                        batch->pc[lane] = (active&(1<<lane)) ? target : next;
+                    }
+                }
+                Account(batch,group,done+1);
+                return LOCKSTEP_DONE;
+            }
+            pc = target;
+            continue;
+        }
+        }
+        if(stopped == LOCKSTEP_SLOW) {
+            break;
+        }
+        pc = next;
+    }
+    for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+        if(group&(1<<lane)) {
+            batch->pc[lane] = pc;
+        }
+    }
+    Account(batch,group,done);
+    if(stopped == LOCKSTEP_SLOW) {
+        //Whatever's left of the group runs the next instruction the ordinary way
+        for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+            if(batch->live&group&(1<<lane)) {
+                SlowStep(batch,lane);
+            }
+        }
+    }
+    return stopped;
+}
+
+static void RunBatch(batch_t *batch) {
+    while(batch->live) {
+        uint32_t live  = batch->live;
+        uint32_t group = 0;
+        uint32_t pc    = 0xffffffff;
+        int32_t  steps = INT32_MAX;
+
+        if(0 == (live&(live-1))) {
+            //Only one left, so there's nothing to keep in step with
+            uint32_t lane = __builtin_ctz(live);
+            ScalarStep(batch,lane,batch->remaining[lane]);
+            continue;
+        }
+        for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+            if(!(live&(1<<lane))) {
+                continue;
+            }
+            if(0 == batch->budget[lane] || PINS(batch->cpus[lane])) {
+                //An event's due or there's an interrupt to take
+                SlowStep(batch,lane);
+                continue;
+            }
+            if((batch->cpus[lane]->flags&FLAG_REPLAYING) && (batch->cpus[lane]->flags&FLAG_WAITING)) {
+                //Replaying a wait, which run_armv2 sees through to the next thing in the recording
+                ScalarStep(batch,lane,batch->budget[lane]);
+                continue;
+            }
+            if(batch->pc[lane] < pc) {
+                pc    = batch->pc[lane];
+                group = 0;
+            }
+            if(batch->pc[lane] == pc) {
+                group |= 1<<lane;
+            }
+        }
+        if(0 == group) {
+            continue;
+        }
+        for(uint32_t lane=0;lane<BATCH_LANES;lane++) {
+            if((group&(1<<lane)) && batch->budget[lane] < steps) {
+                steps = batch->budget[lane];
+            }
+        }
+        Lockstep(batch,group,pc,steps);
+    }
+}
+
+//Run each of the count cpus for instructions, with the same end result as calling run_armv2 on each of
+//them in turn, and put what each one's run_armv2 would have returned in results. It pays off when they're
+//running the same code and mostly take the same branches. A cpu can only be in the batch once, and none of
+//them can be running anywhere else
+enum armv2_status armv2_run_batch(armv2_t **cpus, uint32_t count, int32_t instructions, enum armv2_status *results) {
+    batch_t batch;
+
+    if(NULL == cpus || NULL == results || instructions < 0) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    for(uint32_t i=0;i<count;i++) {
+        if(NULL == cpus[i] || !CPU_INITIALISED(cpus[i])) {
+            return ARMV2STATUS_INVALID_ARGS;
+        }
+        if(NULL != __atomic_load_n(&cpus[i]->executor,__ATOMIC_ACQUIRE)) {
+            return ARMV2STATUS_INVALID_CPUSTATE;
+        }
+    }
+    for(uint32_t start=0;start<count;start+=BATCH_LANES) {
+        memset(&batch,0,sizeof(batch));
+        batch.results = results + start;
+        for(uint32_t lane=0;lane<BATCH_LANES && start+lane<count;lane++) {
+            armv2_t *cpu = cpus[start+lane];
+            batch.cpus[lane]      = cpu;
+            batch.remaining[lane] = instructions;
+            batch.results[lane]   = ARMV2STATUS_OK;
+            if(0 == instructions) {
+                continue;
+            }
+            //As run_armv2 would on the way in
+            cpu->flags &= ~FLAG_HALTED;
+            AdvanceEvents(cpu,0);
+            batch.live |= 1<<lane;
+            Gather(&batch,lane);
+        }
+        RunBatch(&batch);
+    }
+    return ARMV2STATUS_OK;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "testutil.h"
+
+//Check that armv2_run_batch leaves every cpu exactly as running it by itself with run_armv2 does, for
+//programs whose lanes go different ways, take interrupts from timers running at different rates and wait
+//for interrupts, run in one go and in pieces of different sizes
+
+#define MAX_CPUS    9
+
+//mov r0,#0 ; cdp p3,0 (wait for interrupt) ; add r0,r0,#1 ; b .-4. With no interrupt ever coming the wait
+//lasts as long as the run does, so r0 stays 0
+static const uint32_t wait_program[] = {
+    0xe3a00000, 0xee000300, 0xe2800001, 0xeafffffd,
+};
+
+//A collatz loop from a different seed in each cpu (r7), counting into a table indexed by the value. Every
+//fourth seed it waits for the timer, which each cpu runs at its own interval (r11). The interrupt handler
+//counts ticks in r10 and acknowledges them
+static const uint32_t collatz_program[] = {
+    [0x00/4] = 0xea000006, //b 0x20
+    [0x18/4] = 0xea000018, //b 0x80
+    [0x20/4] = 0xe3a02902, //mov r2,#0x8000
+               0xe3a08801, //mov r8,#0x10000
+               0xe588b000, //str r11,[r8,#TIMER_INTERVAL]
+               0xe1a01007, //mov r1,r7
+    [0x30/4] = 0xe3110001, //loop: tst r1,#1
+               0x10811081, //addne r1,r1,r1,lsl #1
+               0x12811001, //addne r1,r1,#1
+               0x01a010a1, //moveq r1,r1,lsr #1
+               0xe2013fff, //and r3,r1,#0x3fc
+               0xe7924003, //ldr r4,[r2,r3]
+               0xe2844001, //add r4,r4,#1
+               0xe7824003, //str r4,[r2,r3]
+               0xe2855001, //add r5,r5,#1
+               0xe3510001, //cmp r1,#1
+               0x1afffff4, //bne loop
+               0xe2866001, //add r6,r6,#1
+               0xe0861007, //add r1,r6,r7
+               0xe3160003, //tst r6,#3
+               0x0e000300, //cdpeq p3,0
+               0xeaffffef, //b loop
+    [0x80/4] = 0xe28aa001, //irq: add r10,r10,#1
+               0xe588a004, //str r10,[r8,#TIMER_TICKS]
+               0xe25ef008, //subs pc,lr,#8
+};
+
+static void Setup(armv2_t *cpu, const uint32_t *program, size_t size, uint32_t index) {
+    SetupCpu(cpu,program,size);
+    AddDevice(cpu,NULL,0x10000);
+    cpu->regs.actual[7]  = 27 + index*3;
+    cpu->regs.actual[11] = 500 + index*37;
+}
+
+static void Check(const char *name, const uint32_t *program, size_t size, uint32_t count, int32_t total, int32_t chunk) {
+    armv2_t solo[MAX_CPUS], batched[MAX_CPUS];
+    armv2_t *cpus[MAX_CPUS];
+    enum armv2_status solo_results[MAX_CPUS], batch_results[MAX_CPUS];
+
+    for(uint32_t i=0;i<count;i++) {
+        Setup(&solo[i],program,size,i);
+        Setup(&batched[i],program,size,i);
+        cpus[i] = &batched[i];
+    }
+    for(int32_t done=0;done<total;done+=chunk) {
+        int32_t instructions = chunk < total-done ? chunk : total-done;
+        for(uint32_t i=0;i<count;i++) {
+            solo_results[i] = run_armv2(&solo[i],instructions);
+        }
+        if(ARMV2STATUS_OK != armv2_run_batch(cpus,count,instructions,batch_results)) {
+            printf("%s: armv2_run_batch failed\n",name);
+            failures++;
+            break;
+        }
+    }
+    for(uint32_t i=0;i<count;i++) {
+        if(solo_results[i] != batch_results[i]) {
+            printf("%s with %u cpus run %d at a time: cpu %u finished with %d rather than %d\n",name,count,chunk,i,
+                   batch_results[i],solo_results[i]);
+            failures++;
+        }
+        CompareState(&solo[i],&batched[i],"%s with %u cpus run %d at a time: cpu %u",name,count,chunk,i);
+        cleanup_armv2(&solo[i]);
+        cleanup_armv2(&batched[i]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static const uint32_t counts[] = {2,5,MAX_CPUS};
+    static const int32_t chunks[] = {1,7,100,1000,200000};
+
+    for(uint32_t i=0;i<sizeof(counts)/sizeof(counts[0]);i++) {
+        Check("wait",wait_program,sizeof(wait_program),counts[i],100,100);
+        Check("wait",wait_program,sizeof(wait_program),counts[i],1000,7);
+        for(uint32_t j=0;j<sizeof(chunks)/sizeof(chunks[0]);j++) {
+            int32_t total = chunks[j] == 1 ? 5000 : 200000;
+            Check("collatz",collatz_program,sizeof(collatz_program),counts[i],total,chunks[j]);
+        }
+    }
+    return Finish(argv[0]);
+}
@@ -1,4 +1,4 @@
-from libc.stdint cimport uint32_t, int64_t, int32_t
+from libc.stdint cimport uint32_t, int64_t, int32_t, uint64_t
 
 cdef extern from "armv2.h":
     cdef enum armv2_status:
@@ -8,6 +8,7 @@ cdef extern from "armv2.h":
         ARMV2STATUS_VALUE_ERROR
         ARMV2STATUS_IO_ERROR
         ARMV2STATUS_BREAKPOINT
+        ARMV2STATUS_INVALID_ARGS
 
     enum: NUMREGS
     enum: NUM_EFFECTIVE_REGS
@@ -33,13 +34,27 @@ cdef extern from "armv2.h":
     enum: R12_F
     enum: R13_F
     enum: R14_F
+    enum: R8_U
+    enum: R9_U
+    enum: R10_U
+    enum: R11_U
+    enum: R12_U
+    enum: R13_U
+    enum: R14_U
     enum: PAGE_SIZE_BITS
     enum: PAGE_SIZE
     enum: PAGE_MASK
     enum: NUM_PAGE_TABLES
     enum: WORDS_PER_PAGE
     enum: MAX_MEMORY
+    enum: HW_DEVICES_MAX
+    enum: DIRTY_WORDS
     enum: SWI_BREAKPOINT
+    enum: PIN_F
+    enum: PIN_I
+    enum: TIMER_DEVICE_ID
+    enum: TIMER_INTERVAL
+    enum: TIMER_TICKS
 
     ctypedef enum:
         EXCEPT_RST
@@ -52,6 +67,7 @@ cdef extern from "armv2.h":
         EXCEPT_FIQ
         EXCEPT_NONE
         EXCEPT_BREAKPOINT
+        EXCEPT_IDLE
         EXCEPT_MAX
 
     ctypedef struct exception_handler_t:
@@ -67,38 +83,84 @@ cdef extern from "armv2.h":
         ARMV2STATUS_VALUE_ERROR,
         ARMV2STATUS_IO_ERROR,
         ARMV2STATUS_BREAKPOINT
+        ARMV2STATUS_INVALID_ARGS
 
     ctypedef struct regs_t:
         uint32_t actual[NUMREGS]
-        uint32_t *effective[NUM_EFFECTIVE_REGS]
 
-    ctypedef void (*access_callback_t)(uint32_t)
+    ctypedef uint32_t (*access_callback_t)(void *extra, uint32_t addr, uint32_t value)
 
     ctypedef struct page_info_t:
         uint32_t *memory
+        void *mapped_device
         access_callback_t read_callback
         access_callback_t write_callback
         uint32_t flags
 
+    ctypedef struct armv2_device_plugin_t:
+        uint32_t device_id
+        const char *name
+
+    ctypedef struct hardware_device_t:
+        uint32_t device_id
+        uint32_t interrupt_flag_addr
+        access_callback_t read_callback
+        access_callback_t write_callback
+        void *extra
+        const armv2_device_plugin_t *plugin
+
     ctypedef struct armv2_t:
         regs_t regs
         uint32_t *physical_ram
         uint32_t physical_ram_size
-        page_info_t *page_tables[NUM_PAGE_TABLES]
         exception_handler_t exception_handlers[EXCEPT_MAX]
         uint32_t pc
         uint32_t flags
         uint32_t pins
+        uint32_t num_hardware_devices
+        hardware_device_t *hardware_devices[HW_DEVICES_MAX]
+        uint64_t dirty[DIRTY_WORDS]
+        uint64_t idle_skipped
+        uint64_t cycles
 
-    ctypedef struct hardware_device_t:
-        uint32_t device_id
-        uint32_t interrupt_flag_addr
-        access_callback_t read_callback
-        access_callback_t write_callback
-        void *extra
+    ctypedef struct armv2_snapshot_t:
+        pass
+
+    ctypedef struct armv2_executor_t:
+        pass
+
+    ctypedef struct armv2_job_t:
+        armv2_status result
+        uint32_t done
 
     armv2_status init(armv2_t *cpu, uint32_t memsize) nogil
     armv2_status load_rom(armv2_t *cpu, const char *filename) nogil
+    armv2_status load_shared_rom(armv2_t *cpu, const char *filename) nogil
     armv2_status cleanup_armv2(armv2_t *cpu) nogil
     armv2_status run_armv2(armv2_t *cpu, int32_t instructions) nogil
     armv2_status add_hardware(armv2_t *cpu, hardware_device_t *device) nogil
+    armv2_status load_device(armv2_t *cpu, const char *filename, const char *args) nogil
+    uint64_t frame_devices(armv2_t *cpu) nogil
+    armv2_status add_timer(armv2_t *cpu) nogil
+    armv2_status invalidate_instruction(armv2_t *cpu, uint32_t addr) nogil
+    void invalidate_page(armv2_t *cpu, uint32_t page_num) nogil
+    armv2_status prepare_page_write(armv2_t *cpu, uint32_t page_num) nogil
+    void armv2_raise_pins(armv2_t *cpu, uint32_t pins) nogil
+    void armv2_lower_pins(armv2_t *cpu, uint32_t pins) nogil
+    void armv2_raise_line(armv2_t *cpu, uint32_t line) nogil
+    void armv2_lower_line(armv2_t *cpu, uint32_t line) nogil
+    uint32_t query_dirty(armv2_t *cpu, uint32_t start_page, uint32_t num_pages, uint64_t *out, uint32_t clear) nogil
+    armv2_status armv2_snapshot(armv2_t *cpu, armv2_snapshot_t **out) nogil
+    armv2_status armv2_restore(armv2_t *cpu, armv2_snapshot_t *snapshot) nogil
+    armv2_status armv2_rewind(armv2_t *cpu, uint64_t cycle) nogil
+    void armv2_free_snapshot(armv2_snapshot_t *snapshot) nogil
+    armv2_status armv2_executor_create(armv2_executor_t **out, uint32_t num_workers) nogil
+    void armv2_executor_destroy(armv2_executor_t *executor) nogil
+    armv2_status armv2_submit(armv2_executor_t *executor, armv2_job_t *job, armv2_t *cpu, int32_t instructions) nogil
+    armv2_status armv2_await(armv2_job_t *job) nogil
+    armv2_status armv2_run_batch(armv2_t **cpus, uint32_t count, int32_t instructions, armv2_status *results) nogil
+    armv2_status armv2_record(armv2_t *cpu, const char *filename) nogil
+    armv2_status armv2_replay(armv2_t *cpu, const char *filename) nogil
+    armv2_status armv2_stop_replay(armv2_t *cpu) nogil
+    void SwapBanks(armv2_t *cpu, uint32_t old_mode, uint32_t new_mode) nogil
+    page_info_t *GetPage(armv2_t *cpu, uint32_t page_num) nogil
@@ -15,6 +15,8 @@ enum armv2_status {
     ARMV2STATUS_NO_SUCH_DEVICE   ,
     ARMV2STATUS_ALREADY_MAPPED   ,
     ARMV2STATUS_INVALID_PAGE     ,
+    ARMV2STATUS_WAIT_FOR_INTERRUPT,
+    ARMV2STATUS_RESCHEDULE       ,
 };
 
 #endif
@@ -1,6 +1,7 @@
 import curses
 import disassemble
 import time
+import tempfile
 import armv2
 
 class WindowControl:
@@ -97,6 +98,12 @@ class Debug(View):
         elif ch == ord('s'):
             self.debugger.Step()
             return WindowControl.RESUME
+        elif ch == ord('C'):
+            self.debugger.ContinueBack()
+            return WindowControl.RESUME
+        elif ch == ord('S'):
+            self.debugger.StepBack()
+            return WindowControl.RESUME
         elif ch == ord('r'):
             #self.debugger.machine.Reset()
             return WindowControl.RESUME
@@ -144,8 +151,10 @@ class Help(View):
         if draw_border:
             self.window.border()
         for i,(key,action) in enumerate( (('c','continue'),
+                                          ('C','continue back'),
                                           ('q','quit'),
                                           ('s','step'),
+                                          ('S','step back'),
                                           ('space','set breakpoint'),
                                           ('tab','switch window')) ):
             self.window.addstr(i+1,1,'%5s - %s' % (key,action))
@@ -169,9 +178,11 @@ class Memdump(View):
         self.window.clear()
         if draw_border:
             self.window.border()
+        #Grab the whole screen's worth in one go, it comes straight out of RAM rather than a byte at a time
+        all_data = self.debugger.machine.mem[self.pos:self.pos + (self.height-2)*self.display_width]
         for i in xrange(self.height-2):
             addr = self.pos + i*self.display_width
-            data = self.debugger.machine.mem[addr:addr+self.display_width]
+            data = all_data[i*self.display_width:(i+1)*self.display_width]
             if len(data) < self.display_width:
                 data += '??'*(self.display_width-len(data))
             data_string = ' '.join((('%02x' % ord(data[i])) if i < len(data) else '??') for i in xrange(self.display_width))
@@ -232,9 +243,15 @@ class Memdump(View):
         return WindowControl.SAME
     
 
+#To go backwards we keep checkpoints every CHECKPOINT_CYCLES, go back to the one before where we want to be
+#and run forward from there. Everything the devices give the machine is recorded, so running it again does
+#exactly the same thing, and a breakpoint doesn't count as an instruction, so being stopped at them on the
+#way doesn't change where we end up
 class Debugger(object):
     BKPT = 0xef000000 | armv2.SWI_BREAKPOINT
     FRAME_CYCLES = 66666
+    CHECKPOINT_CYCLES = FRAME_CYCLES*16
+    MAX_CHECKPOINTS = 64
     def __init__(self,machine,stdscr):
         self.machine          = machine
         self.breakpoints      = {}
@@ -255,6 +272,11 @@ class Debugger(object):
         #stopped means that the debugger has halted execution and is waiting for input
         self.stopped        = True
         self.help_window.Draw()
+        #(cycles,snapshot) oldest first
+        self.checkpoints    = []
+        self.recording      = tempfile.NamedTemporaryFile(prefix = 'armv2',suffix = '.rec')
+        self.machine.Record(self.recording.name)
+        self.Checkpoint()
 
     def AddBreakpoint(self,addr):
         if addr&3:
@@ -269,6 +291,83 @@ class Debugger(object):
         self.machine.memw[addr] = self.breakpoints[addr]
         del self.breakpoints[addr]
 
+    def LiftBreakpoints(self):
+        for addr,word in self.breakpoints.iteritems():
+            self.machine.memw[addr] = word
+
+    def PlaceBreakpoints(self):
+        #After a restore a breakpoint's word is either what was there when the checkpoint was taken, or still
+        #the breakpoint if the page hasn't changed since
+        for addr in self.breakpoints:
+            word = self.machine.memw[addr]
+            if word != self.BKPT:
+                self.breakpoints[addr]  = word
+                self.machine.memw[addr] = self.BKPT
+
+    def Checkpoint(self):
+        #Taken without the breakpoints, so that restoring one can't bring back any we've removed since
+        self.LiftBreakpoints()
+        self.checkpoints.append( (self.machine.cycles,self.machine.Snapshot()) )
+        self.PlaceBreakpoints()
+        if len(self.checkpoints) > self.MAX_CHECKPOINTS:
+            del self.checkpoints[0]
+
+    def StepOver(self):
+        #We're stopped at one of our breakpoints, so run what's really there
+        addr = self.machine.pc
+        self.machine.memw[addr] = self.breakpoints[addr]
+        self.machine.RunTo(self.machine.cycles + 1)
+        self.machine.memw[addr] = self.BKPT
+
+    def RunTo(self,target):
+        #Run forward to cycle target, taking checkpoints on the way, and return the cycles of every breakpoint
+        #we stopped at
+        hits = []
+        while self.machine.cycles < target:
+            stop = min(target,self.checkpoints[-1][0] + self.CHECKPOINT_CYCLES)
+            result = self.machine.RunTo(stop)
+            if result == armv2.Status.Breakpoint:
+                if self.machine.pc not in self.breakpoints:
+                    #One in the code itself, which we can't get past
+                    break
+                hits.append(self.machine.cycles)
+                self.StepOver()
+            elif result != armv2.Status.Ok:
+                break
+            elif self.machine.cycles == stop and stop < target:
+                self.Checkpoint()
+        return hits
+
+    def Replay(self,start,end):
+        #Go back to the checkpoint taken at start and run forward to end. Restoring it drops every checkpoint
+        #after it
+        while self.checkpoints[-1][0] > start:
+            del self.checkpoints[-1]
+        self.machine.Rewind(start)
+        self.PlaceBreakpoints()
+        return self.RunTo(end)
+
+    def StepBack(self):
+        target = self.machine.cycles - 1
+        starts = [cycles for cycles,snapshot in self.checkpoints if cycles <= target]
+        if not starts:
+            return
+        self.Replay(starts[-1],target)
+
+    def ContinueBack(self):
+        #Look for the last breakpoint hit in the stretch since each checkpoint in turn, newest first. If there
+        #isn't one we go all the way back to the oldest checkpoint, rather than stopping wherever the search
+        #got to
+        end = self.machine.cycles
+        for start in reversed([cycles for cycles,snapshot in self.checkpoints if cycles < end]):
+            hits = self.Replay(start,end)
+            if hits:
+                self.Replay(start,hits[-1])
+                return
+            end = start
+        if end != self.machine.cycles:
+            self.Replay(end,end)
+
     def StepNumInternal(self,num):
         #If we're at a breakpoint and we've been asked to continue, we step it once and then replace the breakpoint
         if num == 0:
@@ -291,6 +390,8 @@ class Debugger(object):
     def Continue(self):
         result = None
         self.stopped = False
+        if self.machine.cycles - self.checkpoints[-1][0] >= self.CHECKPOINT_CYCLES:
+            self.Checkpoint()
         if armv2.Status.Breakpoint == self.StepNumInternal(self.num_to_step):
             self.Stop()
         
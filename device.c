@@ -0,0 +1,95 @@
+#include "armv2.h"
+#include <stdlib.h>
+#include <dlfcn.h>
+
+//Load a native device from a shared object and add it to the cpu. args is passed to the plugin's create
+//function as is. On success the device is the last one in cpu->hardware_devices and belongs to the cpu
+enum armv2_status load_device(armv2_t *cpu, const char *filename, const char *args) {
+    const armv2_device_plugin_t *plugin;
+    hardware_device_t *device;
+    enum armv2_status result;
+    void *handle;
+
+    if(NULL == cpu || NULL == filename || !CPU_INITIALISED(cpu)) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    if(cpu->num_hardware_devices >= HW_DEVICES_MAX) {
+        return ARMV2STATUS_MAX_HW;
+    }
+    handle = dlopen(filename,RTLD_NOW|RTLD_LOCAL);
+    if(NULL == handle) {
+        LOG_ERROR("Error loading device %s : %s\n",filename,dlerror());
+        return ARMV2STATUS_IO_ERROR;
+    }
+    plugin = dlsym(handle,ARMV2_DEVICE_PLUGIN_SYMBOL);
+    if(NULL == plugin || plugin->abi_version != ARMV2_DEVICE_ABI_VERSION ||
+       NULL == plugin->read_callback || NULL == plugin->write_callback) {
+        LOG_ERROR("%s is not a version %d device\n",filename,ARMV2_DEVICE_ABI_VERSION);
+        dlclose(handle);
+        return ARMV2STATUS_VALUE_ERROR;
+    }
+    device = calloc(1,sizeof(hardware_device_t));
+    if(NULL == device) {
+        dlclose(handle);
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    device->device_id      = plugin->device_id;
+    device->read_callback  = plugin->read_callback;
+    device->write_callback = plugin->write_callback;
+    device->read_byte_callback   = plugin->read_byte_callback;
+    device->write_byte_callback  = plugin->write_byte_callback;
+    device->read_block_callback  = plugin->read_block_callback;
+    device->write_block_callback = plugin->write_block_callback;
+    device->plugin         = plugin;
+    device->handle         = handle;
+    if(plugin->create) {
+        device->extra = plugin->create(args);
+        if(NULL == device->extra) {
+            LOG_ERROR("Device %s failed to initialise\n",filename);
+            unload_device(device);
+            return ARMV2STATUS_VALUE_ERROR;
+        }
+    }
+
+    result = add_hardware(cpu,device);
+    if(ARMV2STATUS_OK != result) {
+        unload_device(device);
+        return result;
+    }
+    //Not the plugin's name, that goes away with the plugin when it's unloaded but the trace ring keeps it
+    LOG_INFO("Loaded device id %08x as device %u\n",plugin->device_id,cpu->num_hardware_devices-1);
+    return ARMV2STATUS_OK;
+}
+
+void unload_device(hardware_device_t *device) {
+    if(NULL == device || NULL == device->plugin) {
+        return;
+    }
+    if(device->plugin->destroy && NULL != device->extra) {
+        device->plugin->destroy(device->extra);
+    }
+    if(device->handle) {
+        dlclose(device->handle);
+    }
+    free(device);
+}
+
+//Give every native device with a frame function a chance to catch up. Returns a mask with bit n set if
+//device n asked for the host to be told
+uint64_t frame_devices(armv2_t *cpu) {
+    uint64_t notify = 0;
+    //Replaying, the devices are left alone
+    if(NULL == cpu || (cpu->flags&FLAG_REPLAYING)) {
+        return 0;
+    }
+    for(uint32_t i=0;i<cpu->num_hardware_devices;i++) {
+        hardware_device_t *device = cpu->hardware_devices[i];
+        if(NULL == device || NULL == device->plugin || NULL == device->plugin->frame) {
+            continue;
+        }
+        if(device->plugin->frame(device->extra)) {
+            notify |= ((uint64_t)1)<<i;
+        }
+    }
+    return notify;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "testutil.h"
+
+//Check the dirty bitmap: a store to a clean page goes the slow way and marks it dirty, after which stores to
+//it go through the TLB, and query_dirty reports the bits where they should be and, clearing them, takes the
+//page back out of the TLB for writing so the next store marks it dirty again. Writes from outside the cpu
+//through prepare_page_write mark pages dirty too
+
+#define DATA        0x5000
+#define OTHER       0xa000
+
+static const uint32_t program[] = {
+    0xe3a01a05, //mov r1,#DATA
+    0xe5810000, //loop: str r0,[r1]
+    0xe2800001, //add r0,r0,#1
+    0xeafffffc, //b loop
+};
+
+static uint32_t WriteMapped(armv2_t *cpu, uint32_t page_num) {
+    return cpu->tlb[page_num&(TLB_SIZE-1)].write_tag == page_num;
+}
+
+//The bits query_dirty gives for the pages from start_page, which are also checked against its count
+static uint64_t Dirty(armv2_t *cpu, uint32_t start_page, uint32_t clear) {
+    uint64_t bits = 0;
+    uint32_t count = query_dirty(cpu,start_page,64,&bits,clear);
+    if(count != (uint32_t)__builtin_popcountll(bits)) {
+        printf("query_dirty counted %u pages but gave %016llx\n",count,(unsigned long long)bits);
+        failures++;
+    }
+    return bits;
+}
+
+static void Check(const char *when, armv2_t *cpu, uint64_t expected, uint32_t mapped) {
+    uint64_t bits = Dirty(cpu,0,0);
+    if(bits != expected || WriteMapped(cpu,PAGEOF(DATA)) != mapped) {
+        printf("%s: dirty %016llx rather than %016llx, data page %swrite mapped\n",when,
+               (unsigned long long)bits,(unsigned long long)expected,WriteMapped(cpu,PAGEOF(DATA)) ? "" : "not ");
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const uint64_t data_bit = ((uint64_t)1)<<PAGEOF(DATA);
+    const uint64_t other_bit = ((uint64_t)1)<<PAGEOF(OTHER);
+    armv2_t cpu;
+
+    SetupCpu(&cpu,program,sizeof(program));
+    Dirty(&cpu,0,1);
+    Check("start",&cpu,0,0);
+
+    //The first store finds the page clean, so it can't be mapped for writing and goes the slow way
+    run_armv2(&cpu,2);
+    Check("first store",&cpu,data_bit,0);
+    //Now it's dirty the next one fills in the TLB and stores through it
+    run_armv2(&cpu,3);
+    Check("second store",&cpu,data_bit,1);
+    run_armv2(&cpu,30);
+    Check("more stores",&cpu,data_bit,1);
+    if(cpu.physical_ram[DATA/4] != cpu.regs.actual[0] || 11 != cpu.regs.actual[0]) {
+        printf("Stored %u with r0 %u\n",cpu.physical_ram[DATA/4],cpu.regs.actual[0]);
+        failures++;
+    }
+
+    //Bit n is the page n after start_page, and looking without clearing leaves them alone
+    if(Dirty(&cpu,PAGEOF(DATA)-3,0) != 8 || Dirty(&cpu,PAGEOF(DATA)+1,0) != 0) {
+        printf("query_dirty from another page gives the wrong bits\n");
+        failures++;
+    }
+    if(ARMV2STATUS_OK != prepare_page_write(&cpu,PAGEOF(OTHER))) {
+        printf("prepare_page_write failed\n");
+        failures++;
+    }
+    Check("prepare_page_write",&cpu,data_bit|other_bit,1);
+
+    //Clearing them has to stop the page being written through the TLB, or the next store wouldn't mark it
+    if(Dirty(&cpu,0,1) != (data_bit|other_bit)) {
+        printf("Clearing didn't give the dirty pages\n");
+        failures++;
+    }
+    Check("cleared",&cpu,0,0);
+    run_armv2(&cpu,3);
+    Check("store after clearing",&cpu,data_bit,0);
+    run_armv2(&cpu,3);
+    Check("second store after clearing",&cpu,data_bit,1);
+
+    cleanup_armv2(&cpu);
+    return Finish(argv[0]);
+}
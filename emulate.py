@@ -21,6 +21,7 @@ class StdOutWrapper:
 
 def mainloop(dbg,machine):
     dbg.StepNum(dbg.FRAME_CYCLES)
+    machine.FrameDevices()
     for event in pygame.event.get():
         if event.type == pygame.locals.QUIT:
             done = True
@@ -46,6 +47,7 @@ def main(stdscr):
     try:
         machine.AddHardware(hardware.Keyboard(),name='keyboard')
         machine.AddHardware(hardware.LCDDisplay(),name='display')
+        machine.AddTimer(name='timer')
 
         dbg = debugger.Debugger(machine,stdscr)
         background = pygame.Surface((200,200))
@@ -0,0 +1,189 @@
+#include "armv2.h"
+#include <stdio.h>
+
+//The level and slot an event with this deadline belongs in, given the wheel's current time
+static uint32_t Bucket(uint64_t now, uint64_t deadline) {
+    uint64_t diff  = now ^ deadline;
+    uint32_t level = diff ? (63 - __builtin_clzll(diff))/EVENT_WHEEL_BITS : 0;
+    uint32_t slot  = (deadline >> (level*EVENT_WHEEL_BITS))&(EVENT_WHEEL_SLOTS-1);
+    return level*EVENT_WHEEL_SLOTS + slot;
+}
+
+static void Push(armv2_event_t **head, armv2_event_t *event, uint32_t bucket) {
+    event->bucket = bucket;
+    event->prev   = head;
+    event->next   = *head;
+    if(event->next) {
+        event->next->prev = &event->next;
+    }
+    *head = event;
+}
+
+static void Unlink(armv2_t *cpu, armv2_event_t *event) {
+    uint32_t bucket = event->bucket;
+    if(event->next) {
+        event->next->prev = event->prev;
+    }
+    *event->prev  = event->next;
+    event->next   = NULL;
+    event->prev   = NULL;
+    event->bucket = EVENT_NOT_SCHEDULED;
+    if(bucket < EVENT_PENDING && NULL == cpu->events.slots[bucket/EVENT_WHEEL_SLOTS][bucket%EVENT_WHEEL_SLOTS]) {
+        cpu->events.occupied[bucket/EVENT_WHEEL_SLOTS] &= ~(((uint64_t)1)<<(bucket%EVENT_WHEEL_SLOTS));
+    }
+}
+
+static void Insert(armv2_t *cpu, armv2_event_t *event) {
+    uint32_t bucket;
+    if(event->deadline < cpu->cycles) {
+        event->deadline = cpu->cycles;
+    }
+    bucket = Bucket(cpu->cycles,event->deadline);
+    Push(&cpu->events.slots[bucket/EVENT_WHEEL_SLOTS][bucket%EVENT_WHEEL_SLOTS],event,bucket);
+    cpu->events.occupied[bucket/EVENT_WHEEL_SLOTS] |= ((uint64_t)1)<<(bucket%EVENT_WHEEL_SLOTS);
+}
+
+//Move the wheel's time on to now, which mustn't be past any deadline. The only events that have to move
+//are the ones in the slot now has just reached in the highest level whose bits changed, everything in
+//the lower levels having already gone
+static void SetClock(armv2_t *cpu, uint64_t now) {
+    uint64_t diff = cpu->cycles ^ now;
+    armv2_event_t *event;
+    uint32_t level;
+    uint32_t slot;
+
+    if(now <= cpu->cycles) {
+        return;
+    }
+    level = (63 - __builtin_clzll(diff))/EVENT_WHEEL_BITS;
+    slot  = (now >> (level*EVENT_WHEEL_BITS))&(EVENT_WHEEL_SLOTS-1);
+    cpu->cycles = now;
+    if(0 == level) {
+        return;
+    }
+    event = cpu->events.slots[level][slot];
+    cpu->events.slots[level][slot] = NULL;
+    cpu->events.occupied[level] &= ~(((uint64_t)1)<<slot);
+    while(event) {
+        armv2_event_t *next = event->next;
+        Insert(cpu,event);
+        event = next;
+    }
+}
+
+void armv2_init_event(armv2_event_t *event, event_callback_t callback, void *extra) {
+    event->deadline = 0;
+    event->callback = callback;
+    event->extra    = extra;
+    event->next     = NULL;
+    event->prev     = NULL;
+    event->bucket   = EVENT_NOT_SCHEDULED;
+}
+
+//Arrange for event's callback to be called delay cycles from now, replacing any time it was already
+//scheduled for. This has to be called from the thread running the cpu: between runs, from an event
+//callback, or from a device callback during a run. In the last case we don't know exactly how far
+//through the run we are, so the event is put to one side and the cpu stops after the current
+//instruction so that run_armv2 can schedule it from there
+void armv2_schedule(armv2_t *cpu, armv2_event_t *event, uint64_t delay) {
+    armv2_cancel(cpu,event);
+    if(cpu->flags&FLAG_RUNNING) {
+        event->deadline = delay;
+        Push(&cpu->events.pending,event,EVENT_PENDING);
+        __atomic_fetch_or(&cpu->pins,PIN_RESCHEDULE,__ATOMIC_RELAXED);
+        //translated code only looks at the pins at the start of a block
+        cpu->flags |= FLAG_JIT_EXIT;
+        return;
+    }
+    event->deadline = cpu->cycles + delay;
+    Insert(cpu,event);
+}
+
+void armv2_cancel(armv2_t *cpu, armv2_event_t *event) {
+    if(NULL == cpu || NULL == event || event->bucket == EVENT_NOT_SCHEDULED) {
+        return;
+    }
+    Unlink(cpu,event);
+}
+
+//The earliest deadline of anything scheduled, or UINT64_MAX if there's nothing
+uint64_t NextDeadline(armv2_t *cpu) {
+    for(uint32_t level=0;level<EVENT_WHEEL_LEVELS;level++) {
+        uint64_t occupied = cpu->events.occupied[level];
+        uint32_t slot;
+        uint64_t deadline = UINT64_MAX;
+        if(0 == occupied) {
+            continue;
+        }
+        slot = __builtin_ctzll(occupied);
+        if(0 == level) {
+            return (cpu->cycles&~((uint64_t)EVENT_WHEEL_SLOTS-1)) | slot;
+        }
+        //Everything in a higher level slot shares the bits above it, but not the ones below
+        for(armv2_event_t *event = cpu->events.slots[level][slot]; event; event = event->next) {
+            if(event->deadline < deadline) {
+                deadline = event->deadline;
+            }
+        }
+        return deadline;
+    }
+    return UINT64_MAX;
+}
+
+//Fire everything that's due up to now in order, leaving the clock at now
+static void RunEvents(armv2_t *cpu, uint64_t now) {
+    uint64_t next;
+    while((next = NextDeadline(cpu)) <= now) {
+        armv2_event_t **slot;
+        SetClock(cpu,next);
+        //Callbacks can schedule more for right now, which land in the same slot
+        slot = &cpu->events.slots[0][next&(EVENT_WHEEL_SLOTS-1)];
+        while(*slot) {
+            armv2_event_t *event = *slot;
+            Unlink(cpu,event);
+            event->callback(cpu,event->extra);
+        }
+    }
+    SetClock(cpu,now);
+}
+
+//Called by run_armv2 each time a core stops, with the number of cycles it ran for. Events posted during
+//the run are scheduled relative to where it stopped, which is straight after the instruction that
+//posted them
+void AdvanceEvents(armv2_t *cpu, uint64_t cycles) {
+    RunEvents(cpu,cpu->cycles + cycles);
+    while(cpu->events.pending) {
+        armv2_event_t *event = cpu->events.pending;
+        uint64_t delay = event->deadline;
+        Unlink(cpu,event);
+        event->deadline = cpu->cycles + delay;
+        Insert(cpu,event);
+    }
+    RunEvents(cpu,cpu->cycles);
+}
+
+//Set the clock back to cycles, for armv2_restore. Everything scheduled stays due at the same time, but
+//which slot it belongs in depends on the clock, so it all has to go back in again
+void RewindEvents(armv2_t *cpu, uint64_t cycles) {
+    armv2_event_t *events = NULL;
+    if(cycles >= cpu->cycles) {
+        return;
+    }
+    for(uint32_t level=0;level<EVENT_WHEEL_LEVELS;level++) {
+        for(uint32_t slot=0;slot<EVENT_WHEEL_SLOTS;slot++) {
+            while(cpu->events.slots[level][slot]) {
+                armv2_event_t *event = cpu->events.slots[level][slot];
+                Unlink(cpu,event);
+                event->next = events;
+                events      = event;
+            }
+        }
+    }
+    cpu->cycles = cycles;
+    while(events) {
+        armv2_event_t *next = events->next;
+        events->next = NULL;
+        Insert(cpu,events);
+        events = next;
+    }
+}
@@ -0,0 +1,291 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "armv2.h"
+
+//The queues are only locked for long enough to add or remove a job, and each is on its own cache line so
+//that the workers don't slow each other down when they're busy with their own
+typedef struct {
+    pthread_mutex_t lock;
+    armv2_job_t    *head;
+    armv2_job_t    *tail;
+} __attribute__((aligned(64))) job_queue_t;
+
+typedef struct {
+    armv2_executor_t *executor;
+    uint32_t          index;
+    pthread_t         thread;
+} executor_worker_t;
+
+struct _armv2_executor_t {
+    pthread_mutex_t    lock;     //for the parked jobs, finishing jobs and sleeping
+    pthread_cond_t     work;     //workers with nothing to do wait on this
+    pthread_cond_t     finished; //and anyone awaiting a job on this
+    uint32_t           num_workers;
+    uint32_t           sleeping;
+    uint32_t           stopping;
+    uint32_t           queued;   //jobs in the queues, including any that are on their way
+    uint32_t           next_queue;
+    armv2_job_t       *parked;
+    job_queue_t       *queues;
+    executor_worker_t *workers;
+};
+
+static void Push(armv2_executor_t *executor, uint32_t index, armv2_job_t *job) {
+    job_queue_t *queue = &executor->queues[index];
+    //Counted before it's in the queue so that a worker deciding whether to sleep can't miss it
+    __atomic_fetch_add(&executor->queued,1,__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&queue->lock);
+    job->next = NULL;
+    if(queue->tail) {
+        queue->tail->next = job;
+    }
+    else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    pthread_mutex_unlock(&queue->lock);
+    if(__atomic_load_n(&executor->sleeping,__ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&executor->lock);
+        pthread_cond_signal(&executor->work);
+        pthread_mutex_unlock(&executor->lock);
+    }
+}
+
+static armv2_job_t *Pop(armv2_executor_t *executor, uint32_t index) {
+    job_queue_t *queue = &executor->queues[index];
+    armv2_job_t *job;
+    pthread_mutex_lock(&queue->lock);
+    job = queue->head;
+    if(job) {
+        queue->head = job->next;
+        if(NULL == queue->head) {
+            queue->tail = NULL;
+        }
+        job->next = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if(job) {
+        __atomic_fetch_sub(&executor->queued,1,__ATOMIC_SEQ_CST);
+    }
+    return job;
+}
+
+static void Finish(armv2_executor_t *executor, armv2_job_t *job, enum armv2_status result) {
+    pthread_mutex_lock(&executor->lock);
+    job->result = result;
+    __atomic_store_n(&job->cpu->executor,NULL,__ATOMIC_RELEASE);
+    __atomic_store_n(&job->done,1,__ATOMIC_RELEASE);
+    pthread_cond_broadcast(&executor->finished);
+    pthread_mutex_unlock(&executor->lock);
+}
+
+static void RunSlice(armv2_executor_t *executor, uint32_t index, armv2_job_t *job) {
+    armv2_t *cpu = job->cpu;
+    int32_t slice = (job->remaining == -1 || job->remaining > EXECUTOR_SLICE) ? EXECUTOR_SLICE : job->remaining;
+    enum armv2_status result = run_armv2(cpu,slice);
+
+    if(job->remaining != -1) {
+        job->remaining -= slice;
+    }
+    if(ARMV2STATUS_OK != result || 0 == job->remaining) {
+        Finish(executor,job,result);
+        return;
+    }
+    if(job->remaining == -1 && (cpu->flags&FLAG_HALTED)) {
+        //Nothing but an interrupt can wake it, so there's no point running it again until one comes in. The
+        //check is made with the lock held, and ExecutorWake takes it after raising the pin, so one raised
+        //while we're parking it can't be missed. A change waiting to be recorded wakes it the same way
+        pthread_mutex_lock(&executor->lock);
+        if(!InterruptPending(cpu) && !PIN_ON(cpu,RESCHEDULE)) {
+            job->parked = 1;
+            job->next   = executor->parked;
+            executor->parked = job;
+            pthread_mutex_unlock(&executor->lock);
+            return;
+        }
+        pthread_mutex_unlock(&executor->lock);
+    }
+    //To the back of our own queue so that everything in front of it gets a turn first
+    Push(executor,index,job);
+}
+
+static void *ExecutorWorker(void *arg) {
+    executor_worker_t *worker  = arg;
+    armv2_executor_t *executor = worker->executor;
+
+    while(!__atomic_load_n(&executor->stopping,__ATOMIC_ACQUIRE)) {
+        armv2_job_t *job = Pop(executor,worker->index);
+        for(uint32_t i=1;NULL == job && i<executor->num_workers;i++) {
+            job = Pop(executor,(worker->index + i)%executor->num_workers);
+        }
+        if(NULL != job) {
+            RunSlice(executor,worker->index,job);
+            continue;
+        }
+        pthread_mutex_lock(&executor->lock);
+        __atomic_fetch_add(&executor->sleeping,1,__ATOMIC_SEQ_CST);
+        if(!executor->stopping && 0 == __atomic_load_n(&executor->queued,__ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&executor->work,&executor->lock);
+        }
+        __atomic_fetch_sub(&executor->sleeping,1,__ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&executor->lock);
+    }
+    return NULL;
+}
+
+//Start an executor with num_workers threads, or one per online processor if num_workers is 0
+enum armv2_status armv2_executor_create(armv2_executor_t **out, uint32_t num_workers) {
+    armv2_executor_t *executor;
+    uint32_t started;
+
+    if(NULL == out) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    if(0 == num_workers) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = online > 0 ? online : 1;
+    }
+    executor = calloc(1,sizeof(armv2_executor_t));
+    if(NULL == executor) {
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    executor->num_workers = num_workers;
+    executor->workers     = calloc(num_workers,sizeof(executor_worker_t));
+    if(0 != posix_memalign((void**)&executor->queues,64,num_workers*sizeof(job_queue_t))) {
+        executor->queues = NULL;
+    }
+    if(NULL == executor->workers || NULL == executor->queues) {
+        free(executor->workers);
+        free(executor->queues);
+        free(executor);
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    pthread_mutex_init(&executor->lock,NULL);
+    pthread_cond_init(&executor->work,NULL);
+    pthread_cond_init(&executor->finished,NULL);
+    for(uint32_t i=0;i<num_workers;i++) {
+        pthread_mutex_init(&executor->queues[i].lock,NULL);
+        executor->queues[i].head = executor->queues[i].tail = NULL;
+    }
+    for(started=0;started<num_workers;started++) {
+        executor->workers[started].executor = executor;
+        executor->workers[started].index    = started;
+        if(0 != pthread_create(&executor->workers[started].thread,NULL,ExecutorWorker,&executor->workers[started])) {
+            break;
+        }
+    }
+    if(started < num_workers) {
+        LOG_ERROR("Only started %u of %u executor threads\n",started,num_workers);
+        //The ones that did start only ever look at the queues we have threads for
+        executor->num_workers = started;
+        if(0 == started) {
+            armv2_executor_destroy(executor);
+            return ARMV2STATUS_MEMORY_ERROR;
+        }
+    }
+    *out = executor;
+    return ARMV2STATUS_OK;
+}
+
+//Stop the workers after the slices they're running and free the executor. Jobs that haven't finished are
+//marked done with whatever they had left in remaining, so awaiting them afterwards returns straight away.
+//Nobody can be awaiting a job or raising a pin on one of its cpus while this is going on
+void armv2_executor_destroy(armv2_executor_t *executor) {
+    if(NULL == executor) {
+        return;
+    }
+    pthread_mutex_lock(&executor->lock);
+    __atomic_store_n(&executor->stopping,1,__ATOMIC_RELEASE);
+    pthread_cond_broadcast(&executor->work);
+    pthread_mutex_unlock(&executor->lock);
+    for(uint32_t i=0;i<executor->num_workers;i++) {
+        pthread_join(executor->workers[i].thread,NULL);
+    }
+    for(uint32_t i=0;i<executor->num_workers;i++) {
+        armv2_job_t *job;
+        while(NULL != (job = Pop(executor,i))) {
+            Finish(executor,job,ARMV2STATUS_OK);
+        }
+    }
+    while(executor->parked) {
+        armv2_job_t *job = executor->parked;
+        executor->parked = job->next;
+        Finish(executor,job,ARMV2STATUS_OK);
+    }
+    pthread_cond_destroy(&executor->finished);
+    pthread_cond_destroy(&executor->work);
+    pthread_mutex_destroy(&executor->lock);
+    free(executor->workers);
+    free(executor->queues);
+    free(executor);
+}
+
+//Have the executor run cpu for instructions, or until a breakpoint if that's -1. That's unlike run_armv2,
+//for which -1 means run forever treating breakpoints as SWIs: the job is run a slice at a time, so it stops
+//at one. Until the job has been awaited the cpu belongs to the executor, and only its pins and lines can be
+//touched
+enum armv2_status armv2_submit(armv2_executor_t *executor, armv2_job_t *job, armv2_t *cpu, int32_t instructions) {
+    armv2_executor_t *expected = NULL;
+
+    if(NULL == executor || NULL == job || NULL == cpu || !CPU_INITIALISED(cpu) || instructions < -1) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    if(0 != instructions && !__atomic_compare_exchange_n(&cpu->executor,&expected,executor,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST)) {
+        //It's already running somewhere
+        return ARMV2STATUS_INVALID_CPUSTATE;
+    }
+    job->cpu       = cpu;
+    job->executor  = executor;
+    job->next      = NULL;
+    job->remaining = instructions;
+    job->result    = ARMV2STATUS_OK;
+    job->parked    = 0;
+    job->done      = (0 == instructions);
+    if(job->done) {
+        return ARMV2STATUS_OK;
+    }
+    Push(executor,__atomic_fetch_add(&executor->next_queue,1,__ATOMIC_RELAXED)%executor->num_workers,job);
+    return ARMV2STATUS_OK;
+}
+
+//Block until the job is done, returning how it finished: ARMV2STATUS_OK if it ran all its instructions,
+//ARMV2STATUS_BREAKPOINT if it stopped at one
+enum armv2_status armv2_await(armv2_job_t *job) {
+    armv2_executor_t *executor;
+    if(NULL == job) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    if(__atomic_load_n(&job->done,__ATOMIC_ACQUIRE)) {
+        return job->result;
+    }
+    executor = job->executor;
+    pthread_mutex_lock(&executor->lock);
+    while(!job->done) {
+        pthread_cond_wait(&executor->finished,&executor->lock);
+    }
+    pthread_mutex_unlock(&executor->lock);
+    return job->result;
+}
+
+//Called whenever IRQ or FIQ is raised on a cpu, to put it back in a queue if it's parked
+void ExecutorWake(armv2_t *cpu) {
+    armv2_executor_t *executor = __atomic_load_n(&cpu->executor,__ATOMIC_ACQUIRE);
+    armv2_job_t **link;
+    if(NULL == executor) {
+        return;
+    }
+    pthread_mutex_lock(&executor->lock);
+    for(link = &executor->parked; *link; link = &(*link)->next) {
+        armv2_job_t *job = *link;
+        if(job->cpu == cpu) {
+            *link = job->next;
+            job->parked = 0;
+            pthread_mutex_unlock(&executor->lock);
+            Push(executor,__atomic_fetch_add(&executor->next_queue,1,__ATOMIC_RELAXED)%executor->num_workers,job);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&executor->lock);
+}
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "testutil.h"
+
+//Check the executor: a worker with nothing left in its own queue steals from the others and the cpus end
+//up exactly where running them by themselves puts them, a job whose guest waits for an interrupt is parked
+//until a pin is raised and then stops at a breakpoint, and awaiting a job that's already finished returns
+//how it finished straight away
+
+#define LONG_RUN    (40*EXECUTOR_SLICE)
+#define BKPT        (0xef000000 | SWI_BREAKPOINT)
+
+//mov r9,#0x10000 ; loop: ldr r0,[r9] ; add r1,r1,r0 ; b loop, reading from a device that notes which thread
+//ran the cpu
+static const uint32_t read_program[] = {
+    0xe3a09801, 0xe5990000, 0xe0811000, 0xeafffffc,
+};
+
+//Waits for an interrupt with nothing scheduled that could ever give it one, and has a breakpoint for its FIQ
+//handler
+static const uint32_t wait_program[] = {
+    [0x00/4] = 0xea000006, //b 0x20
+    [0x1c/4] = BKPT,       //fiq
+    [0x20/4] = 0xee000300, //wait: cdp p3,0 (wait for interrupt)
+               0xeafffffd, //b wait
+};
+
+typedef struct {
+    pthread_t first;
+    uint32_t  reads;
+    uint32_t  moved; //read from a different thread than the first time
+} threads_t;
+
+static uint32_t ThreadRead(void *extra, uint32_t addr, uint32_t value) {
+    threads_t *threads = extra;
+    if(0 == threads->reads++) {
+        threads->first = pthread_self();
+    }
+    else if(!pthread_equal(threads->first,pthread_self())) {
+        threads->moved = 1;
+    }
+    return 1;
+}
+
+static uint32_t IgnoreWrite(void *extra, uint32_t addr, uint32_t value) {
+    return 0;
+}
+
+//Jobs are shared out over the queues in the order they're submitted, so with two workers the two long ones
+//go in the first worker's queue and the short one in the second's. Once it's done that the second worker
+//has nothing of its own, so unless it steals the first worker runs both long jobs by itself
+static void CheckStealing(void) {
+    static const int32_t runs[] = {LONG_RUN, 1, LONG_RUN};
+    armv2_executor_t *executor;
+    armv2_t cpus[3], solo[3];
+    armv2_job_t jobs[3], spare;
+    threads_t threads[3], solo_threads[3];
+    hardware_device_t devices[3], solo_devices[3];
+    enum armv2_status result;
+
+    memset(threads,0,sizeof(threads));
+    if(ARMV2STATUS_OK != armv2_executor_create(&executor,2)) {
+        printf("Error creating the executor\n");
+        exit(1);
+    }
+    for(uint32_t i=0;i<3;i++) {
+        devices[i] = (hardware_device_t){.device_id = 0x54485244, .read_callback = ThreadRead,
+                                         .write_callback = IgnoreWrite, .extra = &threads[i]};
+        solo_devices[i] = devices[i];
+        solo_devices[i].extra = &solo_threads[i];
+        SetupCpu(&cpus[i],read_program,sizeof(read_program));
+        AddDevice(&cpus[i],&devices[i],0x10000);
+        SetupCpu(&solo[i],read_program,sizeof(read_program));
+        AddDevice(&solo[i],&solo_devices[i],0x10000);
+        if(ARMV2STATUS_OK != (result = armv2_submit(executor,&jobs[i],&cpus[i],runs[i]))) {
+            printf("Error %d submitting job %u\n",result,i);
+            exit(1);
+        }
+    }
+    if(ARMV2STATUS_INVALID_CPUSTATE != armv2_submit(executor,&spare,&cpus[0],1)) {
+        printf("Submitted a cpu that was already running\n");
+        failures++;
+        armv2_await(&spare);
+    }
+    for(uint32_t i=0;i<3;i++) {
+        if(ARMV2STATUS_OK != (result = armv2_await(&jobs[i]))) {
+            printf("Job %u finished with %d\n",i,result);
+            failures++;
+        }
+        run_armv2(&solo[i],runs[i]);
+        CompareState(&solo[i],&cpus[i],"Job %u run by the executor",i);
+    }
+    if(!threads[0].moved && !threads[2].moved && pthread_equal(threads[0].first,threads[2].first)) {
+        printf("The second worker never stole from the first\n");
+        failures++;
+    }
+    armv2_executor_destroy(executor);
+    for(uint32_t i=0;i<3;i++) {
+        cleanup_armv2(&cpus[i]);
+        cleanup_armv2(&solo[i]);
+    }
+}
+
+static int WaitFor(uint32_t *flag) {
+    for(uint32_t i=0;i<5000;i++) {
+        if(__atomic_load_n(flag,__ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+//Running until a breakpoint, the guest halts and the job should be parked rather than going round the
+//queues. Raising FIQ has to get it going again, and the breakpoint in the handler stops it
+static void CheckParking(void) {
+    armv2_executor_t *executor;
+    armv2_t cpu, parked;
+    armv2_job_t job, parked_job;
+    enum armv2_status result;
+
+    if(ARMV2STATUS_OK != armv2_executor_create(&executor,2)) {
+        printf("Error creating the executor\n");
+        exit(1);
+    }
+    SetupCpu(&cpu,wait_program,sizeof(wait_program));
+    SetupCpu(&parked,wait_program,sizeof(wait_program));
+    armv2_submit(executor,&job,&cpu,-1);
+    armv2_submit(executor,&parked_job,&parked,-1);
+    if(!WaitFor(&job.parked) || !(cpu.flags&FLAG_HALTED) || job.done) {
+        printf("The halted cpu wasn't parked\n");
+        failures++;
+    }
+    armv2_raise_pins(&cpu,PIN_F);
+    if(ARMV2STATUS_BREAKPOINT != (result = armv2_await(&job)) || cpu.pc+4 != 0x1c) {
+        printf("Woken by FIQ the job finished with %d at %08x\n",result,cpu.pc+4);
+        failures++;
+    }
+    if(!WaitFor(&parked_job.parked) || parked_job.done) {
+        printf("The other halted cpu wasn't parked\n");
+        failures++;
+    }
+    //Destroying the executor finishes any jobs still parked
+    armv2_executor_destroy(executor);
+    if(!parked_job.done || ARMV2STATUS_OK != armv2_await(&parked_job)) {
+        printf("Destroying the executor didn't finish the parked job\n");
+        failures++;
+    }
+    cleanup_armv2(&cpu);
+    cleanup_armv2(&parked);
+}
+
+//Awaiting a job that has already finished, or again after awaiting it, gives how it finished without
+//blocking. A job of no instructions is done as soon as it's submitted
+static void CheckFinished(void) {
+    armv2_executor_t *executor;
+    armv2_t cpu;
+    armv2_job_t job;
+    enum armv2_status result;
+
+    if(ARMV2STATUS_OK != armv2_executor_create(&executor,1)) {
+        printf("Error creating the executor\n");
+        exit(1);
+    }
+    SetupCpu(&cpu,wait_program,sizeof(wait_program));
+    cpu.physical_ram[0x20/4] = BKPT;
+    armv2_submit(executor,&job,&cpu,1000);
+    if(!WaitFor(&job.done)) {
+        printf("The job never finished\n");
+        failures++;
+    }
+    for(uint32_t i=0;i<2;i++) {
+        if(ARMV2STATUS_BREAKPOINT != (result = armv2_await(&job))) {
+            printf("Awaiting the finished job gave %d\n",result);
+            failures++;
+        }
+    }
+    if(ARMV2STATUS_OK != armv2_submit(executor,&job,&cpu,0) || !job.done || ARMV2STATUS_OK != armv2_await(&job)) {
+        printf("A job of no instructions wasn't done straight away\n");
+        failures++;
+    }
+    armv2_executor_destroy(executor);
+    cleanup_armv2(&cpu);
+}
+
+int main(int argc, char *argv[]) {
+    CheckStealing();
+    CheckParking();
+    CheckFinished();
+    return Finish(argv[0]);
+}
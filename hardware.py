@@ -122,6 +122,11 @@ class Machine:
         with self.cv:
             return self.cpu.pc
 
+    @property
+    def cycles(self):
+        with self.cv:
+            return self.cpu.cycles
+
     def threadMain(self):
         with self.cv:
             while self.running:
@@ -144,6 +149,68 @@ class Machine:
         if name != None:
             setattr(self,name,device)
 
+    def LoadDevice(self,filename,args = None,name = None):
+        with self.cv:
+            device = self.cpu.LoadDevice(filename,args)
+        self.hardware.append(device)
+        if name != None:
+            setattr(self,name,device)
+        return device
+
+    def AddTimer(self,name = None):
+        with self.cv:
+            device = self.cpu.AddTimer()
+        self.hardware.append(device)
+        if name != None:
+            setattr(self,name,device)
+        return device
+
+    def Snapshot(self):
+        with self.cv:
+            return self.cpu.Snapshot()
+
+    def Restore(self,snapshot):
+        with self.cv:
+            self.cpu.Restore(snapshot)
+
+    def Rewind(self,cycle):
+        with self.cv:
+            self.cpu.Rewind(cycle)
+
+    #Unlike Step this runs on the calling thread, which has to wait for the cpu thread to finish first. It
+    #stops at cycle or at a breakpoint, and returns the status
+    def RunTo(self,cycle):
+        with self.cv:
+            result = armv2.Status.Ok
+            while result == armv2.Status.Ok and self.cpu.cycles < cycle:
+                result = self.cpu.Step(min(cycle - self.cpu.cycles,0x7fffffff))
+            return result
+
+    def Record(self,filename):
+        with self.cv:
+            self.cpu.Record(filename)
+
+    def StopReplay(self):
+        with self.cv:
+            self.cpu.StopReplay()
+
+    #These don't take the lock, as the point is to be able to interrupt the cpu thread while it's running
+    def RaiseInterrupt(self,pins):
+        self.cpu.RaiseInterrupt(pins)
+
+    def LowerInterrupt(self,pins):
+        self.cpu.LowerInterrupt(pins)
+
+    def RaiseLine(self,line):
+        self.cpu.RaiseLine(line)
+
+    def LowerLine(self,line):
+        self.cpu.LowerLine(line)
+
+    def FrameDevices(self):
+        with self.cv:
+            self.cpu.FrameDevices()
+
     def Delete(self):
         with self.cv:
             self.running = False
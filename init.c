@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #include "armv2.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,6 +6,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 
 enum armv2_status init(armv2_t *cpu, uint32_t memsize) {
@@ -12,75 +14,68 @@ enum armv2_status init(armv2_t *cpu, uint32_t memsize) {
     enum armv2_status retval = ARMV2STATUS_OK;
 
     if(NULL == cpu) {
-        LOG("%s error, NULL cpu\n",__func__);
+        LOG_ERROR("%s error, NULL cpu\n",__func__);
         return ARMV2STATUS_INVALID_CPUSTATE;
     }
     //round memsize up to a full page
     memsize = (memsize + PAGE_MASK)&(~PAGE_MASK);
     if(memsize&PAGE_MASK) {
-        LOG("Page mask erro\n");
+        LOG_ERROR("Page mask erro\n");
         return ARMV2STATUS_VALUE_ERROR;
     }
     num_pages = memsize>>PAGE_SIZE_BITS;
     if(num_pages > NUM_PAGE_TABLES) {
-        LOG("Serious page table error, too many requested\n");
+        LOG_ERROR("Serious page table error, too many requested\n");
         return ARMV2STATUS_VALUE_ERROR;
     }
     if(memsize > MAX_MEMORY) {
-        LOG("%s error, request memory size(%u) too big\n",__func__,memsize);
+        LOG_ERROR("%s error, request memory size(%u) too big\n",__func__,memsize);
         return ARMV2STATUS_VALUE_ERROR;
     }
     memset(cpu,0,sizeof(armv2_t));
-    cpu->physical_ram = malloc(memsize);
-    if(NULL == cpu->physical_ram) {
+    pthread_mutex_init(&cpu->wakeup_lock,NULL);
+    pthread_cond_init(&cpu->wakeup,NULL);
+    for(uint32_t i=0;i<PAGE_DIRECTORY_SIZE;i++) {
+        cpu->page_directory[i] = empty_page_table;
+    }
+    //Anonymous mappings are zero filled on demand, so the parts of RAM the guest never touches don't cost
+    //anything
+    cpu->physical_ram = mmap(NULL,memsize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(MAP_FAILED == cpu->physical_ram) {
         cpu->physical_ram = NULL;
-        return ARMV2STATUS_MEMORY_ERROR;
+        retval = ARMV2STATUS_MEMORY_ERROR;
+        goto cleanup;
     }
     cpu->physical_ram_size = memsize;
-    LOG("Have %u pages %u\n",num_pages,memsize);
-    memset(cpu->physical_ram,0,memsize);
-
-    //map the physical ram at 0
-    //we could malloc all the page tables for it at once, but all the extra bookkeeping would
-    //be annoying
+    LOG_INFO("Have %u pages %u\n",num_pages,memsize);
 
-    for(uint32_t i=0;i<num_pages;i++) {
-        page_info_t *page_info = calloc(1,sizeof(page_info_t));
-        if(NULL == page_info) {
-            retval = ARMV2STATUS_MEMORY_ERROR;
-            goto cleanup;
-        }
-        page_info->memory = cpu->physical_ram + i*WORDS_PER_PAGE;
-        //LOG("Page %u memory %p\n",i,(void*)page_info->memory);
-        page_info->flags |= (PERM_READ|PERM_EXECUTE|PERM_WRITE);
-        if(i == 0) {
-            //the first page is never writable, we'll put the boot rom there.
-            page_info->flags &= (~PERM_WRITE);
-        }
-        cpu->page_tables[i] = page_info;
+    //map the physical ram at 0, with the page infos for all of it in one allocation. GetPage fills each one
+    //in and puts it in the page table when it's first used
+    cpu->ram_pages = calloc(num_pages,sizeof(page_info_t));
+    if(NULL == cpu->ram_pages) {
+        retval = ARMV2STATUS_MEMORY_ERROR;
+        goto cleanup;
     }
 
     cpu->flags = FLAG_INIT;
+    flush_tlb(cpu);
 
     cpu->regs.actual[PC] = MODE_SUP;
     cpu->pins = 0;
+    ResetInterruptController(cpu);
+    IDLE_RESET(cpu);
     cpu->pc = -4; //hack because it gets incremented on the first loop
 
-    for(uint32_t i=0;i<NUM_EFFECTIVE_REGS;i++) {
-        cpu->regs.effective[i] = &cpu->regs.actual[i];
-    }
-
-    //Set up the exception conditions
+    //Set up the exception conditions. save_reg is the register the return address goes in once the
+    //registers for the new mode have been swapped in
     for(uint32_t i=0;i<EXCEPT_NONE;i++) {
         cpu->exception_handlers[i].mode     = MODE_SUP;
         cpu->exception_handlers[i].pc       = i*4;
         cpu->exception_handlers[i].flags    = FLAG_I;
-        cpu->exception_handlers[i].save_reg = LR_S;
+        cpu->exception_handlers[i].save_reg = LR;
     }
     cpu->exception_handlers[EXCEPT_IRQ].mode     = MODE_IRQ;
-    cpu->exception_handlers[EXCEPT_IRQ].save_reg = LR_I;
     cpu->exception_handlers[EXCEPT_FIQ].mode     = MODE_FIQ;
-    cpu->exception_handlers[EXCEPT_FIQ].save_reg = LR_F;
     cpu->exception_handlers[EXCEPT_FIQ].flags |= FLAG_F;
     cpu->exception_handlers[EXCEPT_RST].flags |= FLAG_F;
 
@@ -93,20 +88,55 @@ cleanup:
 }
 
 enum armv2_status cleanup_armv2(armv2_t *cpu) {
-    LOG("ARMV2 cleanup\n");
+    LOG_INFO("ARMV2 cleanup\n");
     if(NULL == cpu) {
         return ARMV2STATUS_OK;
     }
-    if(NULL != cpu->physical_ram) {
-        free(cpu->physical_ram);
-        cpu->physical_ram = NULL;
+#ifdef ARMV2_JIT
+    jit_cleanup(cpu);
+#endif
+    armv2_stop_replay(cpu);
+    release_snapshots(cpu);
+    //Native devices belong to us, anything else was added by someone who'll free it themselves
+    for(uint32_t i=0;i<cpu->num_hardware_devices;i++) {
+        unload_device(cpu->hardware_devices[i]);
+        cpu->hardware_devices[i] = NULL;
     }
-    for(uint32_t i=0;i<NUM_PAGE_TABLES;i++) {
-        if(NULL != cpu->page_tables[i]) {
-            free(cpu->page_tables[i]);
-            cpu->page_tables[i] = NULL;
+    cpu->num_hardware_devices = 0;
+    for(uint32_t i=0;i<PAGE_DIRECTORY_SIZE;i++) {
+        page_info_t **table = cpu->page_directory[i];
+        if(NULL == table || empty_page_table == table) {
+            continue;
+        }
+        for(uint32_t j=0;j<PAGE_TABLE_SIZE;j++) {
+            page_info_t *page = table[j];
+            if(NULL == page) {
+                continue;
+            }
+            if(NULL != page->decoded && !(page->flags&PAGE_SHARED)) {
+                free(page->decoded);
+            }
+            //The RAM pages are freed all together below
+            if(NULL == cpu->ram_pages || page < cpu->ram_pages ||
+               page >= cpu->ram_pages + (cpu->physical_ram_size>>PAGE_SIZE_BITS)) {
+                free(page);
+            }
         }
+        free(table);
+        cpu->page_directory[i] = empty_page_table;
+    }
+    if(NULL != cpu->ram_pages) {
+        free(cpu->ram_pages);
+        cpu->ram_pages = NULL;
     }
+    if(NULL != cpu->physical_ram) {
+        munmap(cpu->physical_ram,cpu->physical_ram_size);
+        cpu->physical_ram = NULL;
+    }
+    release_rom(cpu->rom);
+    cpu->rom = NULL;
+    pthread_cond_destroy(&cpu->wakeup);
+    pthread_mutex_destroy(&cpu->wakeup_lock);
     return ARMV2STATUS_OK;
 }
 
@@ -122,7 +152,7 @@ enum armv2_status load_rom(armv2_t *cpu, const char *filename) {
     if(!(cpu->flags&FLAG_INIT)) {
         return ARMV2STATUS_INVALID_CPUSTATE;
     }
-    if(NULL == cpu->page_tables[0] || NULL == cpu->page_tables[0]->memory) {
+    if(NULL == GetPage(cpu,0) || NULL == GetPage(cpu,0)->memory) {
         return ARMV2STATUS_INVALID_CPUSTATE;
     }
     if(0 != stat(filename,&st)) {
@@ -135,17 +165,22 @@ enum armv2_status load_rom(armv2_t *cpu, const char *filename) {
     }
     f = fopen(filename,"rb");
     if(NULL == f) {
-        LOG("Error opening %s\n",filename);
+        LOG_ERROR("Error opening %s\n",filename);
         return ARMV2STATUS_IO_ERROR;
     }
     while(size > 0) {
-        read_bytes = fread(cpu->page_tables[page_num++]->memory,1,PAGE_SIZE,f);
+        invalidate_page(cpu,page_num);
+        retval = prepare_page_write(cpu,page_num);
+        if(ARMV2STATUS_OK != retval) {
+            goto close_file;
+        }
+        read_bytes = fread(GetPage(cpu,page_num++)->memory,1,PAGE_SIZE,f);
 
         if(read_bytes < PAGE_SIZE) {
             //It's ok if it's all that's left
 
             if(read_bytes != size) {
-                LOG("Error %d %zd %zd\n",page_num,read_bytes,size);
+                LOG_ERROR("Error %d %zd %zd\n",page_num,read_bytes,size);
                 retval = ARMV2STATUS_IO_ERROR;
                 goto close_file;
             }
@@ -204,7 +239,7 @@ enum armv2_status map_memory(armv2_t *cpu, uint32_t device_num, uint32_t start,
         if(page_pos >= NUM_PAGE_TABLES) { // || page_pos == INTERRUPT_PAGE_NUM) {
             return ARMV2STATUS_MEMORY_ERROR;
         }
-        page = cpu->page_tables[page_pos];
+        page = GetPage(cpu,page_pos);
         if(page == NULL) {
             //That's OK, that means this page is currently completely unmapped. We can make a page just for this
             continue;
@@ -216,7 +251,7 @@ enum armv2_status map_memory(armv2_t *cpu, uint32_t device_num, uint32_t start,
     hw_mapping.device = cpu->hardware_devices[device_num];
     //If we get here then the entire range is free, so we can go ahead and fill it in
     for(page_pos = page_start; page_pos < page_end; page_pos++) {
-        page_info_t *page    = cpu->page_tables[page_pos];
+        page_info_t *page    = GetPage(cpu,page_pos);
         if(NULL == page) {
             //we need a new page
             page = calloc(1,sizeof(page_info_t));
@@ -225,15 +260,22 @@ enum armv2_status map_memory(armv2_t *cpu, uint32_t device_num, uint32_t start,
                 return ARMV2STATUS_MEMORY_ERROR;
             }
             page->memory = NULL;
-            if(hw_mapping.device) {
-                page->mapped_device = hw_mapping.device->extra;
+            if(ARMV2STATUS_OK != set_page(cpu,page_pos,page)) {
+                free(page);
+                return ARMV2STATUS_MEMORY_ERROR;
             }
-            cpu->page_tables[page_pos] = page;
         }
         //Already checked everything's OK, and we're single threaded, so this should be ok I think...
-        LOG("Setting page_pos %x to callbacks %p %p\n",page_pos,hw_mapping.device->read_callback,hw_mapping.device->write_callback);
-        page->read_callback  = hw_mapping.device->read_callback;
-        page->write_callback = hw_mapping.device->write_callback;
+        LOG_INFO("Setting page_pos %x to callbacks %p %p\n",page_pos,hw_mapping.device->read_callback,hw_mapping.device->write_callback);
+        //RAM pages get the device too, it's mapped over the top of them
+        page->mapped_device        = hw_mapping.device->extra;
+        page->read_callback        = hw_mapping.device->read_callback;
+        page->write_callback       = hw_mapping.device->write_callback;
+        page->read_byte_callback   = hw_mapping.device->read_byte_callback;
+        page->write_byte_callback  = hw_mapping.device->write_byte_callback;
+        page->read_block_callback  = hw_mapping.device->read_block_callback;
+        page->write_block_callback = hw_mapping.device->write_block_callback;
+        flush_tlb_page(cpu,page_pos);
     }
 
     hw_mapping.start = start;
@@ -245,11 +287,11 @@ enum armv2_status map_memory(armv2_t *cpu, uint32_t device_num, uint32_t start,
 }
 
 enum armv2_status add_mapping(hardware_mapping_t **head,hardware_mapping_t *item) {
-    LOG("Apping mad! *p *p\n",*head,item);
     if(NULL == head) {
-        LOG("Mapping jim NULL\n");
+        LOG_ERROR("Mapping jim NULL\n");
         return ARMV2STATUS_INVALID_ARGS;
     }
+    LOG_INFO("Adding mapping %p before %p\n",item,*head);
     item->next = *head;
     *head = item;
     return ARMV2STATUS_OK;
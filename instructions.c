@@ -1,6 +1,7 @@
 #include "armv2.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 #define ALU_TYPE_IMM 0x02000000
 #define MUL_TYPE_MLA 0x00200000
@@ -49,7 +50,8 @@ uint32_t OperandShift(armv2_t *cpu, uint32_t bits, uint32_t type_flag, uint32_t
     uint32_t rm = bits&0xf;
     uint32_t shift_type = (bits>>5)&0x3;
     uint32_t shift_amount;
-    uint32_t shift_c = 0;
+    //Anything that doesn't shift at all leaves the carry as it was
+    uint32_t shift_c = (cpu->regs.actual[PC]>>29)&1;
     uint32_t op2;
     if(type_flag) {
             //shift amount comes from a register
@@ -72,7 +74,10 @@ uint32_t OperandShift(armv2_t *cpu, uint32_t bits, uint32_t type_flag, uint32_t
 
     switch(shift_type) {
     case ALU_SHIFT_LSL:
-        if(shift_amount < 32) {
+        if(shift_amount == 0) {
+            //LSL #0 is no shift at all, by an immediate or a register
+        }
+        else if(shift_amount < 32) {
             shift_c = (op2>>(32-shift_amount))&1;
             op2 <<= shift_amount;
         }
@@ -89,7 +94,7 @@ uint32_t OperandShift(armv2_t *cpu, uint32_t bits, uint32_t type_flag, uint32_t
         if(shift_amount == 0) {
             if(type_flag == 0) {
                 //this means LSR 32
-                shift_c = op2&0x80000000;
+                shift_c = op2>>31;
                 op2 = 0;
             }
         }
@@ -98,7 +103,7 @@ uint32_t OperandShift(armv2_t *cpu, uint32_t bits, uint32_t type_flag, uint32_t
             op2 >>= shift_amount;
         }
         else if(shift_amount == 32) {
-            shift_c = op2&0x80000000;
+            shift_c = op2>>31;
             op2 = 0;
         }
         else {
@@ -119,29 +124,29 @@ uint32_t OperandShift(armv2_t *cpu, uint32_t bits, uint32_t type_flag, uint32_t
             op2 = (uint32_t)(((int32_t)op2)>>shift_amount);
         }
         else {
-            shift_c = (shift_amount>>31)&1;
+            //Anything from 32 up fills it with the sign
+            shift_c = (op2>>31)&1;
             op2 = shift_c*0xffffffff;
         }
         break;
     case ALU_SHIFT_ROR:
-        if(shift_amount > 32) {
-            //This is not clear to me from the spec. Should this do the same as 32 or as 0? Go with zero for now
-            shift_amount &= 0x1f;
-        }
         if(shift_amount == 0) {
             if(type_flag == 0) {
                 //this means something weird. RRX
+                uint32_t carry_in = shift_c;
                 shift_c = op2&1;
-                op2 = (op2>>1) | (((cpu->regs.actual[PC]>>29)&1)<<31);
+                op2 = (op2>>1) | (carry_in<<31);
             }
         }
-        else if (shift_amount < 32){
+        else if((shift_amount&0x1f) == 0) {
+            //A rotate by a multiple of 32 leaves the value alone, but bit 31 is carried out
+            shift_c = op2>>31;
+        }
+        else {
+            shift_amount &= 0x1f;
             shift_c = (op2>>(shift_amount-1))&1;
             op2 = (op2>>shift_amount) | (op2<<(32-shift_amount));
         }
-        else if (shift_amount == 32) {
-            shift_c = op2&0x80000000;
-        }
         break;
     }
     if(carry) {
@@ -150,13 +155,15 @@ uint32_t OperandShift(armv2_t *cpu, uint32_t bits, uint32_t type_flag, uint32_t
     return op2;
 }
 
-static enum armv2_status PerformLoad(page_info_t *page, uint32_t addr, uint32_t *out) {
+static enum armv2_status PerformLoad(armv2_t *cpu, page_info_t *page, uint32_t addr, uint32_t *out) {
     uint32_t value;
     if(NULL == page || NULL == out) {
         return ARMV2STATUS_INVALID_ARGS;
     }
     if(page->read_callback) {
-        value = page->read_callback(page->mapped_device,INPAGE(addr),0);
+        //A device can give a different answer every time, so a loop polling one isn't idle
+        IDLE_RESET(cpu);
+        value = DeviceRead(cpu,page,page->read_callback,INPAGE(addr),REPLAY_READ);
     }
     else if(NULL != page->memory) {
         value = page->memory[INPAGE(addr)>>2];
@@ -170,15 +177,23 @@ static enum armv2_status PerformLoad(page_info_t *page, uint32_t addr, uint32_t
     return ARMV2STATUS_OK;
 }
 
-static enum armv2_status PerformStore(page_info_t *page, uint32_t addr, uint32_t value) {
+static enum armv2_status PerformStore(armv2_t *cpu, page_info_t *page, uint32_t addr, uint32_t value) {
     if(NULL == page) {
         return ARMV2STATUS_INVALID_ARGS;
     }
     if(page->write_callback) {
-        page->write_callback(page->mapped_device,INPAGE(addr),value);
+        DeviceWrite(cpu,page,page->write_callback,INPAGE(addr),value);
     }
     else if(NULL != page->memory) {
+        //If the page can't be saved the snapshots it belongs to are marked as such and refuse to be
+        //restored, which is all the guest could be told anyway
+        if(page->flags&PAGE_COW) {
+            (void) SnapshotPage(cpu,page);
+        }
+        MarkDirty(cpu,PAGEOF(addr));
         page->memory[INPAGE(addr)>>2] = value;
+        //If we've been executing from this page the word needs decoding again
+        INVALIDATE_DECODED(cpu,page,addr);
     }
     else {
         //No callback and no memory page is an error
@@ -188,30 +203,76 @@ static enum armv2_status PerformStore(page_info_t *page, uint32_t addr, uint32_t
     return ARMV2STATUS_OK;
 }
 
-enum armv2_exception ALUInstruction                         (armv2_t *cpu,uint32_t instruction)
+//Write the whole of r15 from a privileged mode, which might move us to a different mode
+static void WritePrivilegedR15(armv2_t *cpu, uint32_t value) {
+    uint32_t old_mode = GETMODE(cpu);
+    cpu->regs.actual[PC] = value;
+    if(GETMODE(cpu) != old_mode) {
+        SwapBanks(cpu,old_mode,GETMODE(cpu));
+    }
+}
+
+//Write the NZCV the last flag setting instruction would have set into the PSR
+void ResolveFlags(armv2_t *cpu) {
+    lazy_flags_t *lazy = &cpu->lazy_flags;
+    uint32_t psr = cpu->regs.actual[PC]&0x0fffffff;
+    psr |= lazy->result&FLAG_N;
+    psr |= lazy->result == 0 ? FLAG_Z : 0;
+    switch(lazy->kind) {
+    case FLAGS_LOGIC:
+        psr |= lazy->carry ? FLAG_C : 0;
+        psr |= cpu->regs.actual[PC]&FLAG_V;
+        break;
+    case FLAGS_ARITH:
+        psr |= ((((uint64_t)lazy->op1) + lazy->op2 + lazy->carry)>>32) ? FLAG_C : 0;
+        /*      ADDITION SIGN BITS */
+        /*    num1sign num2sign sumsign */
+        /*   --------------------------- */
+        /*        0 0 0 */
+        /* *OVER* 0 0 1 (adding two positives should be positive) */
+        /*        0 1 0 */
+        /*        0 1 1 */
+        /*        1 0 0 */
+        /*        1 0 1 */
+        /* *OVER* 1 1 0 (adding two negatives should be negative) */
+        /*        1 1 1 */
+        psr |= ((lazy->op1^lazy->op2^0x80000000)&(lazy->op1^lazy->result)&0x80000000) ? FLAG_V : 0;
+        break;
+    }
+    cpu->regs.actual[PC] = psr;
+    lazy->kind = FLAGS_RESOLVED;
+}
+
+//The body of every data processing instruction. The specialised handlers below call this with constant
+//opcode, form, sets_flags and rd_is_pc so each one compiles down to just the work it has to do
+static inline __attribute__((always_inline)) enum armv2_exception ALUOperation(armv2_t *cpu, uint32_t instruction,
+                                                                               uint32_t opcode, uint32_t form,
+                                                                               uint32_t sets_flags, uint32_t rd_is_pc)
 {
-    uint32_t opcode   = (instruction>>21)&0xf;
     uint32_t rn       = (instruction>>16)&0xf;
     uint32_t rd       = (instruction>>12)&0xf;
     uint32_t result   = 0;
     uint32_t source_val;
+    //Only trustworthy if the instruction was decoded as DECODED_NEEDS_FLAGS, which any instruction that
+    //actually uses them will be
     uint32_t shift_c = (cpu->regs.actual[PC]&FLAG_C);
-    uint32_t arith_v = cpu->regs.actual[PC]&FLAG_V;
-    uint64_t result64;
-    if(instruction&ALU_TYPE_IMM) {
+    uint32_t flags_kind = FLAGS_LOGIC;
+    if(form == ALU_FORM_IMMEDIATE) {
         uint32_t right_rotate = (instruction>>7)&0x1e;
         if(right_rotate != 0) {
             source_val = ((instruction&0xff) << (32-right_rotate)) | ((instruction&0xff) >> right_rotate);
+            //The rotation goes through the shifter, which carries out the last bit it rotated round
+            shift_c    = source_val>>31;
         }
         else {
             source_val = instruction&0xff;
         }
     }
     else {
-        source_val = OperandShift(cpu,instruction&0xfff,instruction&0x10,&shift_c);
+        source_val = OperandShift(cpu,instruction&0xfff,form == ALU_FORM_REGISTER_SHIFT ? 0x10 : 0,&shift_c);
     }
-    uint32_t op2;
-    uint32_t op1;
+    uint32_t op2 = 0;
+    uint32_t op1 = 0;
     uint32_t carry = (cpu->regs.actual[PC]>>29)&1;
     uint32_t rn_val = GETREG(cpu,rn);
     switch(opcode) {
@@ -225,65 +286,38 @@ enum armv2_exception ALUInstruction                         (armv2_t *cpu,uint32
         break;
     case ALU_OPCODE_SUB:
     case ALU_OPCODE_CMP:
-        op2 = ~source_val;
         op1 = rn_val;
-        result64 = ((uint64_t)op1) + op2 + 1;
-        result = result64&0xffffffff;
-        shift_c = result64>>32;
-        /*      ADDITION SIGN BITS */
-        /*    num1sign num2sign sumsign */
-        /*   --------------------------- */
-        /*        0 0 0 */
-        /* *OVER* 0 0 1 (adding two positives should be positive) */
-        /*        0 1 0 */
-        /*        0 1 1 */
-        /*        1 0 0 */
-        /*        1 0 1 */
-        /* *OVER* 1 1 0 (adding two negatives should be negative) */
-        /*        1 1 1 */
-
-        arith_v = (op1^op2^0x80000000)&(op1^result)&0x80000000;
+        op2 = ~source_val;
+        carry = 1;
+        flags_kind = FLAGS_ARITH;
         break;
     case ALU_OPCODE_RSB:
         op1 = source_val;
         op2 = ~rn_val;
-        result64 = ((uint64_t)op1) + op2 + 1;
-        result = result64&0xffffffff;
-        shift_c = result64>>32;
-        arith_v = (op1^op2^0x80000000)&(op1^result)&0x80000000;
+        carry = 1;
+        flags_kind = FLAGS_ARITH;
         break;
     case ALU_OPCODE_ADD:
     case ALU_OPCODE_CMN:
-        op2 = source_val;
         op1 = rn_val;
-        result64 = ((uint64_t)op1) + op2;
-        result = result64&0xffffffff;
-        shift_c = result64>>32;
-        arith_v = (op1^op2^0x80000000)&(op1^result)&0x80000000;
+        op2 = source_val;
+        carry = 0;
+        flags_kind = FLAGS_ARITH;
         break;
     case ALU_OPCODE_ADC:
         op1 = rn_val;
         op2 = source_val;
-        result64 = ((uint64_t)op1) + op2 + carry;
-        result = result64&0xffffffff;
-        shift_c = result64>>32;
-        arith_v = (op1^op2^0x80000000)&(op1^result)&0x80000000;
+        flags_kind = FLAGS_ARITH;
         break;
     case ALU_OPCODE_SBC:
         op1 = rn_val;
         op2 = ~source_val;
-        result64 = ((uint64_t)op1) + op2 + carry;
-        result = result64&0xffffffff;
-        shift_c = result64>>32;
-        arith_v = (op1^op2^0x80000000)&(op1^result)&0x80000000;
+        flags_kind = FLAGS_ARITH;
         break;
     case ALU_OPCODE_RSC:
         op1 = ~rn_val;
         op2 = source_val;
-        result64 = ((uint64_t)op2) + op1 + carry;
-        result = result64&0xffffffff;
-        shift_c = result64>>32;
-        arith_v = (result^rn_val)&0x80000000;
+        flags_kind = FLAGS_ARITH;
         break;
     case ALU_OPCODE_ORR:
         result = rn_val | source_val;
@@ -298,14 +332,17 @@ enum armv2_exception ALUInstruction                         (armv2_t *cpu,uint32
         result = ~source_val;
         break;
     }
-    if(rd == PC) {
-        if(instruction&ALU_SETS_FLAGS) {
+    if(flags_kind != FLAGS_LOGIC) {
+        result = op1 + op2 + carry;
+    }
+    if(rd_is_pc) {
+        if(sets_flags) {
             //this means we update the whole register, except for prohibited flags in user mode
             if(GETMODE(cpu) == MODE_USR) {
                 cpu->regs.actual[PC] = (cpu->regs.actual[PC]&PC_PROTECTED_BITS) | (result&PC_UNPROTECTED_BITS);
             }
             else {
-                cpu->regs.actual[PC] = result;
+                WritePrivilegedR15(cpu,result);
             }
         }
         else {
@@ -313,24 +350,59 @@ enum armv2_exception ALUInstruction                         (armv2_t *cpu,uint32
             SETPC(cpu,result);
         }
         cpu->pc = GETPC(cpu)-4;
+        IDLE_RESET(cpu);
     }
     else {
-        if(instruction&ALU_SETS_FLAGS) {
-            uint32_t n = (result&FLAG_N);
-            uint32_t z = result == 0 ? FLAG_Z : 0;
-            uint32_t c = shift_c ? FLAG_C : 0;
-            uint32_t v = arith_v ? FLAG_V : 0;
-            cpu->regs.actual[PC] = (cpu->regs.actual[PC]&0x0fffffff)|n|z|c|v;
+        if(sets_flags) {
+            //Just remember how to work them out, most of the time the next flag setting instruction will
+            //come along before anything looks at them
+            cpu->lazy_flags.kind   = flags_kind;
+            cpu->lazy_flags.result = result;
+            cpu->lazy_flags.op1    = op1;
+            cpu->lazy_flags.op2    = op2;
+            cpu->lazy_flags.carry  = flags_kind == FLAGS_LOGIC ? shift_c : carry;
         }
         if((opcode&0xc) != 0x8) {
             GETREG(cpu,rd) = result;
         }
     }
 
-    //LOG("%s r%d %08x %08x\n",__func__,rd,GETREG(cpu,rd),cpu->regs.actual[PC]);
+    //LOG_DEBUG("%s r%d %08x %08x\n",__func__,rd,GETREG(cpu,rd),cpu->regs.actual[PC]);
     return EXCEPT_NONE;
 }
 
+enum armv2_exception ALUInstruction                         (armv2_t *cpu,uint32_t instruction)
+{
+    return ALUOperation(cpu,instruction,(instruction>>21)&0xf,ALU_FORM(instruction),
+                        (instruction&ALU_SETS_FLAGS) ? 1 : 0,((instruction>>12)&0xf) == PC);
+}
+
+//A handler for every combination of opcode, operand form, S bit and whether rd is the PC, for the decoder
+//to pick from so that none of those have to be looked at when the instruction runs
+#define ALU_OPCODES(X) X(AND) X(EOR) X(SUB) X(RSB) X(ADD) X(ADC) X(SBC) X(RSC) \
+                       X(TST) X(TEQ) X(CMP) X(CMN) X(ORR) X(MOV) X(BIC) X(MVN)
+
+#define ALU_HANDLER_NAME(op,form,s,pc) ALUInstruction_##op##_##form##_##s##_##pc
+#define ALU_HANDLER(op,form,s,pc)                                                             \
+    static enum armv2_exception ALU_HANDLER_NAME(op,form,s,pc)(armv2_t *cpu,uint32_t instruction) { \
+        return ALUOperation(cpu,instruction,ALU_OPCODE_##op,ALU_FORM_##form,s,pc);           \
+    }
+#define ALU_FORM_HANDLERS(op,form) ALU_HANDLER(op,form,0,0) ALU_HANDLER(op,form,0,1) \
+                                   ALU_HANDLER(op,form,1,0) ALU_HANDLER(op,form,1,1)
+#define ALU_HANDLERS(op) ALU_FORM_HANDLERS(op,IMMEDIATE) ALU_FORM_HANDLERS(op,SHIFT) ALU_FORM_HANDLERS(op,REGISTER_SHIFT)
+
+ALU_OPCODES(ALU_HANDLERS)
+
+#define ALU_FORM_ENTRIES(op,form) [ALU_FORM_##form] = {                                          \
+        {ALU_HANDLER_NAME(op,form,0,0),ALU_HANDLER_NAME(op,form,0,1)},                           \
+        {ALU_HANDLER_NAME(op,form,1,0),ALU_HANDLER_NAME(op,form,1,1)}}
+#define ALU_ENTRIES(op) [ALU_OPCODE_##op] = {ALU_FORM_ENTRIES(op,IMMEDIATE),ALU_FORM_ENTRIES(op,SHIFT), \
+                                             ALU_FORM_ENTRIES(op,REGISTER_SHIFT)},
+
+const instruction_handler_t alu_handlers[16][ALU_FORM_MAX][2][2] = {
+    ALU_OPCODES(ALU_ENTRIES)
+};
+
 enum armv2_exception MultiplyInstruction                    (armv2_t *cpu,uint32_t instruction)
 {
     //mul rd,rm,rs means rd = (rm*rs)&0xffffffff
@@ -340,7 +412,7 @@ enum armv2_exception MultiplyInstruction                    (armv2_t *cpu,uint32
     uint32_t rs = (instruction>>8)&0xf;
     uint32_t rd = (instruction>>16)&0xf;
     uint32_t result;
-    LOG("%s\n",__func__);
+    LOG_DEBUG("%s\n",__func__);
 
     if(instruction&MUL_TYPE_MLA) {
         //using rn so get its value
@@ -371,10 +443,11 @@ enum armv2_exception MultiplyInstruction                    (armv2_t *cpu,uint32
         GETREG(cpu,rd) = (rm*rs + rn)&0xffffffff;
     }
     if(instruction&ALU_SETS_FLAGS) {
-        //apparently we set C to a meaningless value! I'll just leave it
-        uint32_t n = (result&FLAG_N);
-        uint32_t z = result == 0 ? FLAG_Z : 0;
-        cpu->regs.actual[PC] = (cpu->regs.actual[PC]&0x3fffffff)|n|z;
+        //apparently we set C to a meaningless value! I'll just leave it. The flags were resolved before
+        //we started (see NeedsFlags) so the PSR's C is the real one
+        cpu->lazy_flags.kind   = FLAGS_LOGIC;
+        cpu->lazy_flags.result = result;
+        cpu->lazy_flags.carry  = FLAG_SET(cpu,C);
     }
 
     return EXCEPT_NONE;
@@ -389,7 +462,7 @@ enum armv2_exception MultiplyInstruction                    (armv2_t *cpu,uint32
 
 enum armv2_exception SingleDataTransferInstruction          (armv2_t *cpu,uint32_t instruction)
 {
-    LOG("%s\n",__func__);
+    LOG_DEBUG("%s\n",__func__);
     //LDR/STR{B}{T} rd,address
     //address is one of:
     //[rn](!)
@@ -412,7 +485,7 @@ enum armv2_exception SingleDataTransferInstruction          (armv2_t *cpu,uint32
     else {
         op2 = OperandShift(cpu,instruction&0xfff,0,NULL);
     }
-    LOG("SDI op2 = %08x\n",op2);
+    LOG_DEBUG("SDI op2 = %08x\n",op2);
     if(rn == PC) {
         rn_val = GETPC(cpu);
     }
@@ -435,30 +508,42 @@ enum armv2_exception SingleDataTransferInstruction          (armv2_t *cpu,uint32
         //The address bus is 26 bits so this is a address exception
         return EXCEPT_ADDRESS;
     }
-    LOG("x %x\n",PAGEOF(rn_val));
-    page = cpu->page_tables[PAGEOF(rn_val)];
-    if(NULL == page) {
-        //This is a data abort. Could also check for permission here
-        return EXCEPT_DATA_ABORT;
-    }
     //do the load/store
     if(instruction&SDT_LDR) {
         //LDR
         uint32_t value;
+        uint32_t *host;
         //must be aligned
         if(rn_val&0x3 && !(instruction&SDT_LOAD_BYTE)) {
             return EXCEPT_DATA_ABORT;
         }
-        if(GETMODE(cpu) == MODE_USR && !(page->flags&PERM_READ)) {
-            return EXCEPT_DATA_ABORT;
+        host = TlbRead(cpu,rn_val);
+        if(NULL != host) {
+            value = *host;
         }
+        else {
+            LOG_DEBUG("x %x\n",PAGEOF(rn_val));
+            page = GetPage(cpu,PAGEOF(rn_val));
+            if(NULL == page) {
+                //This is a data abort. Could also check for permission here
+                return EXCEPT_DATA_ABORT;
+            }
+            if(GETMODE(cpu) == MODE_USR && !(page->flags&PERM_READ)) {
+                return EXCEPT_DATA_ABORT;
+            }
 
-        LOG("Page at %p has memory %p, rc %p wc %p flags %x\n",page,page->memory,page->read_callback,page->write_callback,page->flags);
-        if(ARMV2STATUS_OK != PerformLoad(page,rn_val,&value)) {
-            return EXCEPT_DATA_ABORT;
+            LOG_DEBUG("Page at %p has memory %p, rc %p wc %p flags %x\n",page,page->memory,page->read_callback,page->write_callback,page->flags);
+            if((instruction&SDT_LOAD_BYTE) && page->read_byte_callback) {
+                //put it in the lane the extraction below expects
+                IDLE_RESET(cpu);
+                value = (DeviceRead(cpu,page,page->read_byte_callback,INPAGE(rn_val),REPLAY_READ_BYTE)&0xff)<<((rn_val&3)<<3);
+            }
+            else if(ARMV2STATUS_OK != PerformLoad(cpu,page,rn_val,&value)) {
+                return EXCEPT_DATA_ABORT;
+            }
         }
 
-        LOG("Have value %08x and %d\n",value,instruction&SDT_LOAD_BYTE);
+        LOG_DEBUG("Have value %08x and %d\n",value,instruction&SDT_LOAD_BYTE);
         if(instruction&SDT_LOAD_BYTE) {
             value = (value>>((rn_val&3)<<3))&0xff;
         }
@@ -467,6 +552,7 @@ enum armv2_exception SingleDataTransferInstruction          (armv2_t *cpu,uint32
             //don't set any of the flags
             cpu->pc = value-4;
             SETPC(cpu,value);
+            IDLE_RESET(cpu);
         }
         else {
             GETREG(cpu,rd) = value;
@@ -475,35 +561,60 @@ enum armv2_exception SingleDataTransferInstruction          (armv2_t *cpu,uint32
     else {
         //STR
         uint32_t value;
-        LOG("a\n");
-        if(GETMODE(cpu) == MODE_USR && !(page->flags&PERM_WRITE)) {
-            return EXCEPT_DATA_ABORT;
-        }
+        uint32_t *host;
         if(rd == PC) {
             value = ((cpu->pc+4)&0x03fffffc) | GETMODEPSR(cpu);
         }
         else {
             value = GETREG(cpu,rd);
         }
-        LOG("b\n");
-
-        if(instruction&SDT_LOAD_BYTE) {
-            uint32_t byte_mask = 0xff<<((rn_val&3)<<3);
-            uint32_t rest_mask = ~byte_mask;
-            uint32_t store_val = (page->memory[INPAGE(rn_val)>>2]&rest_mask) | ((value&0xff)<<((rn_val&3)<<3));
-            LOG("STR at address %08x byte_mask = %08x rest_mask = %08x\n",rn_val,byte_mask,rest_mask);
-            (void) PerformStore(page,rn_val,store_val);
+        if(!(instruction&SDT_LOAD_BYTE) && rn_val&0x3) {
+            //must be aligned
+            return EXCEPT_DATA_ABORT;
+        }
+        host = TlbWrite(cpu,rn_val);
+        if(NULL != host) {
+            if(instruction&SDT_LOAD_BYTE) {
+                uint32_t byte_mask = 0xff<<((rn_val&3)<<3);
+                *host = (*host&~byte_mask) | ((value&0xff)<<((rn_val&3)<<3));
+            }
+            else {
+                *host = value;
+            }
         }
         else {
-            //must be aligned
-            if(rn_val&0x3) {
+            LOG_DEBUG("x %x\n",PAGEOF(rn_val));
+            page = GetPage(cpu,PAGEOF(rn_val));
+            if(NULL == page) {
+                //This is a data abort. Could also check for permission here
+                return EXCEPT_DATA_ABORT;
+            }
+            if(GETMODE(cpu) == MODE_USR && !(page->flags&PERM_WRITE)) {
                 return EXCEPT_DATA_ABORT;
             }
-            LOG("Page at %p has memory %p, rc %p wc %p flags %x\n",page,page->memory,page->read_callback,page->write_callback,page->flags);
-            (void) PerformStore(page,rn_val,value);
+
+            if((instruction&SDT_LOAD_BYTE) && page->write_byte_callback) {
+                DeviceWrite(cpu,page,page->write_byte_callback,INPAGE(rn_val),value&0xff);
+            }
+            else if(instruction&SDT_LOAD_BYTE) {
+                uint32_t byte_mask = 0xff<<((rn_val&3)<<3);
+                uint32_t rest_mask = ~byte_mask;
+                uint32_t store_val;
+                //Merge the byte into the word that's there, which for a device means asking it
+                if(ARMV2STATUS_OK != PerformLoad(cpu,page,rn_val&~3,&store_val)) {
+                    return EXCEPT_DATA_ABORT;
+                }
+                store_val = (store_val&rest_mask) | ((value&0xff)<<((rn_val&3)<<3));
+                LOG_DEBUG("STR at address %08x byte_mask = %08x rest_mask = %08x\n",rn_val,byte_mask,rest_mask);
+                (void) PerformStore(cpu,page,rn_val,store_val);
+            }
+            else {
+                LOG_DEBUG("Page at %p has memory %p, rc %p wc %p flags %x\n",page,page->memory,page->read_callback,page->write_callback,page->flags);
+                (void) PerformStore(cpu,page,rn_val,value);
+            }
         }
     }
-    LOG("d\n");
+    LOG_DEBUG("d\n");
     //Now for any post indexing
     if((instruction&SDT_PREINDEX) == 0) {
         if(instruction&SDT_OFFSET_ADD) {
@@ -525,24 +636,116 @@ enum armv2_exception SingleDataTransferInstruction          (armv2_t *cpu,uint32
 
     return EXCEPT_NONE;
 }
+#define MDT_LDM        SDT_LDR
+#define MDT_WRITE_BACK SDT_WRITE_BACK
+#define MDT_HAT        SDT_LOAD_BYTE
+#define MDT_OFFSET_ADD SDT_OFFSET_ADD
+#define MDT_PREINDEX   SDT_PREINDEX
+
+#define BRANCH_LINK    0x01000000
+//Branch offsets from here up go back over at most IDLE_MAX_LOOP instructions
+#define BRANCH_SHORT_BACKWARD (0x01000000 - 2 - IDLE_MAX_LOOP)
+
+//Could running the instructions from start up to end again change anything other than the registers they
+//set? Loads are fine as long as they don't write back, since if the registers that feed them haven't
+//changed they'll load the same thing again. Device reads are caught separately by IDLE_RESET
+static int LoopIsPure(armv2_t *cpu, uint32_t start, uint32_t end) {
+    page_info_t *page = GetPage(cpu,PAGEOF(start));
+    if(PAGEOF(start) != PAGEOF(end) || NULL == page || NULL == page->memory) {
+        return 0;
+    }
+    for(uint32_t addr=start;addr<end;addr+=4) {
+        decoded_instruction_t decoded = {0};
+        uint32_t instruction = page->memory[WORDINPAGE(addr)];
+        DecodeInstruction(&decoded,instruction);
+        switch(decoded.type) {
+        case INSTRUCTION_ALU:
+            if(((instruction>>12)&0xf) == PC) {
+                return 0;
+            }
+            break;
+        case INSTRUCTION_MULTIPLY:
+            if(((instruction>>16)&0xf) == PC) {
+                return 0;
+            }
+            break;
+        case INSTRUCTION_SINGLE_DATA_TRANSFER:
+            if(!(instruction&SDT_LDR) || (instruction&SDT_WRITE_BACK) || !(instruction&SDT_PREINDEX) ||
+               ((instruction>>12)&0xf) == PC) {
+                return 0;
+            }
+            break;
+        case INSTRUCTION_MULTI_DATA_TRANSFER:
+            if(!(instruction&MDT_LDM) || (instruction&(MDT_WRITE_BACK|MDT_HAT|(1<<PC)))) {
+                return 0;
+            }
+            break;
+        case INSTRUCTION_BRANCH:
+            //Taking one stops the watch anyway, so these can only be ways out of the loop
+            if(instruction&BRANCH_LINK) {
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//Called each time the short backward branch at branch is taken, returns 1 if the loop back to start is
+//idle
+static int IdleLoop(armv2_t *cpu, uint32_t branch, uint32_t start) {
+    idle_watch_t *idle = &cpu->idle;
+    if(idle->branch != branch) {
+        idle->branch   = branch;
+        idle->count    = 0;
+        idle->recorded = 0;
+    }
+    if((++idle->count)&(IDLE_CHECK_INTERVAL-1)) {
+        return 0;
+    }
+    RESOLVE_FLAGS(cpu);
+    if(idle->recorded && 0 == memcmp(idle->regs,cpu->regs.actual,sizeof(idle->regs)) &&
+       LoopIsPure(cpu,start,branch)) {
+        //Every time round is the same number of instructions, as anything that branched out of the loop
+        //would have stopped the watch
+        idle->period = IDLE_CHECK_INTERVAL*((branch - start)/4 + 1);
+        return 1;
+    }
+    memcpy(idle->regs,cpu->regs.actual,sizeof(idle->regs));
+    idle->recorded = 1;
+    return 0;
+}
+
 enum armv2_exception BranchInstruction                      (armv2_t *cpu,uint32_t instruction)
 {
-    LOG("%s\n",__func__);
-    if((instruction>>24&1)) {
+    uint32_t offset = instruction&0xffffff;
+    uint32_t branch = cpu->pc;
+    uint32_t target;
+    LOG_DEBUG("%s\n",__func__);
+    if(instruction&BRANCH_LINK) {
         GETREG(cpu,LR) = cpu->pc+4;
     }
-    cpu->pc = (cpu->pc + 8 + ((instruction&0xffffff)<<2) - 4)&0xffffff;
+    cpu->pc = (cpu->pc + 8 + (offset<<2) - 4)&0xffffff;
     //+8 due to the weird prefetch thing, -4 for the hack as we're going to add 4 in the next loop
 
+    target = (cpu->pc+4)&0x3ffffff;
+    if(offset < BRANCH_SHORT_BACKWARD || (instruction&BRANCH_LINK) || target > branch) {
+        //(going back past zero wraps round to somewhere else entirely)
+        IDLE_RESET(cpu);
+        return EXCEPT_NONE;
+    }
+    if(target == branch) {
+        cpu->idle.period = 1;
+        return EXCEPT_IDLE;
+    }
+    if(IdleLoop(cpu,branch,target)) {
+        return EXCEPT_IDLE;
+    }
     return EXCEPT_NONE;
 }
 
-#define MDT_LDM        SDT_LDR
-#define MDT_WRITE_BACK SDT_WRITE_BACK
-#define MDT_HAT        SDT_LOAD_BYTE
-#define MDT_OFFSET_ADD SDT_OFFSET_ADD
-#define MDT_PREINDEX   SDT_PREINDEX
-
 enum armv2_exception MultiDataTransferInstruction           (armv2_t *cpu,uint32_t instruction)
 {
     uint32_t rn         = (instruction>>16)&0xf;
@@ -559,7 +762,7 @@ enum armv2_exception MultiDataTransferInstruction           (armv2_t *cpu,uint32
     uint32_t write_back_old = 0;
     uint32_t write_back_value = 0;
     uint32_t first_loop = 1;
-    //LOG("%s %d %d %d %d %d %d %d %d\n",__func__,rn,!!ldm,!!write_back,!!setflags,!!offset,!!preindex,!!user_bank,num_registers);
+    //LOG_DEBUG("%s %d %d %d %d %d %d %d %d\n",__func__,rn,!!ldm,!!write_back,!!setflags,!!offset,!!preindex,!!user_bank,num_registers);
     if(rn == PC) {
         //psr bits are used, so that's an exception if the flags aren't set, weird
         address = cpu->pc | GETMODEPSR(cpu);
@@ -592,7 +795,7 @@ enum armv2_exception MultiDataTransferInstruction           (armv2_t *cpu,uint32
 
     if(write_back) {
         write_back_old = user_bank ? GETUSERREG(cpu,rn) : GETREG(cpu,rn);
-        //LOG("%08x %08x\n",address,write_back_value);
+        //LOG_DEBUG("%08x %08x\n",address,write_back_value);
         if(user_bank) {
             GETUSERREG(cpu,rn) = write_back_value;
         }
@@ -601,40 +804,96 @@ enum armv2_exception MultiDataTransferInstruction           (armv2_t *cpu,uint32
         }
     }
     if(retval != EXCEPT_NONE) {
-        //LOG("MDT return 1 %d\n",retval);
+        //LOG_DEBUG("MDT return 1 %d\n",retval);
         return retval;
     }
+    //Fast path for the common case of a transfer between normal registers and a single page of plain memory,
+    //which only needs checking once. A device page that takes blocks gets the whole transfer in one call
+    if(rn != PC && (instruction&0xffff) && !(instruction&(1<<PC)) && !(address&0x3) &&
+       (!setflags || GETMODE(cpu) == MODE_USR) &&
+       PAGEOF(address) == PAGEOF(address + (num_registers-1)*4)) {
+        uint32_t *host = ldm ? TlbRead(cpu,address) : TlbWrite(cpu,address);
+        uint32_t registers = instruction&0xffff;
+        uint32_t buffer[16];
+        page_info_t *page = NULL;
+        if(NULL == host) {
+            page = GetPage(cpu,PAGEOF(address));
+            if(NULL != page && (ldm ? page->read_block_callback : page->write_block_callback) &&
+               (GETMODE(cpu) != MODE_USR || (page->flags&(ldm ? PERM_READ : PERM_WRITE)))) {
+                host = buffer;
+                if(ldm) {
+                    IDLE_RESET(cpu);
+                    DeviceReadBlock(cpu,page,INPAGE(address),num_registers,buffer);
+                }
+            }
+            else {
+                page = NULL;
+            }
+        }
+        if(NULL != host) {
+            if(ldm) {
+                while(registers) {
+                    rs = __builtin_ctz(registers);
+                    registers &= registers-1;
+                    GETREG(cpu,rs) = *host++;
+                }
+            }
+            else {
+                //the same quirk as below, r0 as the writeback register gets its old value
+                if(write_back && rn == 0 && (registers&1)) {
+                    *host++ = write_back_old;
+                    registers &= ~1;
+                }
+                while(registers) {
+                    rs = __builtin_ctz(registers);
+                    registers &= registers-1;
+                    *host++ = GETREG(cpu,rs);
+                }
+                if(NULL != page) {
+                    DeviceWriteBlock(cpu,page,INPAGE(address),num_registers,buffer);
+                }
+            }
+            return EXCEPT_NONE;
+        }
+    }
     //shitty hack, cancel the increment we're about to do
     address -= 4;
     for(rs=0;rs<16;rs++,first_loop=0) {
         uint32_t value;
+        uint32_t *host;
         page_info_t *page;
         if(((instruction>>rs)&1) == 0) {
             continue;
         }
         address += 4;
 
-        page = cpu->page_tables[PAGEOF(address)];
-        if(NULL == page) {
-            //This is a data abort. Could also check for permission here
-            retval = EXCEPT_DATA_ABORT;
-            //LOG("MDT return 2 %d\n",retval);
-            continue;
-        }
         if(address&0x3) {
             retval = EXCEPT_DATA_ABORT;
-            //LOG("MDT return 3 %d\n",retval);
+            //LOG_DEBUG("MDT return 3 %d\n",retval);
             continue;
         }
         if(ldm) {
             //we're loading from memory into registers
-            if(GETMODE(cpu) == MODE_USR && !(page->flags&PERM_READ)) {
-                retval = EXCEPT_DATA_ABORT;
-                continue;
+            host = TlbRead(cpu,address);
+            if(NULL != host) {
+                value = *host;
             }
-            if(ARMV2STATUS_OK != PerformLoad(page,address,&value)) {
-                retval = EXCEPT_DATA_ABORT;
-                continue;
+            else {
+                page = GetPage(cpu,PAGEOF(address&0x03ffffff));
+                if(NULL == page) {
+                    //This is a data abort. Could also check for permission here
+                    retval = EXCEPT_DATA_ABORT;
+                    //LOG_DEBUG("MDT return 2 %d\n",retval);
+                    continue;
+                }
+                if(GETMODE(cpu) == MODE_USR && !(page->flags&PERM_READ)) {
+                    retval = EXCEPT_DATA_ABORT;
+                    continue;
+                }
+                if(ARMV2STATUS_OK != PerformLoad(cpu,page,address,&value)) {
+                    retval = EXCEPT_DATA_ABORT;
+                    continue;
+                }
             }
 
             if(rs == PC) {
@@ -643,9 +902,10 @@ enum armv2_exception MultiDataTransferInstruction           (armv2_t *cpu,uint32
                     cpu->regs.actual[PC] = (cpu->regs.actual[PC]&PC_PROTECTED_BITS) | ((value-4)&PC_UNPROTECTED_BITS);
                 }
                 else {
-                    cpu->regs.actual[PC] = value;
+                    WritePrivilegedR15(cpu,value);
                 }
                 cpu->pc = GETPC(cpu)-4;
+                IDLE_RESET(cpu);
             }
             else {
                 if(user_bank) {
@@ -658,9 +918,18 @@ enum armv2_exception MultiDataTransferInstruction           (armv2_t *cpu,uint32
         }
         else {
             //str
-            if(GETMODE(cpu) == MODE_USR && !(page->flags&PERM_WRITE)) {
-                retval = EXCEPT_DATA_ABORT;
-                continue;
+            host = TlbWrite(cpu,address);
+            page = NULL;
+            if(NULL == host) {
+                page = GetPage(cpu,PAGEOF(address&0x03ffffff));
+                if(NULL == page) {
+                    retval = EXCEPT_DATA_ABORT;
+                    continue;
+                }
+                if(GETMODE(cpu) == MODE_USR && !(page->flags&PERM_WRITE)) {
+                    retval = EXCEPT_DATA_ABORT;
+                    continue;
+                }
             }
             if(retval != EXCEPT_NONE) {
                 //stores are prevented after a data abort
@@ -677,7 +946,12 @@ enum armv2_exception MultiDataTransferInstruction           (armv2_t *cpu,uint32
                     value = write_back_old;
                 }
             }
-            (void) PerformStore(page,address,value);
+            if(NULL != host) {
+                *host = value;
+            }
+            else {
+                (void) PerformStore(cpu,page,address,value);
+            }
         }
     }
 
@@ -687,21 +961,37 @@ enum armv2_exception MultiDataTransferInstruction           (armv2_t *cpu,uint32
 
 enum armv2_exception SwapInstruction                        (armv2_t *cpu,uint32_t instruction)
 {
-    //LOG("%s\n",__func__);
+    //LOG_DEBUG("%s\n",__func__);
     uint32_t rm   = instruction&0xf;
     uint32_t rd   = (instruction>>12)&0xf;
     uint32_t rn   = (instruction>>16)&0xf;
     uint32_t byte = instruction&SDT_LOAD_BYTE;
     uint32_t value;
+    uint32_t word = 0;
     page_info_t *page;
 
     uint32_t address = rn == PC ? (cpu->pc | GETMODEPSR(cpu)) : GETREG(cpu,rn);
+    uint32_t *host;
 
     if(address&0xfc000000) {
         //The address bus is 26 bits so this is a address exception
         return EXCEPT_ADDRESS;
     }
-    page = cpu->page_tables[PAGEOF(address)];
+    if(!byte && !(address&0x3) && NULL != TlbRead(cpu,address) && NULL != (host = TlbWrite(cpu,address))) {
+        //Plain memory we can both read and write
+        value = *host;
+        if(rd == PC) {
+            cpu->pc = value-4;
+            SETPC(cpu,value);
+            IDLE_RESET(cpu);
+        }
+        else {
+            GETREG(cpu,rd) = value;
+        }
+        *host = rm == PC ? (((cpu->pc+4)&0x03fffffc) | GETMODEPSR(cpu)) : GETREG(cpu,rm);
+        return EXCEPT_NONE;
+    }
+    page = GetPage(cpu,PAGEOF(address));
     if(NULL == page) {
         //This is a data abort. Could also check for permission here
         return EXCEPT_DATA_ABORT;
@@ -716,17 +1006,22 @@ enum armv2_exception SwapInstruction                        (armv2_t *cpu,uint32
     }
 
     //First load
-    if(ARMV2STATUS_OK != PerformLoad(page,address,&value)) {
-        return EXCEPT_DATA_ABORT;
+    if(byte && page->read_byte_callback) {
+        IDLE_RESET(cpu);
+        value = DeviceRead(cpu,page,page->read_byte_callback,INPAGE(address),REPLAY_READ_BYTE)&0xff;
     }
-    if(byte) {
-        value = (value>>((address&3)<<3))&0xff;
+    else {
+        if(ARMV2STATUS_OK != PerformLoad(cpu,page,address,&word)) {
+            return EXCEPT_DATA_ABORT;
+        }
+        value = byte ? (word>>((address&3)<<3))&0xff : word;
     }
 
     if(rd == PC) {
         //don't set any of the flags
         cpu->pc = value-4;
         SETPC(cpu,value); //the -4 is a hack because we increment on the next loop
+        IDLE_RESET(cpu);
     }
     else {
         GETREG(cpu,rd) = value;
@@ -740,19 +1035,22 @@ enum armv2_exception SwapInstruction                        (armv2_t *cpu,uint32
         value = GETREG(cpu,rm);
     }
 
+    if(byte && page->write_byte_callback) {
+        DeviceWrite(cpu,page,page->write_byte_callback,INPAGE(address),value&0xff);
+        return EXCEPT_NONE;
+    }
     if(byte) {
         uint32_t byte_mask = 0xff<<((address&3)<<3);
         uint32_t rest_mask = ~byte_mask;
-        value = (page->memory[INPAGE(address)]&rest_mask) | ((value&0xff)<<((address&3)<<3));
-    }
-    else {
-        //must be aligned
-        if(address&0x3) {
+        //Merge the byte into the word we loaded, unless the device gave us just the byte and we have to ask
+        //it for the word
+        if(page->read_byte_callback && ARMV2STATUS_OK != PerformLoad(cpu,page,address&~3,&word)) {
             return EXCEPT_DATA_ABORT;
         }
+        value = (word&rest_mask) | ((value&0xff)<<((address&3)<<3));
     }
 
-    (void) PerformStore(page,address,value);
+    (void) PerformStore(cpu,page,address,value);
 
     return EXCEPT_NONE;
 }
@@ -760,7 +1058,7 @@ enum armv2_exception SwapInstruction                        (armv2_t *cpu,uint32
 enum armv2_exception SoftwareInterruptInstruction           (armv2_t *cpu,uint32_t instruction)
 {
     uint32_t type = instruction&0x00ffffff;
-    //LOG("%s %x %x %x\n",__func__,type,SWI_BREAKPOINT,type == SWI_BREAKPOINT ? EXCEPT_BREAKPOINT : EXCEPT_SOFTWARE_INTERRUPT);
+    //LOG_DEBUG("%s %x %x %x\n",__func__,type,SWI_BREAKPOINT,type == SWI_BREAKPOINT ? EXCEPT_BREAKPOINT : EXCEPT_SOFTWARE_INTERRUPT);
     return type == SWI_BREAKPOINT ? EXCEPT_BREAKPOINT : EXCEPT_SOFTWARE_INTERRUPT;
 }
 //Not bothering transfers yet
@@ -787,6 +1085,7 @@ enum armv2_exception CoprocessorRegisterTransferInstruction (armv2_t *cpu,uint32
         break;
     case COPROCESSOR_INTERRUPT_CONTROLLER:
         handler = InterruptControllerTransfer;
+        break;
     default:
         handler = NULL;
         break;
@@ -815,13 +1114,113 @@ enum armv2_exception CoprocessorDataOperationInstruction    (armv2_t *cpu,uint32
         break;
     case COPROCESSOR_INTERRUPT_CONTROLLER:
         handler = InterruptControllerOperation;
+        break;
     default:
         handler = NULL;
         break;
     }
-    if(handler) {
-        (void) handler(cpu,crm,aux,crd,crn,opcode);
+    if(handler && ARMV2STATUS_WAIT_FOR_INTERRUPT == handler(cpu,crm,aux,crd,crn,opcode)) {
+        //Halting is the same as a branch to itself, it's just that we carry on from the next instruction
+        cpu->idle.period = 1;
+        return EXCEPT_IDLE;
     }
 
     return EXCEPT_NONE;
 }
+
+#ifdef ARMV2_THREADED
+//Taking the address of a label and jumping through it are GNU extensions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+//An alternative to interpret_armv2 using direct threaded dispatch. flatten pulls every handler body into
+//this function, and each one ends by fetching the next instruction and jumping straight to its body, so
+//the branch predictor gets a separate indirect jump to learn for every instruction class. Data processing
+//instructions still call their specialised handler, which beats inlining the general one
+__attribute__((flatten)) enum armv2_status threaded_armv2(armv2_t *cpu, int32_t instructions) {
+    static void *const bodies[INSTRUCTION_MAX] = {
+        [INSTRUCTION_ALU]                           = &&alu,
+        [INSTRUCTION_MULTIPLY]                      = &&multiply,
+        [INSTRUCTION_SWAP]                          = &&swap,
+        [INSTRUCTION_SINGLE_DATA_TRANSFER]          = &&single_data_transfer,
+        [INSTRUCTION_BRANCH]                        = &&branch,
+        [INSTRUCTION_MULTI_DATA_TRANSFER]           = &&multi_data_transfer,
+        [INSTRUCTION_SOFTWARE_INTERRUPT]            = &&software_interrupt,
+        [INSTRUCTION_COPROCESSOR_DATA_TRANSFER]     = &&coprocessor_data_transfer,
+        [INSTRUCTION_COPROCESSOR_REGISTER_TRANSFER] = &&coprocessor_register_transfer,
+        [INSTRUCTION_COPROCESSOR_DATA_OPERATION]    = &&coprocessor_data_operation,
+    };
+    decoded_instruction_t *decoded = NULL;
+    enum armv2_exception exception = EXCEPT_NONE;
+    enum armv2_status result = ARMV2STATUS_OK;
+
+    //The same steps as each iteration of interpret_armv2's loop, up to calling the handler. instructions
+    //of -1 means run forever
+#define DISPATCH() for(;;) {                                            \
+        if(instructions == 0) {                                         \
+            return ARMV2STATUS_OK;                                      \
+        }                                                               \
+        if(instructions > 0) {                                          \
+            instructions--;                                             \
+        }                                                               \
+        cpu->pc = (cpu->pc+4)&0x3ffffff;                                \
+        SETPC(cpu,cpu->pc + 8);                                         \
+        if(PINS(cpu)) {                                                 \
+            if(PIN_ON(cpu,RESCHEDULE)) {                                \
+                return Reschedule(cpu,instructions);                    \
+            }                                                           \
+            if(TakeInterrupt(cpu)) {                                    \
+                continue;                                               \
+            }                                                           \
+        }                                                               \
+        result = FetchInstruction(cpu,&decoded);                        \
+        if(ARMV2STATUS_OK != result) {                                  \
+            goto fetch_failed;                                          \
+        }                                                               \
+        if(decoded->flags&DECODED_NEEDS_FLAGS) {                        \
+            RESOLVE_FLAGS(cpu);                                         \
+        }                                                               \
+        if(CONDITION_PASSED(cpu,decoded->condition_mask)) {             \
+            goto *bodies[decoded->type];                                \
+        }                                                               \
+    }
+
+#define BODY(label,handler)                                             \
+    label:                                                              \
+        exception = handler(cpu,decoded->instruction);                  \
+        if(EXCEPT_NONE != exception) {                                  \
+            goto handle_exception;                                      \
+        }                                                               \
+        DISPATCH();
+
+    DISPATCH();
+
+    BODY(alu,                           decoded->handler);
+    BODY(multiply,                      MultiplyInstruction);
+    BODY(swap,                          SwapInstruction);
+    BODY(single_data_transfer,          SingleDataTransferInstruction);
+    BODY(branch,                        BranchInstruction);
+    BODY(multi_data_transfer,           MultiDataTransferInstruction);
+    BODY(software_interrupt,            SoftwareInterruptInstruction);
+    BODY(coprocessor_data_transfer,     CoprocessorDataTransferInstruction);
+    BODY(coprocessor_register_transfer, CoprocessorRegisterTransferInstruction);
+    BODY(coprocessor_data_operation,    CoprocessorDataOperationInstruction);
+
+fetch_failed:
+    if(ARMV2STATUS_INVALID_PAGE != result) {
+        return result;
+    }
+    //Trying to execute an unmapped page!
+    exception = EXCEPT_PREFETCH_ABORT;
+handle_exception:
+    if(ARMV2STATUS_OK != take_exception(cpu,exception,&instructions)) {
+        return ARMV2STATUS_BREAKPOINT;
+    }
+    DISPATCH();
+
+#undef BODY
+#undef DISPATCH
+}
+
+#pragma GCC diagnostic pop
+#endif
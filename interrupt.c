@@ -0,0 +1,245 @@
+#include "armv2.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+//The pins can be raised and lowered from any thread while the cpu is running. The cpu only ever reads
+//them, and if it's halted waiting for one it sleeps on cpu->wakeup, so whoever changes them has to
+//signal that after the change is visible. While recording or replaying the change goes through replay.c,
+//which makes it with the functions below when the cpu stops
+void armv2_raise_pins(armv2_t *cpu, uint32_t pins) {
+    if(NULL != cpu->replay) {
+        ReplayInput(cpu,REPLAY_RAISE_PINS,pins);
+        return;
+    }
+    RaisePins(cpu,pins);
+}
+
+void armv2_lower_pins(armv2_t *cpu, uint32_t pins) {
+    if(NULL != cpu->replay) {
+        ReplayInput(cpu,REPLAY_LOWER_PINS,pins);
+        return;
+    }
+    LowerPins(cpu,pins);
+}
+
+void RaisePins(armv2_t *cpu, uint32_t pins) {
+    __atomic_fetch_or(&cpu->pins,pins,__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&cpu->wakeup_lock);
+    pthread_cond_broadcast(&cpu->wakeup);
+    pthread_mutex_unlock(&cpu->wakeup_lock);
+    ExecutorWake(cpu);
+}
+
+void LowerPins(armv2_t *cpu, uint32_t pins) {
+    //Nobody waits for a pin to go low, so there's no one to wake
+    __atomic_fetch_and(&cpu->pins,~pins,__ATOMIC_SEQ_CST);
+}
+
+//Block the calling thread until an interrupt can be taken, or while recording there's a change for
+//run_armv2 to make. The check is made with the lock held, so a pin raised between it and the wait still
+//wakes us
+void WaitForInterrupt(armv2_t *cpu) {
+    pthread_mutex_lock(&cpu->wakeup_lock);
+    while(!InterruptPending(cpu) && !PIN_ON(cpu,RESCHEDULE)) {
+        pthread_cond_wait(&cpu->wakeup,&cpu->wakeup_lock);
+    }
+    pthread_mutex_unlock(&cpu->wakeup_lock);
+}
+
+//Raise or lower IRQ to match the lines. Called with wakeup_lock held
+static void UpdateIrq(armv2_t *cpu) {
+    if(__atomic_load_n(&cpu->interrupts.pending,__ATOMIC_RELAXED)&cpu->interrupts.enabled) {
+        __atomic_fetch_or(&cpu->pins,PIN_I,__ATOMIC_SEQ_CST);
+        pthread_cond_broadcast(&cpu->wakeup);
+    }
+    else {
+        __atomic_fetch_and(&cpu->pins,~PIN_I,__ATOMIC_SEQ_CST);
+    }
+}
+
+//Devices raise their line when they want attention and lower it once the guest has dealt with them. Like
+//the pins these can be called from any thread
+void armv2_raise_line(armv2_t *cpu, uint32_t line) {
+    if(NULL == cpu || line >= INTERRUPT_LINES) {
+        return;
+    }
+    if(NULL != cpu->replay) {
+        ReplayInput(cpu,REPLAY_RAISE_LINE,line);
+        return;
+    }
+    RaiseLine(cpu,line);
+}
+
+void armv2_lower_line(armv2_t *cpu, uint32_t line) {
+    if(NULL == cpu || line >= INTERRUPT_LINES) {
+        return;
+    }
+    if(NULL != cpu->replay) {
+        ReplayInput(cpu,REPLAY_LOWER_LINE,line);
+        return;
+    }
+    LowerLine(cpu,line);
+}
+
+void RaiseLine(armv2_t *cpu, uint32_t line) {
+    pthread_mutex_lock(&cpu->wakeup_lock);
+    __atomic_fetch_or(&cpu->interrupts.pending,((uint64_t)1)<<line,__ATOMIC_RELAXED);
+    UpdateIrq(cpu);
+    pthread_mutex_unlock(&cpu->wakeup_lock);
+    ExecutorWake(cpu);
+}
+
+void LowerLine(armv2_t *cpu, uint32_t line) {
+    pthread_mutex_lock(&cpu->wakeup_lock);
+    __atomic_fetch_and(&cpu->interrupts.pending,~(((uint64_t)1)<<line),__ATOMIC_RELAXED);
+    UpdateIrq(cpu);
+    pthread_mutex_unlock(&cpu->wakeup_lock);
+}
+
+//Every line starts enabled at the lowest priority, so a guest that doesn't know about the controller still
+//gets its interrupts
+void ResetInterruptController(armv2_t *cpu) {
+    memset(&cpu->interrupts,0,sizeof(cpu->interrupts));
+    cpu->interrupts.enabled        = ~(uint64_t)0;
+    cpu->interrupts.by_priority[0] = ~(uint64_t)0;
+}
+
+//The line to service next, or INTERRUPT_NONE
+static uint32_t NextLine(armv2_t *cpu) {
+    uint64_t active = __atomic_load_n(&cpu->interrupts.pending,__ATOMIC_RELAXED)&cpu->interrupts.enabled;
+    if(0 == active) {
+        return INTERRUPT_NONE;
+    }
+    for(int32_t priority=INTERRUPT_PRIORITIES-1;priority>0;priority--) {
+        if(active&cpu->interrupts.by_priority[priority]) {
+            active &= cpu->interrupts.by_priority[priority];
+            break;
+        }
+    }
+    return __builtin_ctzll(active);
+}
+
+static void SetEnabled(armv2_t *cpu, uint64_t enabled) {
+    pthread_mutex_lock(&cpu->wakeup_lock);
+    cpu->interrupts.enabled = enabled;
+    UpdateIrq(cpu);
+    pthread_mutex_unlock(&cpu->wakeup_lock);
+}
+
+static uint32_t ReadControllerRegister(armv2_t *cpu, interrupt_controller_register_t reg) {
+    interrupt_controller_t *controller = &cpu->interrupts;
+    switch(reg) {
+    case INTERRUPT_PENDING_LO:
+        return __atomic_load_n(&controller->pending,__ATOMIC_RELAXED);
+    case INTERRUPT_PENDING_HI:
+        return __atomic_load_n(&controller->pending,__ATOMIC_RELAXED)>>32;
+    case INTERRUPT_ENABLE_LO:
+        return controller->enabled;
+    case INTERRUPT_ENABLE_HI:
+        return controller->enabled>>32;
+    case INTERRUPT_SELECT:
+        return controller->select;
+    case INTERRUPT_PRIORITY:
+        return controller->priority[controller->select];
+    case INTERRUPT_LINE_VECTOR:
+        return controller->vectors[controller->select];
+    case INTERRUPT_DEFAULT_VECTOR:
+        return controller->default_vector;
+    default:
+        return 0;
+    }
+}
+
+static void WriteControllerRegister(armv2_t *cpu, interrupt_controller_register_t reg, uint32_t value) {
+    interrupt_controller_t *controller = &cpu->interrupts;
+    uint64_t bit = ((uint64_t)1)<<controller->select;
+    switch(reg) {
+    case INTERRUPT_ENABLE_LO:
+        SetEnabled(cpu,(controller->enabled&0xffffffff00000000ULL) | value);
+        break;
+    case INTERRUPT_ENABLE_HI:
+        SetEnabled(cpu,(controller->enabled&0xffffffffULL) | (((uint64_t)value)<<32));
+        break;
+    case INTERRUPT_SELECT:
+        controller->select = value&(INTERRUPT_LINES-1);
+        break;
+    case INTERRUPT_PRIORITY:
+        controller->by_priority[controller->priority[controller->select]] &= ~bit;
+        controller->priority[controller->select] = value&(INTERRUPT_PRIORITIES-1);
+        controller->by_priority[controller->priority[controller->select]] |= bit;
+        break;
+    case INTERRUPT_LINE_VECTOR:
+        controller->vectors[controller->select] = value;
+        break;
+    case INTERRUPT_DEFAULT_VECTOR:
+        controller->default_vector = value;
+        break;
+    default:
+        //The pending registers are read only
+        break;
+    }
+}
+
+enum armv2_status InterruptControllerOperation(armv2_t *cpu, uint32_t crm, uint32_t aux, uint32_t crd, uint32_t crn, uint32_t opcode) {
+    if(NULL == cpu) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    switch((interrupt_controller_opcode_t)opcode) {
+    case INTERRUPT_WAIT:
+        /* Halt until an interrupt comes in. Like the ARM WFI it's allowed to finish without one, which it
+           does when the budget runs out, so the guest should check why it woke up */
+        return ARMV2STATUS_WAIT_FOR_INTERRUPT;
+    default:
+        return ARMV2STATUS_UNKNOWN_OPCODE;
+    }
+    return ARMV2STATUS_UNIVERSE_BROKEN;
+}
+
+enum armv2_status InterruptControllerTransfer(armv2_t *cpu, uint32_t crm, uint32_t aux, uint32_t rd, uint32_t crn, uint32_t opcode) {
+    int load = opcode&1;
+    uint32_t value;
+    uint32_t line;
+    opcode >>= 1;
+    if(NULL == cpu) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+
+    switch((interrupt_register_opcode_t)opcode) {
+    case INTERRUPT_REGISTER:
+        /* Move to / from a controller register */
+        if(crn >= INTERRUPT_NUMREGS) {
+            return ARMV2STATUS_INVALID_ARGS;
+        }
+        if(!load) {
+            WriteControllerRegister(cpu,crn,GETREG(cpu,rd));
+            return ARMV2STATUS_OK;
+        }
+        value = ReadControllerRegister(cpu,crn);
+        break;
+    case INTERRUPT_VECTOR:
+        /* Where the handler for the line to service next is, so the guest can jump straight there */
+        if(!load) {
+            return ARMV2STATUS_UNKNOWN_OPCODE;
+        }
+        line  = NextLine(cpu);
+        value = INTERRUPT_NONE == line ? cpu->interrupts.default_vector : cpu->interrupts.vectors[line];
+        break;
+    case INTERRUPT_NEXT:
+        if(!load) {
+            return ARMV2STATUS_UNKNOWN_OPCODE;
+        }
+        value = NextLine(cpu);
+        break;
+    default:
+        return ARMV2STATUS_UNKNOWN_OPCODE;
+    }
+    if(rd == PC) {
+        //only set the flags
+        SETPSR(cpu,value&0xfc000000);
+    }
+    else {
+        GETREG(cpu,rd) = value;
+    }
+    return ARMV2STATUS_OK;
+}
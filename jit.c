@@ -0,0 +1,533 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "armv2.h"
+
+#ifndef __x86_64__
+#error "The JIT backend only generates x86-64 code, build without ARMV2_JIT"
+#endif
+
+//A basic block translator. Each guest instruction in a block becomes a direct call to its handler with the
+//fetch, decode, condition check and PC bookkeeping done inline, so the only thing left of the interpreter loop
+//is the budget and interrupt check in each block's prologue. Blocks end on anything that can write the PC,
+//SWIs, coprocessor operations and page boundaries, and chain directly to their successors once those have
+//been translated.
+//
+//While running generated code rbx holds the cpu and r12 the jit state.
+
+#define JIT_CODE_SIZE      (4<<20)
+#define JIT_MAX_BLOCKS     (8192)
+#define JIT_MAX_LINKS      (2*JIT_MAX_BLOCKS)
+#define JIT_HASH_SIZE      (4096)
+#define JIT_MAX_BLOCK_LEN  (64)
+//enough for the prologue, epilogue and the longest sequence we generate for a single instruction
+#define JIT_MAX_BLOCK_CODE (256 + JIT_MAX_BLOCK_LEN*160)
+//returned by a block that bailed out in its prologue without executing anything
+#define JIT_NOT_ENTERED    (0xffffffff)
+
+#define JIT_HASH(addr)     (((addr)>>2)&(JIT_HASH_SIZE-1))
+
+typedef struct _jit_link_t {
+    uint8_t            *site;  //the rel32 of a jump that has been chained to a block
+    uint8_t            *stub;  //where that jump went before it was chained
+    struct _jit_link_t *next;
+} jit_link_t;
+
+typedef struct _jit_block_t {
+    uint32_t             start;
+    uint32_t             length;
+    uint8_t             *code;
+    jit_link_t          *incoming;
+    struct _jit_block_t *hash_next;
+} jit_block_t;
+
+typedef uint32_t (*jit_enter_t)(armv2_t *cpu, struct _jit_t *jit, uint8_t *code);
+
+struct _jit_t {
+    //These are accessed from the generated code
+    int32_t      budget;
+    uint32_t     exit_target;
+    uint8_t     *exit_site;
+
+    uint8_t     *code;
+    uint32_t     code_used;
+    uint32_t     trampoline_size;
+    jit_enter_t  enter;
+    uint8_t     *leave;
+    uint8_t     *dead;
+    uint32_t     generation;
+    uint32_t     num_blocks;
+    uint32_t     num_links;
+    jit_block_t *hash[JIT_HASH_SIZE];
+    jit_block_t  blocks[JIT_MAX_BLOCKS];
+    jit_link_t   links[JIT_MAX_LINKS];
+};
+typedef struct _jit_t jit_t;
+
+#define CPU_OFFSET_PC     ((int32_t)offsetof(armv2_t,pc))
+#define CPU_OFFSET_PSR    ((int32_t)(offsetof(armv2_t,regs.actual) + PC*sizeof(uint32_t)))
+#define CPU_OFFSET_PINS   ((int32_t)offsetof(armv2_t,pins))
+#define CPU_OFFSET_FLAGS  ((int32_t)offsetof(armv2_t,flags))
+#define CPU_OFFSET_LAZY   ((int32_t)offsetof(armv2_t,lazy_flags.kind))
+#define JIT_OFFSET_BUDGET ((int32_t)offsetof(jit_t,budget))
+#define JIT_OFFSET_TARGET ((int32_t)offsetof(jit_t,exit_target))
+#define JIT_OFFSET_SITE   ((int32_t)offsetof(jit_t,exit_site))
+
+typedef struct {
+    uint8_t *start;
+    uint8_t *pos;
+} emitter_t;
+
+static void Emit8(emitter_t *e, uint8_t byte) {
+    *e->pos++ = byte;
+}
+
+static void EmitBytes(emitter_t *e, const uint8_t *bytes, size_t len) {
+    memcpy(e->pos,bytes,len);
+    e->pos += len;
+}
+
+static void Emit32(emitter_t *e, uint32_t word) {
+    memcpy(e->pos,&word,sizeof(word));
+    e->pos += sizeof(word);
+}
+
+static void Emit64(emitter_t *e, uint64_t word) {
+    memcpy(e->pos,&word,sizeof(word));
+    e->pos += sizeof(word);
+}
+
+static void PatchRel32(uint8_t *site, uint8_t *target) {
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site,&rel,sizeof(rel));
+}
+
+//Emit a jump or conditional jump with a rel32 operand, returning the position of the operand
+static uint8_t *EmitJump(emitter_t *e, const uint8_t *opcode, size_t len, uint8_t *target) {
+    uint8_t *site;
+    EmitBytes(e,opcode,len);
+    site = e->pos;
+    Emit32(e,0);
+    if(target) {
+        PatchRel32(site,target);
+    }
+    return site;
+}
+
+static const uint8_t op_jmp[] = {0xe9};
+static const uint8_t op_jne[] = {0x0f,0x85};
+static const uint8_t op_jnc[] = {0x0f,0x83};
+static const uint8_t op_jl[]  = {0x0f,0x8c};
+
+//mov dword [rbx+disp], imm32
+static void EmitStoreCpuImm(emitter_t *e, int32_t disp, uint32_t imm) {
+    Emit8(e,0xc7); Emit8(e,0x83); Emit32(e,disp); Emit32(e,imm);
+}
+
+//add/sub dword [r12+disp], imm32
+static void EmitAddJit(emitter_t *e, int32_t disp, uint32_t imm, int subtract) {
+    Emit8(e,0x41); Emit8(e,0x81); Emit8(e,subtract ? 0xac : 0x84); Emit8(e,0x24); Emit32(e,disp); Emit32(e,imm);
+}
+
+//mov eax, imm32 ; jmp leave
+static void EmitLeave(jit_t *jit, emitter_t *e, uint32_t retval) {
+    Emit8(e,0xb8); Emit32(e,retval);
+    (void) EmitJump(e,op_jmp,sizeof(op_jmp),jit->leave);
+}
+
+static void EmitTrampoline(jit_t *jit, emitter_t *e) {
+    //enter(cpu,jit,code): save the registers we use, keep the stack 16 byte aligned, and jump to the block
+    static const uint8_t enter[] = {
+        0x53,                   //push rbx
+        0x41,0x54,              //push r12
+        0x48,0x83,0xec,0x08,    //sub rsp,8
+        0x48,0x89,0xfb,         //mov rbx,rdi
+        0x49,0x89,0xf4,         //mov r12,rsi
+        0xff,0xe2,              //jmp rdx
+    };
+    static const uint8_t leave[] = {
+        0x48,0x83,0xc4,0x08,    //add rsp,8
+        0x41,0x5c,              //pop r12
+        0x5b,                   //pop rbx
+        0xc3,                   //ret
+    };
+    memcpy(&jit->enter,&e->pos,sizeof(jit->enter));
+    EmitBytes(e,enter,sizeof(enter));
+    jit->leave = e->pos;
+    EmitBytes(e,leave,sizeof(leave));
+    //killed blocks have their prologue replaced with a jump here
+    jit->dead = e->pos;
+    EmitLeave(jit,e,JIT_NOT_ENTERED);
+}
+
+static jit_t *JitCreate(void) {
+    emitter_t e;
+    jit_t *jit = calloc(1,sizeof(jit_t));
+    if(NULL == jit) {
+        return NULL;
+    }
+    jit->code = mmap(NULL,JIT_CODE_SIZE,PROT_READ|PROT_WRITE|PROT_EXEC,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(MAP_FAILED == jit->code) {
+        free(jit);
+        return NULL;
+    }
+    e.start = e.pos = jit->code;
+    EmitTrampoline(jit,&e);
+    jit->trampoline_size = jit->code_used = e.pos - e.start;
+    return jit;
+}
+
+void jit_cleanup(armv2_t *cpu) {
+    if(NULL == cpu || NULL == cpu->jit) {
+        return;
+    }
+    munmap(cpu->jit->code,JIT_CODE_SIZE);
+    free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+//Throw away all translations. Only safe when we're not executing generated code
+static void JitFlush(jit_t *jit) {
+    memset(jit->hash,0,sizeof(jit->hash));
+    jit->num_blocks = 0;
+    jit->num_links  = 0;
+    jit->code_used  = jit->trampoline_size;
+    jit->generation++;
+}
+
+static jit_block_t *JitLookup(jit_t *jit, uint32_t addr) {
+    jit_block_t *block;
+    for(block = jit->hash[JIT_HASH(addr)]; NULL != block; block = block->hash_next) {
+        if(block->start == addr) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+//Does executing this instruction (if its condition passes) end a block?
+static int EndsBlock(decoded_instruction_t *decoded) {
+    uint32_t instruction = decoded->instruction;
+    uint32_t rd = (instruction>>12)&0xf;
+    uint32_t rn = (instruction>>16)&0xf;
+    if(decoded->type == INSTRUCTION_ALU || decoded->type == INSTRUCTION_SWAP) {
+        return rd == PC;
+    }
+    if(decoded->type == INSTRUCTION_MULTIPLY) {
+        return 0;
+    }
+    if(decoded->type == INSTRUCTION_SINGLE_DATA_TRANSFER) {
+        //loads to the PC, or writeback (which post indexing always does) to it
+        if((instruction&0x00100000) && rd == PC) {
+            return 1;
+        }
+        return rn == PC && (!(instruction&0x01000000) || (instruction&0x00200000));
+    }
+    if(decoded->type == INSTRUCTION_MULTI_DATA_TRANSFER) {
+        return (instruction&0x00100000) && (instruction&(1<<PC));
+    }
+    //Branches, SWIs and coprocessor instructions
+    return 1;
+}
+
+//Could this set FLAG_JIT_EXIT? Stores can write to translated code, and any access can reach a device
+//that schedules an event
+static int MayExit(decoded_instruction_t *decoded) {
+    return decoded->type == INSTRUCTION_SWAP ||
+        decoded->type == INSTRUCTION_SINGLE_DATA_TRANSFER ||
+        decoded->type == INSTRUCTION_MULTI_DATA_TRANSFER;
+}
+
+//Emit a check for a static successor: if the block left cpu->pc at expected then jump (eventually chained)
+//to the block for the next instruction
+static void EmitSuccessor(jit_t *jit, emitter_t *e, uint32_t expected) {
+    uint8_t *skip;
+    uint8_t *site;
+    uint8_t *stub;
+    //cmp dword [rbx+pc],expected ; jne skip
+    Emit8(e,0x81); Emit8(e,0xbb); Emit32(e,CPU_OFFSET_PC); Emit32(e,expected);
+    skip = EmitJump(e,op_jne,sizeof(op_jne),NULL);
+    site = EmitJump(e,op_jmp,sizeof(op_jmp),NULL);
+    //Until it's chained the jump goes to this stub which tells the dispatcher where we wanted to go
+    stub = e->pos;
+    PatchRel32(site,stub);
+    Emit8(e,0x41); Emit8(e,0xc7); Emit8(e,0x84); Emit8(e,0x24); Emit32(e,JIT_OFFSET_TARGET); Emit32(e,(expected+4)&0x3ffffff);
+    Emit8(e,0x48); Emit8(e,0xb8); Emit64(e,(uint64_t)(uintptr_t)site);             //mov rax,site
+    Emit8(e,0x49); Emit8(e,0x89); Emit8(e,0x84); Emit8(e,0x24); Emit32(e,JIT_OFFSET_SITE); //mov [r12+site],rax
+    EmitLeave(jit,e,EXCEPT_NONE);
+    PatchRel32(skip,e->pos);
+}
+
+static jit_block_t *JitTranslate(armv2_t *cpu, jit_t *jit, uint32_t start) {
+    page_info_t *page = GetPage(cpu,PAGEOF(start));
+    decoded_instruction_t *decoded[JIT_MAX_BLOCK_LEN];
+    uint8_t *exception_sites[JIT_MAX_BLOCK_LEN];
+    uint8_t *exit_sites[JIT_MAX_BLOCK_LEN];
+    uint8_t *skip_sites[JIT_MAX_BLOCK_LEN];
+    uint8_t *bail_site;
+    uint8_t *interrupt_site;
+    uint32_t length = 0;
+    uint32_t addr;
+    jit_block_t *block;
+    emitter_t e;
+
+    if(NULL == page || NULL == page->memory) {
+        //Let the interpreter raise the prefetch abort
+        return NULL;
+    }
+    if(NULL == page->decoded && ARMV2STATUS_OK != allocate_decoded(cpu,PAGEOF(start))) {
+        return NULL;
+    }
+    if(jit->num_blocks >= JIT_MAX_BLOCKS || jit->code_used + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE) {
+        JitFlush(jit);
+    }
+
+    for(addr = start; length < JIT_MAX_BLOCK_LEN && PAGEOF(addr) == PAGEOF(start); addr += 4) {
+        decoded_instruction_t *d = &page->decoded[WORDINPAGE(addr)];
+        if(NULL == d->handler) {
+            DecodeInstruction(d,page->memory[WORDINPAGE(addr)]);
+        }
+        decoded[length++] = d;
+        if(d->condition_mask && EndsBlock(d)) {
+            break;
+        }
+    }
+
+    e.start = e.pos = jit->code + jit->code_used;
+    //prologue: sub dword [r12+budget],length ; jl bail
+    EmitAddJit(&e,JIT_OFFSET_BUDGET,length,1);
+    bail_site = EmitJump(&e,op_jl,sizeof(op_jl),NULL);
+    //Any interrupts that aren't masked, or a reschedule? (pins & (~(psr>>26) | 4) & 7)
+    static const uint8_t interrupt_check[] = {
+        0x8b,0x83,              //mov eax,[rbx+psr]
+    };
+    EmitBytes(&e,interrupt_check,sizeof(interrupt_check)); Emit32(&e,CPU_OFFSET_PSR);
+    Emit8(&e,0xc1); Emit8(&e,0xe8); Emit8(&e,26);          //shr eax,26
+    Emit8(&e,0xf7); Emit8(&e,0xd0);                         //not eax
+    Emit8(&e,0x83); Emit8(&e,0xc8); Emit8(&e,PIN_RESCHEDULE);  //or eax,4
+    Emit8(&e,0x23); Emit8(&e,0x83); Emit32(&e,CPU_OFFSET_PINS); //and eax,[rbx+pins]
+    Emit8(&e,0xa8); Emit8(&e,PIN_F|PIN_I|PIN_RESCHEDULE);   //test al,7
+    interrupt_site = EmitJump(&e,op_jne,sizeof(op_jne),NULL);
+
+    for(uint32_t i = 0; i < length; i++) {
+        decoded_instruction_t *d = decoded[i];
+        addr = start + i*4;
+        exception_sites[i] = exit_sites[i] = skip_sites[i] = NULL;
+        if(d->condition_mask && (d->flags&DECODED_NEEDS_FLAGS)) {
+            //RESOLVE_FLAGS(cpu)
+            Emit8(&e,0x83); Emit8(&e,0xbb); Emit32(&e,CPU_OFFSET_LAZY); Emit8(&e,FLAGS_RESOLVED); //cmp dword [rbx+kind],0
+            Emit8(&e,0x74); Emit8(&e,15);                                 //je past the call
+            Emit8(&e,0x48); Emit8(&e,0x89); Emit8(&e,0xdf);               //mov rdi,rbx
+            Emit8(&e,0x48); Emit8(&e,0xb8); Emit64(&e,(uint64_t)(uintptr_t)ResolveFlags); //mov rax,ResolveFlags
+            Emit8(&e,0xff); Emit8(&e,0xd0);                               //call rax
+        }
+        //cpu->pc = addr ; SETPC(cpu,addr+8)
+        EmitStoreCpuImm(&e,CPU_OFFSET_PC,addr);
+        Emit8(&e,0x8b); Emit8(&e,0x83); Emit32(&e,CPU_OFFSET_PSR);   //mov eax,[rbx+psr]
+        Emit8(&e,0x25); Emit32(&e,0xfc000003);                        //and eax,0xfc000003
+        Emit8(&e,0x0d); Emit32(&e,(addr+8)&0x03fffffc);               //or eax,pc
+        Emit8(&e,0x89); Emit8(&e,0x83); Emit32(&e,CPU_OFFSET_PSR);   //mov [rbx+psr],eax
+        if(0 == d->condition_mask) {
+            continue;
+        }
+        if(0xffff != d->condition_mask) {
+            Emit8(&e,0xc1); Emit8(&e,0xe8); Emit8(&e,28);             //shr eax,28
+            Emit8(&e,0xb9); Emit32(&e,d->condition_mask);             //mov ecx,mask
+            Emit8(&e,0x0f); Emit8(&e,0xa3); Emit8(&e,0xc1);           //bt ecx,eax
+            skip_sites[i] = EmitJump(&e,op_jnc,sizeof(op_jnc),NULL);
+        }
+        Emit8(&e,0x48); Emit8(&e,0x89); Emit8(&e,0xdf);               //mov rdi,rbx
+        Emit8(&e,0xbe); Emit32(&e,d->instruction);                    //mov esi,instruction
+        Emit8(&e,0x48); Emit8(&e,0xb8); Emit64(&e,(uint64_t)(uintptr_t)d->handler); //mov rax,handler
+        Emit8(&e,0xff); Emit8(&e,0xd0);                               //call rax
+        Emit8(&e,0x83); Emit8(&e,0xf8); Emit8(&e,EXCEPT_NONE);        //cmp eax,EXCEPT_NONE
+        exception_sites[i] = EmitJump(&e,op_jne,sizeof(op_jne),NULL);
+        if(MayExit(d)) {
+            //If that wrote to translated code or scheduled something we have to stop here
+            Emit8(&e,0xf7); Emit8(&e,0x83); Emit32(&e,CPU_OFFSET_FLAGS); Emit32(&e,FLAG_JIT_EXIT);
+            exit_sites[i] = EmitJump(&e,op_jne,sizeof(op_jne),NULL);
+        }
+        if(skip_sites[i]) {
+            PatchRel32(skip_sites[i],e.pos);
+        }
+    }
+
+    //epilogue, try to chain to a static successor
+    addr = start + (length-1)*4;
+    if(decoded[length-1]->type == INSTRUCTION_BRANCH) {
+        uint32_t instruction = decoded[length-1]->instruction;
+        EmitSuccessor(jit,&e,(addr + 8 + ((instruction&0xffffff)<<2) - 4)&0xffffff);
+    }
+    EmitSuccessor(jit,&e,addr);
+    EmitLeave(jit,&e,EXCEPT_NONE);
+
+    //The exits that give back the part of the budget we didn't use
+    for(uint32_t i = 0; i < length; i++) {
+        if(exception_sites[i]) {
+            //eax holds the exception
+            PatchRel32(exception_sites[i],e.pos);
+            EmitAddJit(&e,JIT_OFFSET_BUDGET,length-(i+1),0);
+            (void) EmitJump(&e,op_jmp,sizeof(op_jmp),jit->leave);
+        }
+        if(exit_sites[i]) {
+            PatchRel32(exit_sites[i],e.pos);
+            EmitAddJit(&e,JIT_OFFSET_BUDGET,length-(i+1),0);
+            EmitLeave(jit,&e,EXCEPT_NONE);
+        }
+    }
+    PatchRel32(bail_site,e.pos);
+    PatchRel32(interrupt_site,e.pos);
+    EmitAddJit(&e,JIT_OFFSET_BUDGET,length,0);
+    EmitLeave(jit,&e,JIT_NOT_ENTERED);
+
+    block = &jit->blocks[jit->num_blocks++];
+    block->start     = start;
+    block->length    = length;
+    block->code      = e.start;
+    block->incoming  = NULL;
+    block->hash_next = jit->hash[JIT_HASH(start)];
+    jit->hash[JIT_HASH(start)] = block;
+    jit->code_used += e.pos - e.start;
+
+    for(uint32_t i = 0; i < length; i++) {
+        decoded[i]->flags |= DECODED_TRANSLATED;
+    }
+    return block;
+}
+
+static void JitKill(jit_t *jit, jit_block_t *block) {
+    jit_block_t **prev;
+    jit_link_t *link;
+    emitter_t e;
+    for(prev = &jit->hash[JIT_HASH(block->start)]; *prev; prev = &(*prev)->hash_next) {
+        if(*prev == block) {
+            *prev = block->hash_next;
+            break;
+        }
+    }
+    //Anything that was chained to us goes back to asking the dispatcher
+    for(link = block->incoming; NULL != link; link = link->next) {
+        PatchRel32(link->site,link->stub);
+    }
+    block->incoming = NULL;
+    //We may be in the middle of this block (if it wrote to itself), but we'll leave it straight after
+    //the store, so replacing the prologue is safe
+    e.start = e.pos = block->code;
+    (void) EmitJump(&e,op_jmp,sizeof(op_jmp),jit->dead);
+}
+
+void jit_invalidate(armv2_t *cpu, uint32_t addr) {
+    jit_t *jit = cpu->jit;
+    uint32_t start;
+    if(NULL == jit) {
+        return;
+    }
+    addr &= 0x03fffffc;
+    //Any block containing addr must start in the same page, no more than JIT_MAX_BLOCK_LEN words before it
+    for(start = addr; ; start -= 4) {
+        jit_block_t *block = JitLookup(jit,start);
+        if(NULL != block && start + block->length*4 > addr) {
+            JitKill(jit,block);
+        }
+        if(INPAGE(start) == 0 || addr - start >= (JIT_MAX_BLOCK_LEN-1)*4) {
+            break;
+        }
+    }
+    //in case we're running the code that was just overwritten
+    cpu->flags |= FLAG_JIT_EXIT;
+}
+
+static void JitChain(jit_t *jit, uint8_t *site, jit_block_t *target) {
+    jit_link_t *link;
+    int32_t rel;
+    if(jit->num_links >= JIT_MAX_LINKS) {
+        return;
+    }
+    memcpy(&rel,site,sizeof(rel));
+    link = &jit->links[jit->num_links++];
+    link->site = site;
+    link->stub = site + 4 + rel;
+    link->next = target->incoming;
+    target->incoming = link;
+    PatchRel32(site,target->code);
+}
+
+enum armv2_status jit_run_armv2(armv2_t *cpu, int32_t instructions) {
+    jit_t *jit;
+    if(NULL == cpu->jit) {
+        cpu->jit = JitCreate();
+        if(NULL == cpu->jit) {
+            //No executable memory, we'll just have to interpret
+            return interpret_armv2(cpu,instructions);
+        }
+    }
+    jit = cpu->jit;
+
+    while(instructions != 0) {
+        enum armv2_status status;
+        uint32_t result;
+        int32_t budget = instructions == -1 ? INT32_MAX : instructions;
+        uint32_t generation = jit->generation;
+        jit_block_t *block;
+        uint32_t next = (cpu->pc+4)&0x3ffffff;
+
+        cpu->flags &= ~FLAG_JIT_EXIT;
+        block = JitLookup(jit,next);
+        if(NULL == block) {
+            block = JitTranslate(cpu,jit,next);
+        }
+        if(NULL == block) {
+            result = JIT_NOT_ENTERED;
+        }
+        else {
+            jit->budget    = budget;
+            jit->exit_site = NULL;
+            result = jit->enter(cpu,jit,block->code);
+            if(instructions != -1) {
+                instructions = jit->budget;
+            }
+            if(JIT_NOT_ENTERED == result && jit->budget != budget) {
+                //We ran some blocks and then one we chained to bailed out, go round again to see why
+                continue;
+            }
+        }
+        if(JIT_NOT_ENTERED == result) {
+            //Interrupts, the end of the budget and aborts are all left to the interpreter
+            status = interpret_armv2(cpu,1);
+            if(ARMV2STATUS_RESCHEDULE == status || ARMV2STATUS_BREAKPOINT == status) {
+                //It put the instruction back
+                cpu->budget_left = instructions;
+                return status;
+            }
+            if(instructions > 0) {
+                instructions--;
+            }
+            if(ARMV2STATUS_OK != status) {
+                cpu->budget_left = instructions;
+                return status;
+            }
+            continue;
+        }
+        if(EXCEPT_NONE != result) {
+            if(ARMV2STATUS_OK != take_exception(cpu,(enum armv2_exception)result,&instructions)) {
+                return ARMV2STATUS_BREAKPOINT;
+            }
+            continue;
+        }
+        if(NULL != jit->exit_site) {
+            jit_block_t *target = JitLookup(jit,jit->exit_target);
+            if(NULL == target) {
+                target = JitTranslate(cpu,jit,jit->exit_target);
+            }
+            //Translating may have thrown away the block we were going to patch
+            if(NULL != target && generation == jit->generation) {
+                JitChain(jit,jit->exit_site,target);
+            }
+        }
+    }
+    return ARMV2STATUS_OK;
+}
@@ -1,7 +1,11 @@
 #include "armv2.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 
+//Every directory entry with nothing mapped in its range points here. It's never written to
+page_info_t *empty_page_table[PAGE_TABLE_SIZE];
+
 enum armv2_status MmuDataOperation(armv2_t *cpu,uint32_t crm, uint32_t aux, uint32_t crd, uint32_t crn, uint32_t opcode) {
     return ARMV2STATUS_OK;
 }
@@ -9,3 +13,131 @@ enum armv2_status MmuDataOperation(armv2_t *cpu,uint32_t crm, uint32_t aux, uint
 enum armv2_status MmuRegisterTransfer      (armv2_t *cpu, uint32_t crm, uint32_t aux, uint32_t crd, uint32_t crn, uint32_t opcode) {
     return ARMV2STATUS_OK;
 }
+
+void flush_tlb(armv2_t *cpu) {
+    for(uint32_t i=0;i<TLB_SIZE;i++) {
+        cpu->tlb[i].read_tag  = TLB_INVALID;
+        cpu->tlb[i].write_tag = TLB_INVALID;
+    }
+}
+
+void flush_tlb_page(armv2_t *cpu, uint32_t page_num) {
+    tlb_entry_t *entry = &cpu->tlb[page_num&(TLB_SIZE-1)];
+    if(entry->read_tag == page_num || entry->write_tag == page_num) {
+        entry->read_tag  = TLB_INVALID;
+        entry->write_tag = TLB_INVALID;
+    }
+}
+
+//The TLB missed, so fill in the entry for this page if it's one that the fast path can handle. Returns the
+//host address for the access if so, otherwise NULL
+uint32_t *TlbFill(armv2_t *cpu, uint32_t addr, uint32_t write) {
+    uint32_t page_num = PAGEOF(addr);
+    page_info_t *page;
+    tlb_entry_t *entry = &cpu->tlb[page_num&(TLB_SIZE-1)];
+    uint32_t user = GETMODE(cpu) == MODE_USR;
+    uint32_t read_ok;
+    uint32_t write_ok;
+
+    if(page_num >= NUM_PAGE_TABLES) {
+        return NULL;
+    }
+    page = GetPage(cpu,page_num);
+    if(NULL == page || NULL == page->memory) {
+        return NULL;
+    }
+    read_ok  = NULL == page->read_callback && (!user || (page->flags&PERM_READ));
+    //Anything we've decoded has to be invalidated on a write, so those go the slow way
+    //and pages a snapshot still needs a copy of have to be saved first. Clean pages need marking dirty
+    write_ok = NULL == page->write_callback && NULL == page->decoded && !(page->flags&PAGE_COW) &&
+        PageDirty(cpu,page_num) && (!user || (page->flags&PERM_WRITE));
+    if(!read_ok && !write_ok) {
+        return NULL;
+    }
+    entry->read_tag  = read_ok  ? page_num : TLB_INVALID;
+    entry->write_tag = write_ok ? page_num : TLB_INVALID;
+    entry->memory    = page->memory;
+    if(write ? !write_ok : !read_ok) {
+        return NULL;
+    }
+    return &page->memory[WORDINPAGE(addr)];
+}
+
+//Put page in the page table at page_num, allocating the second level table for it if need be
+enum armv2_status set_page(armv2_t *cpu, uint32_t page_num, page_info_t *page) {
+    page_info_t ***entry;
+    if(page_num >= NUM_PAGE_TABLES) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    entry = &cpu->page_directory[page_num>>PAGE_TABLE_BITS];
+    if(*entry == empty_page_table) {
+        if(NULL == page) {
+            return ARMV2STATUS_OK;
+        }
+        *entry = calloc(PAGE_TABLE_SIZE,sizeof(page_info_t*));
+        if(NULL == *entry) {
+            *entry = empty_page_table;
+            return ARMV2STATUS_MEMORY_ERROR;
+        }
+    }
+    (*entry)[page_num&(PAGE_TABLE_SIZE-1)] = page;
+    flush_tlb_page(cpu,page_num);
+    return ARMV2STATUS_OK;
+}
+
+//Set up the page_info for a RAM page that hasn't been used yet and put it in the page table. Until now
+//only SetCow can have touched it, so it keeps the PAGE_COW that gave it. Returns NULL if there's no memory
+//for the page table
+page_info_t *FillRamPage(armv2_t *cpu, uint32_t page_num) {
+    page_info_t *page = &cpu->ram_pages[page_num];
+    page->memory = cpu->physical_ram + page_num*WORDS_PER_PAGE;
+    page->flags  = (page->flags&PAGE_COW) | PERM_READ|PERM_EXECUTE|PERM_WRITE;
+    if(page_num == 0) {
+        //the first page is never writable, we'll put the boot rom there.
+        page->flags &= (~PERM_WRITE);
+    }
+    if(ARMV2STATUS_OK != set_page(cpu,page_num,page)) {
+        LOG_ERROR("No memory for the page table holding RAM page %u\n",page_num);
+        return NULL;
+    }
+    return page;
+}
+
+//Copy the dirty bits for num_pages pages from start_page into out, bit n of the bitmap being start_page+n, and
+//clear them if asked. Returns the number of dirty pages
+uint32_t query_dirty(armv2_t *cpu, uint32_t start_page, uint32_t num_pages, uint64_t *out, uint32_t clear) {
+    uint32_t count = 0;
+    if(NULL == cpu || start_page >= NUM_PAGE_TABLES) {
+        return 0;
+    }
+    if(num_pages > NUM_PAGE_TABLES - start_page) {
+        num_pages = NUM_PAGE_TABLES - start_page;
+    }
+    if(NULL != out) {
+        for(uint32_t i=0;i<(num_pages+63)/64;i++) {
+            out[i] = 0;
+        }
+    }
+    for(uint32_t i=0;i<num_pages;) {
+        uint32_t page_num = start_page + i;
+        uint64_t word = cpu->dirty[page_num>>6]>>(page_num&63);
+        if(0 == word) {
+            //nothing else in this word
+            i += 64 - (page_num&63);
+            continue;
+        }
+        if(word&1) {
+            count++;
+            if(NULL != out) {
+                out[i>>6] |= ((uint64_t)1)<<(i&63);
+            }
+            if(clear) {
+                cpu->dirty[page_num>>6] &= ~(((uint64_t)1)<<(page_num&63));
+                //It has to stop being write mapped so the next write can set it again
+                flush_tlb_page(cpu,page_num);
+            }
+        }
+        i++;
+    }
+    return count;
+}
@@ -0,0 +1,526 @@
+#include "armv2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+//Everything the guest sees that doesn't follow from its own state comes from the devices: the values their
+//read callbacks return, and the pins and interrupt lines they raise and lower. Recording saves those to a
+//file, and replaying feeds them back in place of the devices, which aren't called at all, so a recorded run
+//can be repeated exactly as long as the cpu starts out the same and has the same memory map.
+//
+//Device reads happen in the middle of a run, but they come in the same order every time the guest runs, so
+//they're saved without a time. Pins and lines can change at any moment from any thread, so while recording
+//a change isn't made straight away. It's put to one side and the cpu is stopped, and run_armv2 makes it
+//and records the cycle it did so at (see RecordInputs). Replaying schedules an event for each change, which
+//makes it at that same cycle.
+//
+//The one other thing that changes what the guest does is where the host's runs end. A WFI that's still
+//waiting when a slice runs out finishes there, so while recording each of those is saved too, as a wake.
+//Replaying, a slice that runs out during a WFI leaves the cpu waiting (FLAG_WAITING), and run_armv2 lets
+//the time go by without running anything until the next thing in the recording, whatever the host's runs
+//are.
+//
+//Snapshots save how far through the recording the cpu was (see ReplayPosition). Restoring one while
+//recording turns the recording into a replay from that point, which gives the cpu exactly the same inputs
+//as the first time round. Once it's caught up with the cycle the recording had got to it carries on
+//recording from there, see ReplayRewind.
+//
+//The file is REPLAY_MAGIC, then one record after another. Each is a byte with the kind of record, and then
+//numbers in LEB128, seven bits to a byte with the top bit set if there's more. A read of a word or a byte
+//has the value, a block read has the number of words and then each word, and a change of pins or lines has
+//the cycles since the last change (or the start) and then the pins or the line. A wake is stored like a
+//change, with a value of 0
+#define REPLAY_MAGIC      "ARMV2RR\1"
+#define REPLAY_MAGIC_SIZE (8)
+
+typedef struct {
+    uint32_t kind;
+    uint32_t value;
+} replay_input_t;
+
+struct _armv2_replay_t {
+    //Recording
+    FILE           *file;
+    uint32_t        failed;  //a write to the file went wrong
+    pthread_mutex_t lock;    //for the staged changes, which any thread can add to
+    replay_input_t *staged;
+    uint32_t        num_staged;
+    uint32_t        max_staged;
+    //Replaying. We keep one place in the recording for reads and another for changes, each skipping over
+    //the other kind of record
+    uint8_t        *data;
+    size_t          size;
+    size_t          read_pos;
+    size_t          input_pos;
+    armv2_event_t   event;   //due at the next change
+    uint32_t        diverged; //the guest asked for something the recording doesn't have
+    //cpu->cycles when we started, and the time of the last change since then
+    uint64_t        start;
+    uint64_t        last;
+    //Tells snapshots taken during this recording from ones taken before it
+    uint64_t        serial;
+    //Replaying a recording we were making before a restore took us back, the cycle we'd got to
+    uint64_t        live;
+};
+
+static uint64_t next_serial;
+
+static void PutNumber(armv2_replay_t *replay, uint64_t value) {
+    do {
+        uint32_t byte = value&0x7f;
+        value >>= 7;
+        if(EOF == fputc(value ? byte|0x80 : byte,replay->file)) {
+            replay->failed = 1;
+        }
+    } while(value);
+}
+
+static void PutKind(armv2_replay_t *replay, uint32_t kind) {
+    if(EOF == fputc(kind,replay->file)) {
+        replay->failed = 1;
+    }
+}
+
+//Returns 0 if the recording ends part way through the number
+static int GetNumber(armv2_replay_t *replay, size_t *pos, uint64_t *out) {
+    uint64_t value = 0;
+    for(uint32_t shift=0;*pos < replay->size && shift < 64;shift += 7) {
+        uint8_t byte = replay->data[(*pos)++];
+        value |= ((uint64_t)(byte&0x7f))<<shift;
+        if(!(byte&0x80)) {
+            *out = value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int IsInput(uint32_t kind) {
+    return kind >= REPLAY_RAISE_PINS && kind <= REPLAY_WAKE;
+}
+
+//Move pos past the record there. Returns 0 if there's no more complete records
+static int SkipRecord(armv2_replay_t *replay, size_t *pos) {
+    uint64_t count;
+    uint64_t value;
+    uint32_t kind;
+    if(*pos >= replay->size) {
+        return 0;
+    }
+    kind = replay->data[(*pos)++];
+    switch(kind) {
+    case REPLAY_READ:
+    case REPLAY_READ_BYTE:
+        return GetNumber(replay,pos,&value);
+    case REPLAY_READ_BLOCK:
+        if(!GetNumber(replay,pos,&count)) {
+            return 0;
+        }
+        while(count--) {
+            if(!GetNumber(replay,pos,&value)) {
+                return 0;
+            }
+        }
+        return 1;
+    default:
+        return IsInput(kind) && GetNumber(replay,pos,&value) && GetNumber(replay,pos,&value);
+    }
+}
+
+//Move pos on to the next record that is (or isn't) a change of pins or lines, returning its kind, or
+//REPLAY_END if there isn't one
+static uint32_t FindRecord(armv2_replay_t *replay, size_t *pos, int input) {
+    while(*pos < replay->size) {
+        uint32_t kind = replay->data[*pos];
+        if(IsInput(kind) == input) {
+            return kind;
+        }
+        if(!SkipRecord(replay,pos)) {
+            break;
+        }
+    }
+    *pos = replay->size;
+    return REPLAY_END;
+}
+
+static void ApplyInput(armv2_t *cpu, uint32_t kind, uint32_t value) {
+    switch(kind) {
+    case REPLAY_RAISE_PINS:
+        RaisePins(cpu,value);
+        break;
+    case REPLAY_LOWER_PINS:
+        LowerPins(cpu,value);
+        break;
+    case REPLAY_RAISE_LINE:
+        if(value < INTERRUPT_LINES) {
+            RaiseLine(cpu,value);
+        }
+        break;
+    case REPLAY_LOWER_LINE:
+        if(value < INTERRUPT_LINES) {
+            LowerLine(cpu,value);
+        }
+        break;
+    }
+}
+
+//Make every change that's due now, and schedule the event for the next one
+static void ReplayInputs(armv2_t *cpu, void *extra) {
+    armv2_replay_t *replay = extra;
+    uint32_t kind;
+    while(REPLAY_END != (kind = FindRecord(replay,&replay->input_pos,1))) {
+        size_t pos = replay->input_pos + 1;
+        uint64_t delta;
+        uint64_t value;
+        if(!GetNumber(replay,&pos,&delta) || !GetNumber(replay,&pos,&value)) {
+            replay->input_pos = replay->size;
+            break;
+        }
+        if(replay->start + replay->last + delta > cpu->cycles) {
+            armv2_schedule(cpu,&replay->event,replay->start + replay->last + delta - cpu->cycles);
+            return;
+        }
+        replay->last     += delta;
+        replay->input_pos = pos;
+        //Whatever the guest was waiting for, the recording has it finishing now
+        cpu->flags &= ~FLAG_WAITING;
+        ApplyInput(cpu,kind,value);
+    }
+    if(NULL == replay->file) {
+        return;
+    }
+    //Everything that was recorded has happened again, so once we're back where the recording had got to the
+    //devices take over
+    if(replay->live > cpu->cycles) {
+        armv2_schedule(cpu,&replay->event,replay->live - cpu->cycles);
+        return;
+    }
+    if(REPLAY_END != FindRecord(replay,&replay->read_pos,0)) {
+        replay->diverged = 1;
+    }
+    free(replay->data);
+    replay->data = NULL;
+    replay->size = 0;
+    cpu->flags   = (cpu->flags&~FLAG_REPLAYING) | FLAG_RECORDING;
+}
+
+//The read callbacks come here instead while we're recording or replaying
+uint32_t ReplayRead(armv2_t *cpu, page_info_t *page, access_callback_t callback, uint32_t addr, uint32_t kind) {
+    armv2_replay_t *replay = cpu->replay;
+    uint64_t value = 0;
+    if(cpu->flags&FLAG_RECORDING) {
+        value = callback(page->mapped_device,addr,0);
+        PutKind(replay,kind);
+        PutNumber(replay,value);
+        return value;
+    }
+    if(FindRecord(replay,&replay->read_pos,0) != kind) {
+        replay->diverged = 1;
+        return 0;
+    }
+    replay->read_pos++;
+    if(!GetNumber(replay,&replay->read_pos,&value)) {
+        replay->diverged = 1;
+    }
+    return value;
+}
+
+void ReplayReadBlock(armv2_t *cpu, page_info_t *page, uint32_t addr, uint32_t count, uint32_t *buffer) {
+    armv2_replay_t *replay = cpu->replay;
+    uint64_t recorded;
+    if(cpu->flags&FLAG_RECORDING) {
+        page->read_block_callback(page->mapped_device,addr,count,buffer);
+        PutKind(replay,REPLAY_READ_BLOCK);
+        PutNumber(replay,count);
+        for(uint32_t i=0;i<count;i++) {
+            PutNumber(replay,buffer[i]);
+        }
+        return;
+    }
+    memset(buffer,0,count*sizeof(uint32_t));
+    if(FindRecord(replay,&replay->read_pos,0) != REPLAY_READ_BLOCK) {
+        replay->diverged = 1;
+        return;
+    }
+    replay->read_pos++;
+    if(!GetNumber(replay,&replay->read_pos,&recorded) || recorded != count) {
+        replay->diverged = 1;
+        return;
+    }
+    for(uint32_t i=0;i<count;i++) {
+        uint64_t value;
+        if(!GetNumber(replay,&replay->read_pos,&value)) {
+            replay->diverged = 1;
+            return;
+        }
+        buffer[i] = value;
+    }
+}
+
+//Called by armv2_raise_pins and friends while we're recording or replaying. Replaying, the recording says
+//what changes, so anything else is ignored. Recording, the change waits for RecordInputs, and we stop the
+//cpu (or wake it) so that it gets made as soon as possible
+void ReplayInput(armv2_t *cpu, uint32_t kind, uint32_t value) {
+    armv2_replay_t *replay = cpu->replay;
+    if(!(cpu->flags&FLAG_RECORDING)) {
+        return;
+    }
+    pthread_mutex_lock(&replay->lock);
+    if(replay->num_staged == replay->max_staged) {
+        uint32_t max = replay->max_staged ? replay->max_staged*2 : 16;
+        replay_input_t *staged = realloc(replay->staged,max*sizeof(replay_input_t));
+        if(NULL == staged) {
+            LOG_ERROR("Out of memory recording an input\n");
+            replay->failed = 1;
+            pthread_mutex_unlock(&replay->lock);
+            return;
+        }
+        replay->staged     = staged;
+        replay->max_staged = max;
+    }
+    replay->staged[replay->num_staged].kind  = kind;
+    replay->staged[replay->num_staged].value = value;
+    replay->num_staged++;
+    pthread_mutex_unlock(&replay->lock);
+
+    //It's staged before the cpu's told about it, so it'll be there when the cpu stops to look
+    __atomic_fetch_or(&cpu->pins,PIN_RESCHEDULE,__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&cpu->wakeup_lock);
+    pthread_cond_broadcast(&cpu->wakeup);
+    pthread_mutex_unlock(&cpu->wakeup_lock);
+    ExecutorWake(cpu);
+}
+
+//Called by run_armv2 while recording, whenever the core isn't running. Make the changes that have been
+//staged since last time and record them as happening now
+void RecordInputs(armv2_t *cpu) {
+    armv2_replay_t *replay = cpu->replay;
+    replay_input_t *staged;
+    uint32_t num_staged;
+
+    //Anything staged after this will stop the cpu again
+    __atomic_fetch_and(&cpu->pins,~PIN_RESCHEDULE,__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&replay->lock);
+    staged     = replay->staged;
+    num_staged = replay->num_staged;
+    replay->staged     = NULL;
+    replay->num_staged = 0;
+    replay->max_staged = 0;
+    pthread_mutex_unlock(&replay->lock);
+
+    if(cpu->flags&FLAG_WAITING) {
+        PutKind(replay,REPLAY_WAKE);
+        PutNumber(replay,cpu->cycles - replay->start - replay->last);
+        PutNumber(replay,0);
+        replay->last = cpu->cycles - replay->start;
+        cpu->flags &= ~FLAG_WAITING;
+    }
+    for(uint32_t i=0;i<num_staged;i++) {
+        PutKind(replay,staged[i].kind);
+        PutNumber(replay,cpu->cycles - replay->start - replay->last);
+        PutNumber(replay,staged[i].value);
+        replay->last = cpu->cycles - replay->start;
+        ApplyInput(cpu,staged[i].kind,staged[i].value);
+    }
+    free(staged);
+}
+
+//Where the cpu has got to, for armv2_snapshot
+void ReplayPosition(armv2_t *cpu, replay_position_t *position) {
+    armv2_replay_t *replay = cpu->replay;
+    memset(position,0,sizeof(replay_position_t));
+    if(NULL == replay) {
+        return;
+    }
+    if(cpu->flags&FLAG_RECORDING) {
+        //Whatever comes next gets written at the end
+        long pos = ftell(replay->file);
+        if(pos < 0) {
+            //Leave the serial as 0 so the snapshot can't be restored while this is going on
+            return;
+        }
+        position->read_pos  = pos;
+        position->input_pos = pos;
+    }
+    else {
+        position->read_pos  = replay->read_pos;
+        position->input_pos = replay->input_pos;
+    }
+    position->serial = replay->serial;
+    position->last   = replay->last;
+}
+
+//Called by armv2_restore before it changes anything, so that it can still fail. The snapshot has to have
+//been taken since we started, and if we're recording we need what's been written so far to replay it
+enum armv2_status ReplayPrepareRewind(armv2_t *cpu, const replay_position_t *position) {
+    armv2_replay_t *replay = cpu->replay;
+    uint8_t *data = NULL;
+    long size;
+    if(NULL == replay) {
+        return ARMV2STATUS_OK;
+    }
+    if(position->serial != replay->serial) {
+        return ARMV2STATUS_INVALID_CPUSTATE;
+    }
+    if(!(cpu->flags&FLAG_RECORDING)) {
+        return ARMV2STATUS_OK;
+    }
+    if(0 != fflush(replay->file) || 0 != fseek(replay->file,0,SEEK_END) || (size = ftell(replay->file)) <= 0 ||
+       0 != fseek(replay->file,0,SEEK_SET) || NULL == (data = malloc(size)) ||
+       1 != fread(data,size,1,replay->file)) {
+        LOG_ERROR("Error reading back the recording\n");
+        free(data);
+        fseek(replay->file,0,SEEK_END);
+        return ARMV2STATUS_IO_ERROR;
+    }
+    //It has to be moved before it's written again anyway
+    fseek(replay->file,0,SEEK_END);
+    free(replay->data);
+    replay->data = data;
+    replay->size = size;
+    return ARMV2STATUS_OK;
+}
+
+//Called by armv2_restore once the cpu and the clock are back how they were at position. live is where the
+//clock had got to before that
+void ReplayRewind(armv2_t *cpu, const replay_position_t *position, uint64_t live) {
+    armv2_replay_t *replay = cpu->replay;
+    if(NULL == replay) {
+        return;
+    }
+    if(cpu->flags&FLAG_RECORDING) {
+        //Replay what's been recorded until we're back at live, see ReplayInputs
+        replay->live = live;
+        cpu->flags   = (cpu->flags&~FLAG_RECORDING) | FLAG_REPLAYING;
+    }
+    replay->read_pos  = position->read_pos;
+    replay->input_pos = position->input_pos;
+    replay->last      = position->last;
+    armv2_cancel(cpu,&replay->event);
+    ReplayInputs(cpu,replay);
+}
+
+static armv2_replay_t *NewReplay(armv2_t *cpu) {
+    armv2_replay_t *replay = calloc(1,sizeof(armv2_replay_t));
+    if(NULL == replay) {
+        return NULL;
+    }
+    pthread_mutex_init(&replay->lock,NULL);
+    armv2_init_event(&replay->event,ReplayInputs,replay);
+    replay->start  = cpu->cycles;
+    replay->serial = __atomic_add_fetch(&next_serial,1,__ATOMIC_RELAXED);
+    return replay;
+}
+
+static void FreeReplay(armv2_replay_t *replay) {
+    pthread_mutex_destroy(&replay->lock);
+    free(replay->staged);
+    free(replay->data);
+    free(replay);
+}
+
+//Save everything the devices give the cpu to filename, from now until armv2_stop_replay. Like running it,
+//this and armv2_stop_replay have to be called from the thread that runs the cpu, between runs
+enum armv2_status armv2_record(armv2_t *cpu, const char *filename) {
+    armv2_replay_t *replay;
+    if(NULL == cpu || NULL == filename || !CPU_INITIALISED(cpu)) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    if(NULL != cpu->replay || NULL != cpu->executor) {
+        return ARMV2STATUS_INVALID_CPUSTATE;
+    }
+    replay = NewReplay(cpu);
+    if(NULL == replay) {
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    //Read as well as written, for ReplayPrepareRewind
+    replay->file = fopen(filename,"w+b");
+    if(NULL == replay->file) {
+        LOG_ERROR("Error opening %s\n",filename);
+        FreeReplay(replay);
+        return ARMV2STATUS_IO_ERROR;
+    }
+    if(1 != fwrite(REPLAY_MAGIC,REPLAY_MAGIC_SIZE,1,replay->file)) {
+        fclose(replay->file);
+        FreeReplay(replay);
+        return ARMV2STATUS_IO_ERROR;
+    }
+    cpu->replay = replay;
+    cpu->flags |= FLAG_RECORDING;
+    return ARMV2STATUS_OK;
+}
+
+//Run the cpu on what armv2_record saved to filename rather than on its devices. The cpu has to be in the
+//state it was in when the recording started, with the same devices mapped in the same places
+enum armv2_status armv2_replay(armv2_t *cpu, const char *filename) {
+    armv2_replay_t *replay;
+    FILE *f;
+    long size;
+    if(NULL == cpu || NULL == filename || !CPU_INITIALISED(cpu)) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    if(NULL != cpu->replay || NULL != cpu->executor) {
+        return ARMV2STATUS_INVALID_CPUSTATE;
+    }
+    replay = NewReplay(cpu);
+    if(NULL == replay) {
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    f = fopen(filename,"rb");
+    if(NULL == f) {
+        LOG_ERROR("Error opening %s\n",filename);
+        FreeReplay(replay);
+        return ARMV2STATUS_IO_ERROR;
+    }
+    if(0 != fseek(f,0,SEEK_END) || (size = ftell(f)) < REPLAY_MAGIC_SIZE || 0 != fseek(f,0,SEEK_SET) ||
+       NULL == (replay->data = malloc(size)) || 1 != fread(replay->data,size,1,f) ||
+       0 != memcmp(replay->data,REPLAY_MAGIC,REPLAY_MAGIC_SIZE)) {
+        LOG_ERROR("Error reading recording %s\n",filename);
+        fclose(f);
+        FreeReplay(replay);
+        return ARMV2STATUS_IO_ERROR;
+    }
+    fclose(f);
+    replay->size      = size;
+    replay->read_pos  = REPLAY_MAGIC_SIZE;
+    replay->input_pos = REPLAY_MAGIC_SIZE;
+    cpu->replay = replay;
+    cpu->flags &= ~FLAG_WAITING;
+    cpu->flags |= FLAG_REPLAYING;
+    ReplayInputs(cpu,replay);
+    return ARMV2STATUS_OK;
+}
+
+//Finish recording or replaying. Returns ARMV2STATUS_IO_ERROR if the recording couldn't be written, and
+//ARMV2STATUS_VALUE_ERROR if a replay went somewhere the recording didn't, which means the cpu wasn't set up
+//the same as when it was recorded
+enum armv2_status armv2_stop_replay(armv2_t *cpu) {
+    armv2_replay_t *replay;
+    enum armv2_status result = ARMV2STATUS_OK;
+    if(NULL == cpu) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    replay = cpu->replay;
+    if(NULL == replay) {
+        return ARMV2STATUS_OK;
+    }
+    if(cpu->flags&FLAG_RECORDING) {
+        //Whatever's still staged happens now
+        RecordInputs(cpu);
+    }
+    armv2_cancel(cpu,&replay->event);
+    if(NULL != replay->file && 0 != fclose(replay->file)) {
+        replay->failed = 1;
+    }
+    if(replay->failed) {
+        result = ARMV2STATUS_IO_ERROR;
+    }
+    else if(replay->diverged) {
+        result = ARMV2STATUS_VALUE_ERROR;
+    }
+    cpu->flags &= ~(FLAG_RECORDING|FLAG_REPLAYING|FLAG_WAITING);
+    cpu->replay = NULL;
+    FreeReplay(replay);
+    return result;
+}
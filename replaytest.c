@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "testutil.h"
+
+//Check that replaying a recording gives exactly the run that was recorded, without calling the devices at
+//all, however the replay's runs are split up. The recorded run reads words, bytes and blocks from a device
+//that makes its values up as it goes, takes interrupts from the timer, waits for them, and has the FIQ pin
+//raised and lowered between its runs
+
+#define RECORD_RUNS 300
+
+static const uint32_t program[] = {
+    [0x00/4]  = 0xea00003e, //b start
+    [0x18/4]  = 0xea000018, //b irq
+                0xea000027, //b fiq
+    [0x80/4]  = 0xe3a09801, //irq: mov r9,#0x10000
+                0xe5990000, //ldr r0,[r9]
+                0xe08aa000, //add r10,r10,r0
+                0xe3a08a11, //mov r8,#0x11000
+                0xe5880004, //str r0,[r8,#TIMER_TICKS]
+                0xe28bb001, //add r11,r11,#1
+                0xe25ef008, //subs pc,lr,#8
+    [0xc0/4]  = 0xe3a09801, //fiq: mov r9,#0x10000
+                0xe5d90001, //ldrb r0,[r9,#1]
+                0xe08aa000, //add r10,r10,r0
+                0xe28cc001, //add r12,r12,#1
+                0xe25ef008, //subs pc,lr,#8
+    [0x100/4] = 0xe3a09801, //start: mov r9,#0x10000
+                0xe3a08a11, //mov r8,#0x11000
+                0xe3a00f7d, //mov r0,#500
+                0xe5880000, //str r0,[r8,#TIMER_INTERVAL]
+                0xe3a07a02, //mov r7,#0x2000
+                0xe5991008, //loop: ldr r1,[r9,#8]
+                0xe0822001, //add r2,r2,r1
+                0xe8990038, //ldmia r9,{r3,r4,r5}
+                0xe0822003, //add r2,r2,r3
+                0xe0222084, //eor r2,r2,r4,lsl #1
+                0xe08221e5, //add r2,r2,r5,ror #3
+                0xe5c92003, //strb r2,[r9,#3]
+                0xe589200c, //str r2,[r9,#12]
+                0xe2866001, //add r6,r6,#1
+                0xe20650ff, //and r5,r6,#0xff
+                0xe7872105, //str r2,[r7,r5,lsl #2]
+                0xe316003f, //tst r6,#0x3f
+                0x0e000300, //cdpeq p3,0 (wait for interrupt)
+                0xee101310, //mrc p3,0,r1,c0,c0,0
+                0xe0822001, //add r2,r2,r1
+                0xeaffffef, //b loop
+};
+
+static void Setup(armv2_t *cpu) {
+    SetupCpu(cpu,program,sizeof(program));
+    AddDevice(cpu,&random_device,0x10000);
+    AddDevice(cpu,NULL,0x11000);
+}
+
+int main(int argc, char *argv[]) {
+    char filename[] = "/tmp/replaytestXXXXXX";
+    static const int32_t slices[] = {1,7,1000,INT32_MAX};
+    armv2_t recorded;
+    enum armv2_status result;
+
+    MakeTempFile(filename,NULL,0);
+    Setup(&recorded);
+    if(ARMV2STATUS_OK != (result = armv2_record(&recorded,filename))) {
+        printf("Error %d recording\n",result);
+        return 1;
+    }
+    for(uint32_t i=0;i<RECORD_RUNS;i++) {
+        run_armv2(&recorded,1 + Random()%5000);
+        if(Random()&1) {
+            armv2_raise_pins(&recorded,PIN_F);
+        }
+        else {
+            armv2_lower_pins(&recorded,PIN_F);
+        }
+    }
+    if(ARMV2STATUS_OK != (result = armv2_stop_replay(&recorded))) {
+        printf("Error %d finishing the recording\n",result);
+        failures++;
+    }
+    //Make sure the recording has all the kinds of input in it
+    if(0 == recorded.regs.actual[11] || 0 == recorded.regs.actual[R8_F+4] || 0 == device_calls) {
+        printf("Recorded %u interrupts %u fast interrupts and %u device calls\n",recorded.regs.actual[11],
+               recorded.regs.actual[R8_F+4],device_calls);
+        failures++;
+    }
+
+    device_calls = 0;
+    for(uint32_t i=0;i<sizeof(slices)/sizeof(slices[0]);i++) {
+        armv2_t replayed;
+        Setup(&replayed);
+        if(ARMV2STATUS_OK != (result = armv2_replay(&replayed,filename))) {
+            printf("Error %d replaying\n",result);
+            return 1;
+        }
+        while(replayed.cycles < recorded.cycles) {
+            uint64_t left = recorded.cycles - replayed.cycles;
+            run_armv2(&replayed,left < (uint64_t)slices[i] ? left : slices[i]);
+        }
+        if(ARMV2STATUS_OK != (result = armv2_stop_replay(&replayed))) {
+            printf("Replaying %d at a time finished with %d\n",slices[i],result);
+            failures++;
+        }
+        CompareState(&recorded,&replayed,"Replaying %d at a time",slices[i]);
+        cleanup_armv2(&replayed);
+    }
+    if(0 != device_calls) {
+        printf("The device was called %u times while replaying\n",device_calls);
+        failures++;
+    }
+
+    cleanup_armv2(&recorded);
+    unlink(filename);
+    return Finish(argv[0]);
+}
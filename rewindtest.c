@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "testutil.h"
+
+//Check that going back in time with armv2_rewind and running forward again, as the debugger does, lands in
+//exactly the state the cpu was in the first time it got there, given the inputs were recorded. Sometimes it
+//runs forward over a breakpoint, stepping past it each time it's hit, which mustn't change the cycles. Once
+//it's been back and forth the recording has to still replay to where it ended up
+
+#define NUM_PIECES  48
+#define NUM_REWINDS 24
+#define BKPT        (0xef000000 | SWI_BREAKPOINT)
+#define BREAKPOINT  0x118
+
+static const uint32_t program[] = {
+    [0x00/4]  = 0xea00003e, //b start
+    [0x18/4]  = 0xea000018, //b irq
+                0xea000027, //b fiq
+    [0x80/4]  = 0xe5990000, //irq: ldr r0,[r9]
+                0xe08aa000, //add r10,r10,r0
+                0xe5880004, //str r0,[r8,#TIMER_TICKS]
+                0xe25ef008, //subs pc,lr,#8
+    [0xc0/4]  = 0xe28cc001, //fiq: add r12,r12,#1
+                0xe25ef008, //subs pc,lr,#8
+    [0x100/4] = 0xe3a09801, //start: mov r9,#0x10000
+                0xe3a08a11, //mov r8,#0x11000
+                0xe3a00f4b, //mov r0,#300
+                0xe5880000, //str r0,[r8,#TIMER_INTERVAL]
+                0xe3a07901, //mov r7,#0x4000
+                0xe5991004, //loop: ldr r1,[r9,#4]
+                0xe0822001, //add r2,r2,r1
+                0xe082200a, //add r2,r2,r10
+                0xe2023dff, //and r3,r2,#0x3fc0
+                0xe7872003, //str r2,[r7,r3]
+                0xe2866001, //add r6,r6,#1
+                0xe31600ff, //tst r6,#0xff
+                0x0e000300, //cdpeq p3,0 (wait for interrupt)
+                0xeafffff6, //b loop
+};
+
+static void Setup(armv2_t *cpu) {
+    SetupCpu(cpu,program,sizeof(program));
+    AddDevice(cpu,&random_device,0x10000);
+    AddDevice(cpu,NULL,0x11000);
+}
+
+static uint64_t Hash(armv2_t *cpu) {
+    uint64_t hash = 14695981039346656037ULL;
+    RESOLVE_FLAGS(cpu);
+    for(uint32_t i=0;i<NUMREGS;i++) {
+        hash = (hash ^ cpu->regs.actual[i])*1099511628211ULL;
+    }
+    hash = (hash ^ cpu->pc)*1099511628211ULL;
+    hash = (hash ^ cpu->cycles)*1099511628211ULL;
+    for(uint32_t i=0;i<MEMORY_SIZE/4;i++) {
+        hash = (hash ^ cpu->physical_ram[i])*1099511628211ULL;
+    }
+    return hash;
+}
+
+//Write over an instruction the way the debugger does, saving the page for the snapshots first
+static void SetWord(armv2_t *cpu, uint32_t addr, uint32_t word) {
+    prepare_page_write(cpu,PAGEOF(addr));
+    cpu->physical_ram[addr/4] = word;
+    invalidate_instruction(cpu,addr);
+}
+
+//Run on to cycle, with a breakpoint in the loop if asked, stepping over it with the real instruction each
+//time it's hit. Returns how many times that was
+static uint32_t RunTo(armv2_t *cpu, uint64_t cycle, int breakpoint) {
+    uint32_t hits = 0;
+    if(breakpoint) {
+        SetWord(cpu,BREAKPOINT,BKPT);
+    }
+    while(cpu->cycles < cycle) {
+        if(ARMV2STATUS_BREAKPOINT == run_armv2(cpu,cycle - cpu->cycles)) {
+            hits++;
+            SetWord(cpu,BREAKPOINT,program[BREAKPOINT/4]);
+            run_armv2(cpu,1);
+            SetWord(cpu,BREAKPOINT,BKPT);
+        }
+    }
+    if(breakpoint) {
+        SetWord(cpu,BREAKPOINT,program[BREAKPOINT/4]);
+    }
+    return hits;
+}
+
+int main(int argc, char *argv[]) {
+    char filename[] = "/tmp/rewindtestXXXXXX";
+    armv2_t cpu, replayed;
+    armv2_snapshot_t *snapshots[NUM_PIECES];
+    uint32_t num_snapshots = 0;
+    uint64_t cycles[NUM_PIECES+1];
+    uint64_t hashes[NUM_PIECES+1];
+    uint32_t hits = 0;
+    enum armv2_status result;
+
+    MakeTempFile(filename,NULL,0);
+    Setup(&cpu);
+    if(ARMV2STATUS_OK != (result = armv2_record(&cpu,filename))) {
+        printf("Error %d recording\n",result);
+        return 1;
+    }
+    //The first time through, in pieces of random size with a snapshot at the end of every fourth
+    cycles[0] = cpu.cycles;
+    hashes[0] = Hash(&cpu);
+    for(uint32_t i=1;i<=NUM_PIECES;i++) {
+        run_armv2(&cpu,1 + Random()%3000);
+        cycles[i] = cpu.cycles;
+        hashes[i] = Hash(&cpu);
+        if(0 == i%4 && ARMV2STATUS_OK == armv2_snapshot(&cpu,&snapshots[num_snapshots])) {
+            num_snapshots++;
+        }
+        if(0 == Random()%4) {
+            armv2_raise_pins(&cpu,PIN_F);
+        }
+        else {
+            armv2_lower_pins(&cpu,PIN_F);
+        }
+    }
+    if(num_snapshots != NUM_PIECES/4) {
+        printf("Only took %u snapshots\n",num_snapshots);
+        return 1;
+    }
+    if(ARMV2STATUS_VALUE_ERROR != armv2_rewind(&cpu,cycles[3])) {
+        printf("Rewound to before the first snapshot\n");
+        failures++;
+    }
+
+    //Back to random points after the first snapshot, and forward to them again the same way or by stepping
+    //over a breakpoint
+    for(uint32_t i=0;i<NUM_REWINDS;i++) {
+        uint32_t target = 4 + Random()%(NUM_PIECES-3);
+        int breakpoint  = i&1;
+        if(ARMV2STATUS_OK != (result = armv2_rewind(&cpu,cycles[target])) || cpu.cycles > cycles[target]) {
+            printf("Error %d rewinding to %llu, got to %llu\n",result,(unsigned long long)cycles[target],
+                   (unsigned long long)cpu.cycles);
+            failures++;
+            continue;
+        }
+        hits += RunTo(&cpu,cycles[target],breakpoint);
+        if(cpu.cycles != cycles[target] || Hash(&cpu) != hashes[target]) {
+            printf("Running forward to piece %u %s the breakpoint differs, at %llu rather than %llu\n",target,
+                   breakpoint ? "over" : "without",(unsigned long long)cpu.cycles,(unsigned long long)cycles[target]);
+            failures++;
+        }
+    }
+    if(0 == hits) {
+        printf("Never stopped at the breakpoint\n");
+        failures++;
+    }
+
+    //Carry on past where the recording had got to, which goes back to recording, and the whole thing has to
+    //replay to the same place
+    RunTo(&cpu,cycles[NUM_PIECES],0);
+    run_armv2(&cpu,5000);
+    if(ARMV2STATUS_OK != (result = armv2_stop_replay(&cpu))) {
+        printf("Error %d finishing the recording\n",result);
+        failures++;
+    }
+    Setup(&replayed);
+    if(ARMV2STATUS_OK != (result = armv2_replay(&replayed,filename))) {
+        printf("Error %d replaying\n",result);
+        return 1;
+    }
+    RunTo(&replayed,cpu.cycles,0);
+    if(ARMV2STATUS_OK != (result = armv2_stop_replay(&replayed))) {
+        printf("Replaying the recording after rewinding finished with %d\n",result);
+        failures++;
+    }
+    CompareState(&cpu,&replayed,"Replaying the recording after rewinding");
+
+    for(uint32_t i=0;i<num_snapshots;i++) {
+        armv2_free_snapshot(snapshots[i]);
+    }
+    cleanup_armv2(&replayed);
+    cleanup_armv2(&cpu);
+    unlink(filename);
+    return Finish(argv[0]);
+}
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "armv2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+//ROM images that any number of cpus can share. The first load_shared_rom of a file reads it once into an
+//anonymous file and decodes every word of it. Every cpu that loads the same file after that maps the anonymous
+//file over the start of its RAM privately, so the host shares the memory until a cpu writes to a page
+//and gets its own copy, and points its page infos at the shared decoded instructions. Nothing writes to
+//those: any write to a page drops the page to a private copy first (see UnsharePage), and every word is
+//already decoded so fetching never has to fill one in. Translated code marks the decoded instructions it
+//covers, so the JIT build only shares the memory
+struct _armv2_rom_t {
+    armv2_rom_t           *next;
+    dev_t                  device;
+    ino_t                  inode;
+    off_t                  size;
+    struct timespec        mtime;
+    uint32_t               refcount;
+    uint32_t               num_pages;
+    int                    fd;
+    uint32_t              *memory;  //read only view of fd
+    decoded_instruction_t *decoded; //WORDS_PER_PAGE for each page
+};
+
+static armv2_rom_t *roms;
+static pthread_mutex_t roms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void FreeRom(armv2_rom_t *rom) {
+    if(NULL != rom->memory) {
+        munmap(rom->memory,rom->num_pages*PAGE_SIZE);
+    }
+    if(rom->fd >= 0) {
+        close(rom->fd);
+    }
+    free(rom->decoded);
+    free(rom);
+}
+
+//Read the file into a new anonymous file. Returns NULL on error
+static armv2_rom_t *CreateRom(const char *filename, const struct stat *st) {
+    armv2_rom_t *rom = calloc(1,sizeof(armv2_rom_t));
+    FILE *f = NULL;
+    size_t size;
+
+    if(NULL == rom) {
+        return NULL;
+    }
+    rom->fd        = -1;
+    rom->device    = st->st_dev;
+    rom->inode     = st->st_ino;
+    rom->size      = st->st_size;
+    rom->mtime     = st->st_mtim;
+    rom->num_pages = (st->st_size + PAGE_MASK)>>PAGE_SIZE_BITS;
+    size           = rom->num_pages*PAGE_SIZE;
+
+    rom->fd = memfd_create("armv2 rom",MFD_CLOEXEC);
+    if(rom->fd < 0 || 0 != ftruncate(rom->fd,size)) {
+        goto error;
+    }
+    rom->memory = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,rom->fd,0);
+    if(MAP_FAILED == rom->memory) {
+        rom->memory = NULL;
+        goto error;
+    }
+    f = fopen(filename,"rb");
+    if(NULL == f) {
+        LOG_ERROR("Error opening %s\n",filename);
+        goto error;
+    }
+    if(fread(rom->memory,1,st->st_size,f) != (size_t)st->st_size) {
+        LOG_ERROR("Error reading %s\n",filename);
+        goto error;
+    }
+    fclose(f);
+    f = NULL;
+    //From here on everyone only ever reads it
+    mprotect(rom->memory,size,PROT_READ);
+
+#ifndef ARMV2_JIT
+    rom->decoded = calloc(rom->num_pages*WORDS_PER_PAGE,sizeof(decoded_instruction_t));
+    if(NULL == rom->decoded) {
+        goto error;
+    }
+    for(uint32_t i=0;i<rom->num_pages*WORDS_PER_PAGE;i++) {
+        DecodeInstruction(&rom->decoded[i],rom->memory[i]);
+    }
+#endif
+    return rom;
+
+error:
+    if(NULL != f) {
+        fclose(f);
+    }
+    FreeRom(rom);
+    return NULL;
+}
+
+//Find the registry's copy of the file, making it if this is the first time, and take a reference to it
+static armv2_rom_t *AcquireRom(const char *filename, enum armv2_status *result) {
+    struct stat st = {0};
+    armv2_rom_t *rom;
+
+    if(0 != stat(filename,&st)) {
+        *result = ARMV2STATUS_IO_ERROR;
+        return NULL;
+    }
+    if(st.st_size < 24) {
+        //24 is the bare minimum for a rom, see load_rom
+        *result = ARMV2STATUS_IO_ERROR;
+        return NULL;
+    }
+    pthread_mutex_lock(&roms_lock);
+    for(rom = roms; NULL != rom; rom = rom->next) {
+        //Anything that's changed since we read it is a different rom, however soon after it was written
+        if(rom->device == st.st_dev && rom->inode == st.st_ino && rom->size == st.st_size &&
+           rom->mtime.tv_sec == st.st_mtim.tv_sec && rom->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            break;
+        }
+    }
+    if(NULL == rom) {
+        rom = CreateRom(filename,&st);
+        if(NULL == rom) {
+            pthread_mutex_unlock(&roms_lock);
+            *result = ARMV2STATUS_IO_ERROR;
+            return NULL;
+        }
+        rom->next = roms;
+        roms      = rom;
+    }
+    rom->refcount++;
+    pthread_mutex_unlock(&roms_lock);
+    *result = ARMV2STATUS_OK;
+    return rom;
+}
+
+void release_rom(armv2_rom_t *rom) {
+    armv2_rom_t **link;
+    if(NULL == rom) {
+        return;
+    }
+    pthread_mutex_lock(&roms_lock);
+    if(0 != --rom->refcount) {
+        pthread_mutex_unlock(&roms_lock);
+        return;
+    }
+    for(link = &roms; *link != rom; link = &(*link)->next) {
+    }
+    *link = rom->next;
+    pthread_mutex_unlock(&roms_lock);
+    FreeRom(rom);
+}
+
+//Called before anything decoded from a page is invalidated. If the decoded instructions belong to a ROM
+//the page gets its own copy of them
+void UnsharePage(page_info_t *page) {
+    decoded_instruction_t *decoded = malloc(WORDS_PER_PAGE*sizeof(decoded_instruction_t));
+    if(NULL != decoded) {
+        memcpy(decoded,page->decoded,WORDS_PER_PAGE*sizeof(decoded_instruction_t));
+    }
+    //If we're out of memory it'll just be decoded again as it's executed
+    page->decoded = decoded;
+    page->flags  &= ~PAGE_SHARED;
+}
+
+//Like load_rom, but RAM that holds the same ROM as another cpu's is only stored once, as is what's been
+//decoded from it. A write to one of its pages gives this cpu its own copy of the page
+enum armv2_status load_shared_rom(armv2_t *cpu, const char *filename) {
+    enum armv2_status result;
+    armv2_rom_t *rom;
+    void *mapped = MAP_FAILED;
+
+    if(NULL == cpu || NULL == filename) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    if(!(cpu->flags&FLAG_INIT) || NULL == cpu->ram_pages) {
+        return ARMV2STATUS_INVALID_CPUSTATE;
+    }
+    rom = AcquireRom(filename,&result);
+    if(NULL == rom) {
+        return result;
+    }
+    if(rom->num_pages > (cpu->physical_ram_size>>PAGE_SIZE_BITS)) {
+        release_rom(rom);
+        return ARMV2STATUS_VALUE_ERROR;
+    }
+
+    //Let go of everything decoded from the old contents, which for pages of a rom we had before isn't ours
+    for(uint32_t i=0;NULL != cpu->rom && i<cpu->rom->num_pages;i++) {
+        if(cpu->ram_pages[i].flags&PAGE_SHARED) {
+            cpu->ram_pages[i].decoded = NULL;
+            cpu->ram_pages[i].flags  &= ~PAGE_SHARED;
+        }
+    }
+    for(uint32_t i=0;i<rom->num_pages;i++) {
+        invalidate_page(cpu,i);
+        result = prepare_page_write(cpu,i);
+        if(ARMV2STATUS_OK != result) {
+            release_rom(rom);
+            return result;
+        }
+    }
+    //The host can only map it over RAM in whole host pages, otherwise it's copied like load_rom would
+    if(sysconf(_SC_PAGESIZE) == PAGE_SIZE) {
+        mapped = mmap(cpu->physical_ram,rom->num_pages*PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_FIXED,rom->fd,0);
+    }
+    if(MAP_FAILED == mapped) {
+        memcpy(cpu->physical_ram,rom->memory,rom->num_pages*PAGE_SIZE);
+    }
+    for(uint32_t i=0;NULL != rom->decoded && i<rom->num_pages;i++) {
+        page_info_t *page = &cpu->ram_pages[i];
+        free(page->decoded);
+        page->decoded = rom->decoded + i*WORDS_PER_PAGE;
+        page->flags  |= PAGE_SHARED;
+    }
+    flush_tlb(cpu);
+
+    //Nothing refers to the old rom any more, and if it's the same one we've taken another reference to it
+    release_rom(cpu->rom);
+    cpu->rom = rom;
+    return ARMV2STATUS_OK;
+}
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "testutil.h"
+
+//Check that cpus sharing a ROM from load_shared_rom each behave exactly as if they had their own copy from
+//load_rom, when some of them write over the ROM's data and code and the others don't: the ones that write
+//see their writes and run the code they wrote, and the others still see the ROM as it was in the file
+
+#define NUM_CPUS    6
+#define ROM_PAGES   3
+
+static uint32_t rom[ROM_PAGES*WORDS_PER_PAGE] = {
+    [0x00/4]   = 0xea00000e, //b 0x40
+    [0x40/4]   = 0xe3a00a01, //mov r0,#0x1000
+    [0x44/4]   = 0xe5901000, //loop: ldr r1,[r0]
+                 0xe2811001, //add r1,r1,#1
+                 0xe3540000, //cmp r4,#0
+                 0x15801000, //strne r1,[r0]
+                 0x15805008, //strne r5,[r0,#8]
+                 0xe0822001, //add r2,r2,r1
+                 0xeb0003e8, //bl 0x1004
+                 0xeafffff7, //b loop
+    [0x1000/4] = 0x00000000, //the counter, which the cpus with r4 set write to
+                 0xe2866001, //add r6,r6,#1
+                 0xe2833001, //add r3,r3,#1, which those cpus replace with what's in r5
+                 0xe1a0f00e, //mov pc,lr
+};
+
+static void Setup(armv2_t *cpu, const char *filename, uint32_t shared, uint32_t index) {
+    enum armv2_status result;
+    SetupCpu(cpu,NULL,0);
+    result = shared ? load_shared_rom(cpu,filename) : load_rom(cpu,filename);
+    if(ARMV2STATUS_OK != result) {
+        printf("Error %d loading %s\n",result,filename);
+        exit(1);
+    }
+    //Every other cpu writes, over the counter and the add r3,r3,#1 with add r3,r3,#2
+    cpu->regs.actual[4] = index&1;
+    cpu->regs.actual[5] = 0xe2833002;
+}
+
+//What each cpu has done has to be down to what it ran, and not what the others sharing its rom ran. The
+//run might have stopped between the two adds, in which case the last call hasn't added anything yet
+static void CheckWrites(armv2_t *cpu, uint32_t index) {
+    uint32_t counter = cpu->physical_ram[0x1000/4];
+    uint32_t calls   = cpu->regs.actual[6];
+    uint32_t added   = cpu->regs.actual[3];
+    if(cpu->pc == 0x1004) {
+        calls--;
+    }
+    if(index&1) {
+        if(0 == counter || added != calls*2) {
+            printf("cpu %u wrote %u calls %u added %u\n",index,counter,calls,added);
+            failures++;
+        }
+    }
+    else if(0 != counter || added != calls || cpu->physical_ram[0x1008/4] != rom[0x1008/4]) {
+        printf("cpu %u sees another's writes: counter %u calls %u added %u\n",index,counter,calls,added);
+        failures++;
+    }
+}
+
+//Writing the file again makes it a different rom, even if it's the same size and the same second. Its new
+//time is set to a nanosecond later so that it's the same second however coarse the filesystem's clock is.
+//The cpu still running the old rom mustn't notice
+static void CheckRewritten(const char *filename, armv2_t *old) {
+    static const uint32_t word = 0xe3a00a02; //mov r0,#0x2000
+    struct timespec times[2];
+    struct stat st;
+    armv2_t cpu;
+    int fd;
+
+    fd = open(filename,O_WRONLY);
+    if(fd < 0 || 0 != fstat(fd,&st) || pwrite(fd,&word,sizeof(word),0x40) != (ssize_t)sizeof(word)) {
+        printf("Error rewriting %s\n",filename);
+        exit(1);
+    }
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    times[1].tv_nsec = (times[1].tv_nsec + 1)%1000000000;
+    if(0 != futimens(fd,times)) {
+        printf("Error setting the time of %s\n",filename);
+        exit(1);
+    }
+    close(fd);
+    Setup(&cpu,filename,1,0);
+    if(cpu.physical_ram[0x40/4] != word || old->physical_ram[0x40/4] != rom[0x40/4]) {
+        printf("Loading the rewritten rom gave %08x, and the old one has %08x\n",cpu.physical_ram[0x40/4],
+               old->physical_ram[0x40/4]);
+        failures++;
+    }
+    cleanup_armv2(&cpu);
+}
+
+int main(int argc, char *argv[]) {
+    char filename[] = "/tmp/romtestXXXXXX";
+    armv2_t shared[NUM_CPUS], private[NUM_CPUS];
+    armv2_t *cpus[NUM_CPUS];
+    enum armv2_status results[NUM_CPUS];
+
+    for(uint32_t i=0x2000/4;i<ROM_PAGES*WORDS_PER_PAGE;i++) {
+        rom[i] = 0xe1a00000;
+    }
+    MakeTempFile(filename,rom,sizeof(rom));
+
+    for(uint32_t i=0;i<NUM_CPUS;i++) {
+        Setup(&shared[i],filename,1,i);
+        Setup(&private[i],filename,0,i);
+        cpus[i] = &shared[i];
+    }
+    //They take turns, so the ones that don't write run right after the ones that do
+    for(uint32_t round=0;round<5;round++) {
+        for(uint32_t i=0;i<NUM_CPUS;i++) {
+            run_armv2(&shared[i],1001+i*17);
+            run_armv2(&private[i],1001+i*17);
+            CompareState(&private[i],&shared[i],"run: cpu %u with the shared rom",i);
+        }
+    }
+    for(uint32_t i=0;i<NUM_CPUS;i++) {
+        CheckWrites(&shared[i],i);
+#ifndef ARMV2_JIT
+        //The JIT build only shares the memory
+        if(!(shared[i].ram_pages[0].flags&PAGE_SHARED) || !!(shared[i].ram_pages[1].flags&PAGE_SHARED) != !(i&1)) {
+            printf("cpu %u pages shared %x %x\n",i,shared[i].ram_pages[0].flags,shared[i].ram_pages[1].flags);
+            failures++;
+        }
+#endif
+    }
+
+    //Running them together treats the lanes still sharing the rom's code as running the same instructions
+    armv2_run_batch(cpus,NUM_CPUS,5000,results);
+    for(uint32_t i=0;i<NUM_CPUS;i++) {
+        run_armv2(&private[i],5000);
+        CompareState(&private[i],&shared[i],"batch: cpu %u with the shared rom",i);
+        CheckWrites(&shared[i],i);
+    }
+
+    CheckRewritten(filename,&shared[0]);
+
+    for(uint32_t i=0;i<NUM_CPUS;i++) {
+        cleanup_armv2(&shared[i]);
+        cleanup_armv2(&private[i]);
+    }
+    unlink(filename);
+    return Finish(argv[0]);
+}
@@ -0,0 +1,384 @@
+#include "armv2.h"
+#include <stdlib.h>
+#include <string.h>
+
+//Taking a snapshot doesn't copy any memory. Every RAM page is marked PAGE_COW instead, which keeps it out of
+//the write side of the TLB so that the first store to it after the snapshot comes through PerformStore. That
+//saves the page as it was into the newest snapshot before the store goes ahead.
+//
+//Snapshots are chained from oldest to newest. A page as it was at snapshot n is the copy in the first
+//snapshot from n onwards that has one, or what's in RAM now if none of them do
+
+typedef struct {
+    uint32_t    page_num;
+    page_info_t page; //only the device and permission parts mean anything
+} mapped_page_t;
+
+struct _armv2_snapshot_t {
+    armv2_t                  *cpu; //NULL once the snapshot has been dropped from the chain by a restore
+    struct _armv2_snapshot_t *older;
+    struct _armv2_snapshot_t *newer;
+    regs_t                    regs;
+    uint32_t                  pc;
+    uint32_t                  pins;
+    uint64_t                  cycles;
+    uint32_t                  waiting; //FLAG_WAITING, which a replay needs to carry on the same way
+    uint32_t                  incomplete; //a page written since couldn't be saved, so it can't be restored
+    replay_position_t         replay;
+    exception_handler_t       exception_handlers[EXCEPT_MAX];
+    hw_manager_t              hardware_manager;
+    interrupt_controller_t    interrupts;
+    uint32_t                  num_pages;
+    uint32_t                **pages; //the saved contents of each RAM page, NULL if it hasn't been needed
+    uint32_t                  num_mapped;
+    mapped_page_t            *mapped;
+};
+
+static uint32_t NumRamPages(armv2_t *cpu) {
+    return cpu->physical_ram_size>>PAGE_SIZE_BITS;
+}
+
+static uint32_t IsRamPage(armv2_t *cpu, page_info_t *page) {
+    return NULL != cpu->ram_pages && page >= cpu->ram_pages && page < cpu->ram_pages + NumRamPages(cpu);
+}
+
+static uint32_t IsMapped(page_info_t *page) {
+    return page->read_callback || page->write_callback;
+}
+
+static void FreePages(armv2_snapshot_t *snapshot) {
+    if(NULL == snapshot->pages) {
+        return;
+    }
+    for(uint32_t i=0;i<snapshot->num_pages;i++) {
+        free(snapshot->pages[i]);
+        snapshot->pages[i] = NULL;
+    }
+}
+
+//Take the snapshot out of the chain and let go of everything it holds apart from the struct itself
+static void DetachSnapshot(armv2_snapshot_t *snapshot) {
+    FreePages(snapshot);
+    free(snapshot->pages);
+    free(snapshot->mapped);
+    snapshot->pages  = NULL;
+    snapshot->mapped = NULL;
+    snapshot->cpu    = NULL;
+    snapshot->older  = NULL;
+    snapshot->newer  = NULL;
+}
+
+static void SetCow(armv2_t *cpu, uint32_t cow) {
+    for(uint32_t i=0;i<NumRamPages(cpu);i++) {
+        if(cow) {
+            cpu->ram_pages[i].flags |= PAGE_COW;
+        }
+        else {
+            cpu->ram_pages[i].flags &= ~PAGE_COW;
+        }
+    }
+    flush_tlb(cpu);
+}
+
+//Called before the first write to a RAM page since the newest snapshot was taken
+enum armv2_status SnapshotPage(armv2_t *cpu, page_info_t *page) {
+    armv2_snapshot_t *snapshot = cpu->snapshot;
+    uint32_t index;
+    uint32_t *copy;
+
+    if(!(page->flags&PAGE_COW)) {
+        return ARMV2STATUS_OK;
+    }
+    if(NULL == snapshot || !IsRamPage(cpu,page)) {
+        page->flags &= ~PAGE_COW;
+        return ARMV2STATUS_OK;
+    }
+    index = page - cpu->ram_pages;
+    if(NULL != snapshot->pages[index]) {
+        //Freeing a newer snapshot can leave us with a copy from before it was taken, which is the one we want
+        page->flags &= ~PAGE_COW;
+        return ARMV2STATUS_OK;
+    }
+    copy = malloc(PAGE_SIZE);
+    if(NULL == copy) {
+        //The write goes ahead regardless, so none of the snapshots up to now can get this page back
+        LOG_ERROR("Out of memory saving page %u for a snapshot\n",index);
+        for(armv2_snapshot_t *s = snapshot; NULL != s; s = s->older) {
+            s->incomplete = 1;
+        }
+        page->flags &= ~PAGE_COW;
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    memcpy(copy,page->memory,PAGE_SIZE);
+    snapshot->pages[index] = copy;
+    page->flags &= ~PAGE_COW;
+    return ARMV2STATUS_OK;
+}
+
+//For writes to RAM from outside the cpu, like load_rom or the python bindings. Saves the page for the
+//snapshot if need be, and marks it dirty
+enum armv2_status prepare_page_write(armv2_t *cpu, uint32_t page_num) {
+    page_info_t *page;
+    if(NULL == cpu || page_num >= NUM_PAGE_TABLES) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    page = GetPage(cpu,page_num);
+    if(NULL == page) {
+        return ARMV2STATUS_OK;
+    }
+    MarkDirty(cpu,page_num);
+    return SnapshotPage(cpu,page);
+}
+
+enum armv2_status armv2_snapshot(armv2_t *cpu, armv2_snapshot_t **out) {
+    armv2_snapshot_t *snapshot;
+    uint32_t num_mapped = 0;
+
+    if(NULL == cpu || NULL == out || !CPU_INITIALISED(cpu)) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    snapshot = calloc(1,sizeof(armv2_snapshot_t));
+    if(NULL == snapshot) {
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    snapshot->num_pages = NumRamPages(cpu);
+    snapshot->pages     = calloc(snapshot->num_pages,sizeof(uint32_t*));
+    if(NULL == snapshot->pages) {
+        free(snapshot);
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+
+    //Remember which pages have devices on them, and any pages that aren't RAM at all
+    for(int pass=0;pass<2;pass++) {
+        for(uint32_t i=0;i<PAGE_DIRECTORY_SIZE;i++) {
+            page_info_t **table = cpu->page_directory[i];
+            if(empty_page_table == table) {
+                continue;
+            }
+            for(uint32_t j=0;j<PAGE_TABLE_SIZE;j++) {
+                page_info_t *page = table[j];
+                if(NULL == page || (IsRamPage(cpu,page) && !IsMapped(page))) {
+                    continue;
+                }
+                if(pass == 1) {
+                    snapshot->mapped[snapshot->num_mapped].page_num = (i<<PAGE_TABLE_BITS) | j;
+                    snapshot->mapped[snapshot->num_mapped].page     = *page;
+                    snapshot->num_mapped++;
+                }
+                else {
+                    num_mapped++;
+                }
+            }
+        }
+        if(pass == 0 && num_mapped) {
+            snapshot->mapped = calloc(num_mapped,sizeof(mapped_page_t));
+            if(NULL == snapshot->mapped) {
+                free(snapshot->pages);
+                free(snapshot);
+                return ARMV2STATUS_MEMORY_ERROR;
+            }
+        }
+        if(0 == num_mapped) {
+            break;
+        }
+    }
+
+    RESOLVE_FLAGS(cpu);
+    snapshot->regs             = cpu->regs;
+    snapshot->pc               = cpu->pc;
+    snapshot->pins             = cpu->pins;
+    snapshot->cycles           = cpu->cycles;
+    snapshot->waiting          = cpu->flags&FLAG_WAITING;
+    snapshot->hardware_manager = cpu->hardware_manager;
+    snapshot->interrupts       = cpu->interrupts;
+    memcpy(snapshot->exception_handlers,cpu->exception_handlers,sizeof(snapshot->exception_handlers));
+    ReplayPosition(cpu,&snapshot->replay);
+
+    snapshot->cpu   = cpu;
+    snapshot->older = cpu->snapshot;
+    if(NULL != cpu->snapshot) {
+        cpu->snapshot->newer = snapshot;
+    }
+    cpu->snapshot = snapshot;
+    SetCow(cpu,1);
+
+    *out = snapshot;
+    return ARMV2STATUS_OK;
+}
+
+//Put the device pages back the way they were when the snapshot was taken
+static enum armv2_status RestoreMappings(armv2_t *cpu, armv2_snapshot_t *snapshot) {
+    //First clear out everything that's mapped now...
+    for(uint32_t i=0;i<PAGE_DIRECTORY_SIZE;i++) {
+        page_info_t **table = cpu->page_directory[i];
+        if(empty_page_table == table) {
+            continue;
+        }
+        for(uint32_t j=0;j<PAGE_TABLE_SIZE;j++) {
+            page_info_t *page = table[j];
+            if(NULL == page) {
+                continue;
+            }
+            if(IsRamPage(cpu,page)) {
+                page->mapped_device        = NULL;
+                page->read_callback        = NULL;
+                page->write_callback       = NULL;
+                page->read_byte_callback   = NULL;
+                page->write_byte_callback  = NULL;
+                page->read_block_callback  = NULL;
+                page->write_block_callback = NULL;
+            }
+            else if(NULL == page->memory) {
+                //A page that only exists for a device, the snapshot will make it again if it needs it
+                free(page->decoded);
+                free(page);
+                table[j] = NULL;
+            }
+        }
+    }
+    //...then put back what was mapped then
+    for(uint32_t i=0;i<snapshot->num_mapped;i++) {
+        mapped_page_t *mapped = &snapshot->mapped[i];
+        page_info_t *page = GetPage(cpu,mapped->page_num);
+        if(NULL == page) {
+            page = calloc(1,sizeof(page_info_t));
+            if(NULL == page) {
+                return ARMV2STATUS_MEMORY_ERROR;
+            }
+            if(ARMV2STATUS_OK != set_page(cpu,mapped->page_num,page)) {
+                free(page);
+                return ARMV2STATUS_MEMORY_ERROR;
+            }
+        }
+        page->mapped_device        = mapped->page.mapped_device;
+        page->read_callback        = mapped->page.read_callback;
+        page->write_callback       = mapped->page.write_callback;
+        page->read_byte_callback   = mapped->page.read_byte_callback;
+        page->write_byte_callback  = mapped->page.write_byte_callback;
+        page->read_block_callback  = mapped->page.read_block_callback;
+        page->write_block_callback = mapped->page.write_block_callback;
+        page->flags                = (page->flags&(PAGE_COW|PAGE_SHARED)) | (mapped->page.flags&~(PAGE_COW|PAGE_SHARED));
+    }
+    return ARMV2STATUS_OK;
+}
+
+//Put the cpu back how it was when the snapshot was taken. Only the pages that have been written since are
+//copied back. Snapshots newer than this one describe a future that no longer happens, so they're dropped
+//from the chain; they still have to be freed but can't be restored. The clock goes back too, with anything
+//scheduled still due when it was. If we're recording, the cpu replays the recording from where it was at
+//the snapshot until it's back to now, see ReplayRewind. Returns ARMV2STATUS_MEMORY_ERROR if a page written
+//since the snapshot couldn't be saved, leaving the cpu as it was
+enum armv2_status armv2_restore(armv2_t *cpu, armv2_snapshot_t *snapshot) {
+    armv2_snapshot_t *newer;
+    enum armv2_status result;
+    uint64_t live;
+    if(NULL == cpu || NULL == snapshot || snapshot->cpu != cpu) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    if(snapshot->incomplete) {
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    result = ReplayPrepareRewind(cpu,&snapshot->replay);
+    if(ARMV2STATUS_OK != result) {
+        return result;
+    }
+
+    for(uint32_t i=0;i<snapshot->num_pages;i++) {
+        for(armv2_snapshot_t *s = snapshot; NULL != s; s = s->newer) {
+            if(NULL != s->pages[i]) {
+                memcpy(cpu->ram_pages[i].memory,s->pages[i],PAGE_SIZE);
+                invalidate_page(cpu,i);
+                MarkDirty(cpu,i);
+                break;
+            }
+        }
+    }
+    newer = snapshot->newer;
+    while(NULL != newer) {
+        armv2_snapshot_t *next = newer->newer;
+        DetachSnapshot(newer);
+        newer = next;
+    }
+    snapshot->newer = NULL;
+    FreePages(snapshot);
+    cpu->snapshot = snapshot;
+
+    cpu->regs             = snapshot->regs;
+    cpu->pc               = snapshot->pc;
+    cpu->pins             = snapshot->pins;
+    cpu->hardware_manager = snapshot->hardware_manager;
+    cpu->interrupts       = snapshot->interrupts;
+    cpu->lazy_flags.kind  = FLAGS_RESOLVED;
+    memcpy(cpu->exception_handlers,snapshot->exception_handlers,sizeof(cpu->exception_handlers));
+    cpu->flags = (cpu->flags&~FLAG_WAITING) | snapshot->waiting;
+    live = cpu->cycles;
+    RewindEvents(cpu,snapshot->cycles);
+    ReplayRewind(cpu,&snapshot->replay,live);
+
+    result = RestoreMappings(cpu,snapshot);
+    //This flushes the TLB too, which covers the mode and the mappings having changed
+    SetCow(cpu,1);
+    return result;
+}
+
+//Restore the newest snapshot taken at or before cycle, for going back in time. run_armv2 can then run the
+//cpu forward to exactly where it was at cycle, as a breakpoint doesn't count as an instruction, and as long
+//as it gets the same inputs, which recording makes sure of. Returns ARMV2STATUS_VALUE_ERROR if there's no
+//snapshot that old
+enum armv2_status armv2_rewind(armv2_t *cpu, uint64_t cycle) {
+    armv2_snapshot_t *snapshot;
+    if(NULL == cpu) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    for(snapshot = cpu->snapshot; NULL != snapshot && snapshot->cycles > cycle; snapshot = snapshot->older) {
+    }
+    if(NULL == snapshot) {
+        return ARMV2STATUS_VALUE_ERROR;
+    }
+    return armv2_restore(cpu,snapshot);
+}
+
+//Free a snapshot. If it's still in the chain then the pages it saved are handed on to the next oldest, as
+//they're also how things were then if that snapshot hasn't saved the page itself
+void armv2_free_snapshot(armv2_snapshot_t *snapshot) {
+    armv2_t *cpu;
+    if(NULL == snapshot) {
+        return;
+    }
+    cpu = snapshot->cpu;
+    if(NULL != cpu) {
+        armv2_snapshot_t *older = snapshot->older;
+        if(NULL != older) {
+            for(uint32_t i=0;i<snapshot->num_pages;i++) {
+                if(NULL == older->pages[i]) {
+                    older->pages[i]    = snapshot->pages[i];
+                    snapshot->pages[i] = NULL;
+                }
+            }
+            older->newer = snapshot->newer;
+        }
+        if(NULL != snapshot->newer) {
+            snapshot->newer->older = older;
+        }
+        else {
+            cpu->snapshot = older;
+            if(NULL == older) {
+                //Nothing to save pages for any more
+                SetCow(cpu,0);
+            }
+        }
+        DetachSnapshot(snapshot);
+    }
+    free(snapshot);
+}
+
+//Drop every snapshot from the chain, for cleanup_armv2. Whoever took them still has to free them
+void release_snapshots(armv2_t *cpu) {
+    armv2_snapshot_t *snapshot = cpu->snapshot;
+    while(NULL != snapshot) {
+        armv2_snapshot_t *older = snapshot->older;
+        DetachSnapshot(snapshot);
+        snapshot = older;
+    }
+    cpu->snapshot = NULL;
+}
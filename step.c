@@ -5,7 +5,262 @@
 #include <string.h>
 #include "armv2.h"
 
-enum armv2_status run_armv2(armv2_t *cpu, int32_t instructions) {
+//For each condition, bit n of the mask is set if that condition passes when the NZCV flags are n
+static const uint32_t condition_masks[16] = {
+    [COND_EQ] = 0xf0f0, //Z set
+    [COND_NE] = 0x0f0f, //Z clear
+    [COND_CS] = 0xcccc, //C set
+    [COND_CC] = 0x3333, //C clear
+    [COND_MI] = 0xff00, //N set
+    [COND_PL] = 0x00ff, //N clear
+    [COND_VS] = 0xaaaa, //V set
+    [COND_VC] = 0x5555, //V clear
+    [COND_HI] = 0x0c0c, //C set and Z clear
+    [COND_LS] = 0xf3f3, //C clear or Z set
+    [COND_GE] = 0xaa55, //N set and V set, or N clear and V clear
+    [COND_LT] = 0x55aa, //N set and V clear or N clear and V set
+    [COND_GT] = 0x0a05, //Z clear and either N set and V set, or N clear and V clear
+    [COND_LE] = 0xf5fa, //Z set or N set and V clear, or N clear and V set
+    [COND_AL] = 0xffff, //Always
+    [COND_NV] = 0x0000, //Never
+};
+
+static const instruction_handler_t instruction_handlers[INSTRUCTION_MAX] = {
+    [INSTRUCTION_ALU]                           = ALUInstruction,
+    [INSTRUCTION_MULTIPLY]                      = MultiplyInstruction,
+    [INSTRUCTION_SWAP]                          = SwapInstruction,
+    [INSTRUCTION_SINGLE_DATA_TRANSFER]          = SingleDataTransferInstruction,
+    [INSTRUCTION_BRANCH]                        = BranchInstruction,
+    [INSTRUCTION_MULTI_DATA_TRANSFER]           = MultiDataTransferInstruction,
+    [INSTRUCTION_SOFTWARE_INTERRUPT]            = SoftwareInterruptInstruction,
+    [INSTRUCTION_COPROCESSOR_DATA_TRANSFER]     = CoprocessorDataTransferInstruction,
+    [INSTRUCTION_COPROCESSOR_REGISTER_TRANSFER] = CoprocessorRegisterTransferInstruction,
+    [INSTRUCTION_COPROCESSOR_DATA_OPERATION]    = CoprocessorDataOperationInstruction,
+};
+
+//Does this instruction read NZCV? That includes reading r15 as an operand (which gets the whole PSR),
+//writing the whole of r15, and the flag setting instructions that leave some of the flags alone
+static int NeedsFlags(enum instruction_type type, uint32_t instruction) {
+    uint32_t rn = (instruction>>16)&0xf;
+    uint32_t rd = (instruction>>12)&0xf;
+    uint32_t rs = (instruction>>8)&0xf;
+    uint32_t rm = instruction&0xf;
+    if(CONDITION_BITS(instruction) != COND_AL) {
+        return 1;
+    }
+    switch(type) {
+    case INSTRUCTION_ALU:
+        if(rn == PC || rd == PC) {
+            return 1;
+        }
+        if(!(instruction&0x02000000)) {
+            if(rm == PC || ((instruction&0x10) && rs == PC)) {
+                return 1;
+            }
+            if((instruction&0xff0) == 0x060) {
+                //RRX shifts the carry in
+                return 1;
+            }
+        }
+        //ADC, SBC and RSC use the carry, and the logical operations keep V and maybe C
+        return ((1<<((instruction>>21)&0xf))&0x00e0) ||
+            ((instruction&0x00100000) && ((1<<((instruction>>21)&0xf))&0xf303));
+    case INSTRUCTION_MULTIPLY:
+        return (instruction&0x00100000) || rn == PC || rd == PC || rs == PC || rm == PC;
+    case INSTRUCTION_SWAP:
+        return rn == PC || rd == PC || rm == PC;
+    case INSTRUCTION_SINGLE_DATA_TRANSFER:
+        return rn == PC || rd == PC || ((instruction&0x02000000) && rm == PC);
+    case INSTRUCTION_BRANCH:
+        return 0;
+    case INSTRUCTION_MULTI_DATA_TRANSFER:
+        return rn == PC || (instruction&(1<<PC));
+    default:
+        //SWIs and coprocessor instructions are rare enough not to bother
+        return 1;
+    }
+}
+
+void DecodeInstruction(decoded_instruction_t *decoded, uint32_t instruction) {
+    enum instruction_type type = INSTRUCTION_ALU;
+    switch((instruction>>26)&03) {
+    case 0:
+        //Data processing, multiply or single data swap
+        if((instruction&0x020000f0) != 0x90) {
+            //data processing instruction, which is any with an immediate operand whatever the low bits look like
+            type = INSTRUCTION_ALU;
+        }
+        else if(instruction&0xf00) {
+            //multiply
+            type = INSTRUCTION_MULTIPLY;
+        }
+        else {
+            //swap
+            type = INSTRUCTION_SWAP;
+        }
+        break;
+    case 1:
+        //LDR or STR, or undefined
+        type = INSTRUCTION_SINGLE_DATA_TRANSFER;
+        break;
+    case 2:
+        //LDM or STM or branch
+        if(instruction&0x02000000) {
+            type = INSTRUCTION_BRANCH;
+        }
+        else {
+            type = INSTRUCTION_MULTI_DATA_TRANSFER;
+        }
+        break;
+    case 3:
+        //coproc functions or swi
+        if((instruction&0x0f000000) == 0x0f000000) {
+            type = INSTRUCTION_SOFTWARE_INTERRUPT;
+        }
+        else if((instruction&0x02000000) == 0) {
+            type = INSTRUCTION_COPROCESSOR_DATA_TRANSFER;
+        }
+        else if(instruction&0x10) {
+            type = INSTRUCTION_COPROCESSOR_REGISTER_TRANSFER;
+        }
+        else {
+            type = INSTRUCTION_COPROCESSOR_DATA_OPERATION;
+        }
+        break;
+    }
+    decoded->instruction    = instruction;
+    decoded->condition_mask = condition_masks[CONDITION_BITS(instruction)];
+    decoded->type           = type;
+    decoded->flags          = (decoded->flags&DECODED_TRANSLATED) | (NeedsFlags(type,instruction) ? DECODED_NEEDS_FLAGS : 0);
+    if(type == INSTRUCTION_ALU) {
+        decoded->handler = alu_handlers[(instruction>>21)&0xf][ALU_FORM(instruction)][(instruction>>20)&1][((instruction>>12)&0xf) == PC];
+    }
+    else {
+        decoded->handler = instruction_handlers[type];
+    }
+}
+
+//Where each mode keeps r8-r14 while it isn't the current mode
+static const uint8_t register_banks[4][7] = {
+    [MODE_USR] = {R8_U,R9_U,R10_U,R11_U,R12_U,R13_U,R14_U},
+    [MODE_FIQ] = {R8_F,R9_F,R10_F,R11_F,R12_F,R13_F,R14_F},
+    [MODE_IRQ] = {R8_U,R9_U,R10_U,R11_U,R12_U,R13_I,R14_I},
+    [MODE_SUP] = {R8_U,R9_U,R10_U,R11_U,R12_U,R13_S,R14_S},
+};
+
+void SwapBanks(armv2_t *cpu, uint32_t old_mode, uint32_t new_mode) {
+    const uint8_t *old_bank = register_banks[old_mode&3];
+    const uint8_t *new_bank = register_banks[new_mode&3];
+    if(((old_mode&3) == MODE_USR) != ((new_mode&3) == MODE_USR)) {
+        //The TLB only holds pages the current mode can access
+        flush_tlb(cpu);
+    }
+    for(uint32_t i=0;i<7;i++) {
+        if(old_bank[i] != new_bank[i]) {
+            cpu->regs.actual[old_bank[i]] = cpu->regs.actual[8+i];
+            cpu->regs.actual[8+i]         = cpu->regs.actual[new_bank[i]];
+        }
+    }
+}
+
+enum armv2_status allocate_decoded(armv2_t *cpu, uint32_t page_num) {
+    page_info_t *page = GetPage(cpu,page_num);
+    page->decoded = calloc(WORDS_PER_PAGE,sizeof(decoded_instruction_t));
+    if(NULL == page->decoded) {
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    //Stores to this page now have to invalidate what we decode, so they can't use the TLB
+    flush_tlb_page(cpu,page_num);
+    return ARMV2STATUS_OK;
+}
+
+void invalidate_page(armv2_t *cpu, uint32_t page_num) {
+    page_info_t *page = GetPage(cpu,page_num);
+    if(NULL == page || NULL == page->decoded) {
+        return;
+    }
+    for(uint32_t addr=page_num<<PAGE_SIZE_BITS;addr<((page_num+1)<<PAGE_SIZE_BITS);addr+=4) {
+        INVALIDATE_DECODED(cpu,page,addr);
+    }
+}
+
+enum armv2_status invalidate_instruction(armv2_t *cpu, uint32_t addr) {
+    page_info_t *page;
+    if(NULL == cpu || addr&0xfc000000) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    page = GetPage(cpu,PAGEOF(addr));
+    if(NULL != page) {
+        INVALIDATE_DECODED(cpu,page,addr);
+    }
+    return ARMV2STATUS_OK;
+}
+
+//The guest is spinning or halted until it's interrupted, and every cpu->idle.period instructions it's back
+//in exactly the same state. We skip as many whole periods of the budget as we can, so that whatever's left
+//over leaves it where running everything would have done. The budget run_armv2 gives us ends at the next
+//event, so nothing that's due gets skipped. With nothing scheduled only an interrupt can wake it, so we
+//mark it halted, and if we're running forever we sleep until one comes in rather than burn a host core
+//going round the loop
+static void Idle(armv2_t *cpu, int32_t *instructions) {
+    if(InterruptPending(cpu) || PIN_ON(cpu,RESCHEDULE)) {
+        //Raised by another thread while we were running, we'll take it next time round
+        return;
+    }
+    if(UINT64_MAX == NextDeadline(cpu)) {
+        cpu->flags |= FLAG_HALTED;
+    }
+    if((cpu->flags&FLAG_RUN_FOREVER) && (cpu->flags&FLAG_HALTED)) {
+        WaitForInterrupt(cpu);
+    }
+    else if(*instructions >= 0) {
+        int32_t skip = *instructions - *instructions%cpu->idle.period;
+        *instructions     -= skip;
+        cpu->idle_skipped += skip;
+        if(0 == *instructions && 1 == cpu->idle.period) {
+            //When the core starts again it carries on past the WFI, which a replay has to know about
+            cpu->flags |= FLAG_WAITING;
+        }
+    }
+    else if(*instructions == -1) {
+        WaitForInterrupt(cpu);
+    }
+}
+
+//Returns ARMV2STATUS_BREAKPOINT if the exception means we should stop executing. instructions is the
+//budget the caller has left, which we might use some of. If we stop, what's left of it goes in
+//cpu->budget_left
+enum armv2_status take_exception(armv2_t *cpu, enum armv2_exception exception, int32_t *instructions) {
+    if(exception == EXCEPT_IDLE) {
+        Idle(cpu,instructions);
+        return ARMV2STATUS_OK;
+    }
+    RESOLVE_FLAGS(cpu);
+    IDLE_RESET(cpu);
+    if(exception == EXCEPT_BREAKPOINT) {
+        if(*instructions == -1 || (cpu->flags&FLAG_RUN_FOREVER)) {
+            //this means we're running forver, so treat this as an SWI
+            exception = EXCEPT_SOFTWARE_INTERRUPT;
+        }
+        else {
+            //This is special and means stop executing the emulator
+            //Don't advance PC next time since we're at a bkpt
+            cpu->pc -= 4;
+            //Nor count it, so that the cycles only ever go up for instructions that ran, wherever the
+            //breakpoints are
+            cpu->budget_left = *instructions + 1;
+            return ARMV2STATUS_BREAKPOINT;
+        }
+    }
+    exception_handler_t ex_handler = cpu->exception_handlers[exception];
+    uint32_t saved_pc = cpu->regs.actual[PC];
+    SWITCHMODE(cpu,ex_handler.mode);
+    cpu->regs.actual[ex_handler.save_reg] = saved_pc;
+    cpu->pc = ex_handler.pc-4;
+    return ARMV2STATUS_OK;
+}
+
+enum armv2_status interpret_armv2(armv2_t *cpu, int32_t instructions) {
     uint32_t running = 1;
     //for(running=1;running;cpu->pc = (cpu->pc+4)&0x3ffffff) {
     //instructions of -1 means run forever
@@ -17,196 +272,109 @@ enum armv2_status run_armv2(armv2_t *cpu, int32_t instructions) {
             instructions--;
         }
         enum armv2_exception exception = EXCEPT_NONE;
+        decoded_instruction_t *decoded = NULL;
         cpu->pc = (cpu->pc+4)&0x3ffffff;
         //check if PC is valid
         SETPC(cpu,cpu->pc + 8);
 
         //Before we do anything, we check to see if we need to do an FIQ or an IRQ
-        if(FLAG_CLEAR(cpu,F)) {
-            if(PIN_ON(cpu,F)) {
-                //crumbs, time to do an FIQ!
-                cpu->regs.actual[R14_F] = cpu->regs.actual[PC];
-                SETMODE(cpu,MODE_FIQ);
-                SETFLAG(cpu,F);
-                SETFLAG(cpu,I);
-                for(uint32_t i=8;i<15;i++) {
-                    cpu->regs.effective[i] = &cpu->regs.actual[R8_F+(i-8)];
-                }
-                cpu->pc = 0x1c-4;
-                continue;
+        if(PINS(cpu)) {
+            if(PIN_ON(cpu,RESCHEDULE)) {
+                return Reschedule(cpu,instructions);
             }
-        }
-        if(FLAG_CLEAR(cpu,I)) {
-            if(PIN_ON(cpu,I)) {
-                //crumbs, time to do an FIQ!
-                //set the LR first
-                cpu->regs.actual[R14_I] = cpu->regs.actual[PC];
-                //set the mode to IRQ mode
-                SETMODE(cpu,MODE_IRQ);
-                //mask interrupts so they won't be taken next time.
-                SETFLAG(cpu,I);
-                cpu->pc = 0x18-4;
-                for(uint32_t i=13;i<15;i++) {
-                    cpu->regs.effective[i] = &cpu->regs.actual[R13_I+(i-13)];
-                }
+            if(TakeInterrupt(cpu)) {
                 continue;
             }
         }
 
-        if(cpu->page_tables[PAGEOF(cpu->pc)] == NULL) {
+        enum armv2_status result = FetchInstruction(cpu,&decoded);
+        if(ARMV2STATUS_INVALID_PAGE == result) {
             //Trying to execute an unmapped page!
             //some sort of exception
             exception = EXCEPT_PREFETCH_ABORT;
             goto handle_exception;
         }
+        else if(ARMV2STATUS_OK != result) {
+            return result;
+        }
 
-
-        uint32_t instruction = DEREF(cpu,cpu->pc);
-        switch(CONDITION_BITS(instruction)) {
-        case COND_EQ: //Z set
-            if(FLAG_SET(cpu,Z)) {
-                break;
-            }
-            continue;
-        case COND_NE: //Z clear
-            if(FLAG_CLEAR(cpu,Z)) {
-                break;
-            }
-            continue;
-        case COND_CS: //C set
-            if(FLAG_SET(cpu,C)) {
-                break;
-            }
-            continue;
-        case COND_CC: //C clear
-            if(FLAG_CLEAR(cpu,C)) {
-                break;
-            }
-            continue;
-        case COND_MI: //N set
-            if(FLAG_SET(cpu,N)) {
-                break;
-            }
-            continue;
-        case COND_PL: //N clear
-            if(FLAG_CLEAR(cpu,N)) {
-                break;
-            }
-            continue;
-        case COND_VS: //V set
-            if(FLAG_SET(cpu,V)) {
-                break;
-            }
-            continue;
-        case COND_VC: //V clear
-            if(FLAG_CLEAR(cpu,V)) {
-                continue;
-            }
-            break;
-        case COND_HI: //C set and Z clear
-            if(FLAG_SET(cpu,C) && FLAG_CLEAR(cpu,Z)) {
-                break;
-            }
-            continue;
-        case COND_LS: //C clear or Z set
-            if(FLAG_CLEAR(cpu,C) || FLAG_SET(cpu,Z)) {
-                break;
-            }
-            continue;
-        case COND_GE: //N set and V set, or N clear and V clear
-            if( (!!FLAG_SET(cpu,N)) == (!!FLAG_SET(cpu,V)) ) {
-                break;
-            }
-            continue;
-        case COND_LT: //N set and V clear or N clear and V set
-            if( (!!FLAG_SET(cpu,N)) != (!!FLAG_SET(cpu,V)) ) {
-                break;
-            }
-            continue;
-        case COND_GT: //Z clear and either N set and V set, or N clear and V clear
-            if((FLAG_CLEAR(cpu,Z) && (!!FLAG_SET(cpu,N)) == (!!FLAG_SET(cpu,V)) )) {
-                break;
-            }
-            continue;
-        case COND_LE: //Z set or N set and V clear, or N clear and V set
-            if((FLAG_SET(cpu,Z) || (!!FLAG_SET(cpu,N)) != (!!FLAG_SET(cpu,V)) )) {
-                break;
-            }
-            continue;
-        case COND_AL: //Always
-            break;
-        case COND_NV: //Never
+        if(decoded->flags&DECODED_NEEDS_FLAGS) {
+            RESOLVE_FLAGS(cpu);
+        }
+        if(!CONDITION_PASSED(cpu,decoded->condition_mask)) {
             continue;
         }
-        instruction_handler_t handler = NULL;
         //We're executing the instruction
-        switch((instruction>>26)&03) {
-        case 0:
-            //Data processing, multiply or single data swap
-            if((instruction&0xf0) != 0x90) {
-                //data processing instruction...
-                handler = ALUInstruction;
-            }
-            else if(instruction&0xf00) {
-                //multiply
-                handler = MultiplyInstruction;
-            }
-            else {
-                //swap
-                handler = SwapInstruction;
-            }
-            break;
-        case 1:
-            //LDR or STR, or undefined
-            handler = SingleDataTransferInstruction;
-            break;
-        case 2:
-            //LDM or STM or branch
-            if(instruction&0x02000000) {
-                handler = BranchInstruction;
-            }
-            else {
-                handler = MultiDataTransferInstruction;
-            }
-            break;
-        case 3:
-            //coproc functions or swi
-            if((instruction&0x0f000000) == 0x0f000000) {
-                handler = SoftwareInterruptInstruction;
-            }
-            else if((instruction&0x02000000) == 0) {
-                handler = CoprocessorDataTransferInstruction;
-            }
-            else if(instruction&0x10) {
-                handler = CoprocessorRegisterTransferInstruction;
-            }
-            else {
-                handler = CoprocessorDataOperationInstruction;
-            }
-            break;
-        }
-        exception = handler(cpu,instruction);
+        exception = decoded->handler(cpu,decoded->instruction);
         //handle the exception if there was one
     handle_exception:
         if(exception != EXCEPT_NONE) {
-            //LOG("Instruction exception %d\n",exception);
-            if(exception == EXCEPT_BREAKPOINT) {
-                if(instructions == -1) {
-                    //this means we're running forver, so treat this as an SWI
-                    exception = EXCEPT_SOFTWARE_INTERRUPT;
-                }
-                else {
-                    //This is special and means stop executing the emulator
-                    //Don't advance PC next time since we're at a bkpt
-                    cpu->pc -= 4;
-                    return ARMV2STATUS_BREAKPOINT;
-                }
+            //LOG_DEBUG("Instruction exception %d\n",exception);
+            if(ARMV2STATUS_OK != take_exception(cpu,exception,&instructions)) {
+                return ARMV2STATUS_BREAKPOINT;
             }
-            exception_handler_t ex_handler = cpu->exception_handlers[exception];
-            cpu->regs.actual[ex_handler.save_reg] = cpu->regs.actual[PC];
-            cpu->regs.actual[PC] = ((cpu->regs.actual[PC])&0xfffffffc) | ex_handler.mode;
-            cpu->pc = ex_handler.pc-4;
         }
     }
     return ARMV2STATUS_OK;
 }
+
+//Run the core in slices that end at the next event deadline, so that it never has to check the time
+//itself. A slice can stop early at a breakpoint or when something is scheduled during it, and what it
+//didn't run is in cpu->budget_left
+enum armv2_status run_armv2(armv2_t *cpu, int32_t instructions) {
+    enum armv2_status result = ARMV2STATUS_OK;
+    //The host may have written to memory since we last ran, so whatever loop we were watching might not
+    //be idle any more
+    IDLE_RESET(cpu);
+    cpu->flags &= ~FLAG_HALTED;
+    if(instructions == -1) {
+        cpu->flags |= FLAG_RUN_FOREVER;
+    }
+    //Anything the host scheduled for right now
+    AdvanceEvents(cpu,0);
+    if(cpu->flags&FLAG_RECORDING) {
+        RecordInputs(cpu);
+    }
+    while(instructions != 0) {
+        int32_t slice = instructions == -1 ? INT32_MAX : instructions;
+        uint64_t next = NextDeadline(cpu);
+        if(next - cpu->cycles < (uint64_t)slice) {
+            slice = next - cpu->cycles;
+        }
+        cpu->budget_left = 0;
+        if((cpu->flags&FLAG_REPLAYING) && (cpu->flags&FLAG_WAITING) && UINT64_MAX != next) {
+            //The guest waits until the recording says something ended it, see ReplayInputs
+            cpu->idle_skipped += slice;
+        }
+        else {
+            cpu->flags &= ~FLAG_WAITING;
+            cpu->flags |= FLAG_RUNNING;
+#if defined(ARMV2_JIT)
+            result = jit_run_armv2(cpu,slice);
+#elif defined(ARMV2_THREADED)
+            result = threaded_armv2(cpu,slice);
+#else
+            result = interpret_armv2(cpu,slice);
+#endif
+            cpu->flags &= ~FLAG_RUNNING;
+        }
+        __atomic_fetch_and(&cpu->pins,~PIN_RESCHEDULE,__ATOMIC_RELAXED);
+        if(instructions != -1) {
+            instructions -= slice - cpu->budget_left;
+        }
+        AdvanceEvents(cpu,slice - cpu->budget_left);
+        if(cpu->flags&FLAG_RECORDING) {
+            RecordInputs(cpu);
+        }
+        if(ARMV2STATUS_RESCHEDULE == result) {
+            result = ARMV2STATUS_OK;
+        }
+        if(ARMV2STATUS_OK != result) {
+            break;
+        }
+    }
+    cpu->flags &= ~FLAG_RUN_FOREVER;
+    //Whoever called us is going to want to see the registers
+    RESOLVE_FLAGS(cpu);
+    return result;
+}
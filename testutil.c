@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include "testutil.h"
+
+int failures = 0;
+uint32_t device_calls = 0;
+
+static uint32_t rand_state = 0x12345678;
+
+uint32_t Random(void) {
+    rand_state ^= rand_state<<13;
+    rand_state ^= rand_state>>17;
+    rand_state ^= rand_state<<5;
+    return rand_state;
+}
+
+static uint32_t RandomRead(void *extra, uint32_t addr, uint32_t value) {
+    device_calls++;
+    return Random();
+}
+
+static uint32_t RandomWrite(void *extra, uint32_t addr, uint32_t value) {
+    device_calls++;
+    return 0;
+}
+
+static void RandomReadBlock(void *extra, uint32_t addr, uint32_t count, uint32_t *buffer) {
+    device_calls++;
+    for(uint32_t i=0;i<count;i++) {
+        buffer[i] = Random();
+    }
+}
+
+static void RandomWriteBlock(void *extra, uint32_t addr, uint32_t count, uint32_t *buffer) {
+    device_calls++;
+}
+
+hardware_device_t random_device = {
+    .device_id            = 0x52414e44,
+    .read_callback        = RandomRead,
+    .write_callback       = RandomWrite,
+    .read_byte_callback   = RandomRead,
+    .write_byte_callback  = RandomWrite,
+    .read_block_callback  = RandomReadBlock,
+    .write_block_callback = RandomWriteBlock,
+};
+
+//A cpu with MEMORY_SIZE of RAM starting with program, if there is one
+void SetupCpu(armv2_t *cpu, const uint32_t *program, size_t size) {
+    enum armv2_status result;
+    if(ARMV2STATUS_OK != (result = init(cpu,MEMORY_SIZE))) {
+        printf("Error %d creating cpu\n",result);
+        exit(1);
+    }
+    if(NULL != program) {
+        memcpy(cpu->physical_ram,program,size);
+    }
+}
+
+//Add device, or a timer if it's NULL, and map it at the page from start
+void AddDevice(armv2_t *cpu, hardware_device_t *device, uint32_t start) {
+    enum armv2_status result = NULL == device ? add_timer(cpu) : add_hardware(cpu,device);
+    if(ARMV2STATUS_OK == result) {
+        result = map_memory(cpu,cpu->num_hardware_devices-1,start,start+PAGE_SIZE);
+    }
+    if(ARMV2STATUS_OK != result) {
+        printf("Error %d adding a device at %08x\n",result,start);
+        exit(1);
+    }
+}
+
+//Check that got is in exactly the state expected is in, saying what's different if not. format says which
+//cpu it is. Returns 1 if they're the same
+int CompareState(armv2_t *expected, armv2_t *got, const char *format, ...) {
+    va_list args;
+    RESOLVE_FLAGS(expected);
+    RESOLVE_FLAGS(got);
+    if(expected->pc == got->pc && expected->cycles == got->cycles &&
+       memcmp(expected->regs.actual,got->regs.actual,sizeof(expected->regs.actual)) == 0 &&
+       memcmp(expected->physical_ram,got->physical_ram,MEMORY_SIZE) == 0) {
+        return 1;
+    }
+    va_start(args,format);
+    vprintf(format,args);
+    va_end(args);
+    printf(" differs\n    pc %08x %08x cycles %llu %llu\n",expected->pc,got->pc,(unsigned long long)expected->cycles,
+           (unsigned long long)got->cycles);
+    for(uint32_t i=0;i<NUMREGS;i++) {
+        if(expected->regs.actual[i] != got->regs.actual[i]) {
+            printf("    reg %u %08x %08x\n",i,expected->regs.actual[i],got->regs.actual[i]);
+        }
+    }
+    for(uint32_t i=0;i<MEMORY_SIZE/4;i++) {
+        if(expected->physical_ram[i] != got->physical_ram[i]) {
+            printf("    memory from %08x %08x %08x\n",i*4,expected->physical_ram[i],got->physical_ram[i]);
+            break;
+        }
+    }
+    failures++;
+    return 0;
+}
+
+//Make a file from the mkstemp template in filename holding size bytes of contents
+void MakeTempFile(char *filename, const void *contents, size_t size) {
+    int fd = mkstemp(filename);
+    if(fd < 0 || write(fd,contents,size) != (ssize_t)size) {
+        printf("Error writing %s\n",filename);
+        exit(1);
+    }
+    close(fd);
+}
+
+//Report how it went, returning the exit status
+int Finish(const char *name) {
+    printf("%s: %d failures\n",name,failures);
+    return failures ? 1 : 0;
+}
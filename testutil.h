@@ -0,0 +1,24 @@
+#ifndef __ARMV2_TESTUTIL_H__
+#define __ARMV2_TESTUTIL_H__
+
+#include "armv2.h"
+
+//What the checks have in common: a cpu with a program in its RAM and devices mapped in, a device that makes
+//its values up, comparing two cpus, and counting the failures
+
+#define MEMORY_SIZE (64*1024)
+
+extern int failures;
+//How many times random_device has been called
+extern uint32_t device_calls;
+//Every kind of callback, reads giving the next Random()
+extern hardware_device_t random_device;
+
+uint32_t Random(void);
+void SetupCpu(armv2_t *cpu, const uint32_t *program, size_t size);
+void AddDevice(armv2_t *cpu, hardware_device_t *device, uint32_t start);
+int CompareState(armv2_t *expected, armv2_t *got, const char *format, ...);
+void MakeTempFile(char *filename, const void *contents, size_t size);
+int Finish(const char *name);
+
+#endif
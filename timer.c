@@ -0,0 +1,101 @@
+#include "armv2.h"
+#include <stdlib.h>
+
+//A programmable interval timer built on the event scheduler. The guest maps it like any other device and
+//writes the number of cycles it wants between interrupts to TIMER_INTERVAL. Every time that many cycles
+//have gone by the timer counts a tick and raises its interrupt line, which stays up until the guest writes
+//to TIMER_TICKS to acknowledge them. Ticks are scheduled from the deadline of the one before rather than
+//from whenever the guest got round to acknowledging it, so they never drift
+typedef struct {
+    //first so that unload_device can free the whole thing
+    hardware_device_t device;
+    armv2_t          *cpu;
+    armv2_event_t     tick;
+    uint32_t          line;
+    uint32_t          interval;
+    uint32_t          ticks; //since the guest last acknowledged them
+} armv2_timer_t;
+
+static void TimerTick(armv2_t *cpu, void *extra) {
+    armv2_timer_t *timer = extra;
+    timer->ticks++;
+    armv2_raise_line(cpu,timer->line);
+    armv2_schedule(cpu,&timer->tick,timer->interval);
+}
+
+static uint32_t TimerRead(void *extra, uint32_t addr, uint32_t value) {
+    armv2_timer_t *timer = extra;
+    switch(addr) {
+    case TIMER_INTERVAL:
+        return timer->interval;
+    case TIMER_TICKS:
+        return timer->ticks;
+    default:
+        return 0;
+    }
+}
+
+static uint32_t TimerWrite(void *extra, uint32_t addr, uint32_t value) {
+    armv2_timer_t *timer = extra;
+    switch(addr) {
+    case TIMER_INTERVAL:
+        timer->interval = value;
+        if(0 == value) {
+            armv2_cancel(timer->cpu,&timer->tick);
+        }
+        else {
+            armv2_schedule(timer->cpu,&timer->tick,value);
+        }
+        break;
+    case TIMER_TICKS:
+        timer->ticks = 0;
+        armv2_lower_line(timer->cpu,timer->line);
+        break;
+    }
+    return 0;
+}
+
+static void TimerDestroy(void *extra) {
+    armv2_timer_t *timer = extra;
+    armv2_cancel(timer->cpu,&timer->tick);
+}
+
+//Built in, so there's no shared object to unload, but giving it a plugin means cleanup_armv2 treats it
+//like the native devices that belong to the cpu
+static const armv2_device_plugin_t timer_plugin = {
+    .abi_version    = ARMV2_DEVICE_ABI_VERSION,
+    .device_id      = TIMER_DEVICE_ID,
+    .name           = "timer",
+    .destroy        = TimerDestroy,
+    .read_callback  = TimerRead,
+    .write_callback = TimerWrite,
+};
+
+//Add a timer to the cpu. Like a device from load_device it's the last one in cpu->hardware_devices and
+//belongs to the cpu
+enum armv2_status add_timer(armv2_t *cpu) {
+    armv2_timer_t *timer;
+    enum armv2_status result;
+
+    if(NULL == cpu || !CPU_INITIALISED(cpu)) {
+        return ARMV2STATUS_INVALID_ARGS;
+    }
+    timer = calloc(1,sizeof(armv2_timer_t));
+    if(NULL == timer) {
+        return ARMV2STATUS_MEMORY_ERROR;
+    }
+    timer->cpu                   = cpu;
+    timer->line                  = cpu->num_hardware_devices;
+    timer->device.device_id      = timer_plugin.device_id;
+    timer->device.read_callback  = timer_plugin.read_callback;
+    timer->device.write_callback = timer_plugin.write_callback;
+    timer->device.plugin         = &timer_plugin;
+    timer->device.extra          = timer;
+    armv2_init_event(&timer->tick,TimerTick,timer);
+
+    result = add_hardware(cpu,&timer->device);
+    if(ARMV2STATUS_OK != result) {
+        free(timer);
+    }
+    return result;
+}
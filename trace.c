@@ -0,0 +1,189 @@
+#include "armv2.h"
+#include <stdio.h>
+#include <string.h>
+
+//The ring is preallocated so that recording never allocates, and it's shared by every cpu in the
+//process. Writers only ever touch trace_head and their own slot. trace_tail and trace_lost belong to the
+//one reader, whoever calls trace_drain
+static trace_record_t trace_ring[TRACE_RING_SIZE];
+static uint64_t trace_head;
+static uint64_t trace_tail;
+static uint64_t trace_lost;
+
+void trace_record(const char *fmt, uint32_t num_args, uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e) {
+    uint64_t position = __atomic_fetch_add(&trace_head,1,__ATOMIC_RELAXED);
+    trace_record_t *record = &trace_ring[position&TRACE_RING_MASK];
+
+    //Mark the slot as in progress before touching the body so that a reader copying it at the same time
+    //sees the sequence change and throws its copy away
+    __atomic_store_n(&record->sequence,0,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->fmt      = fmt;
+    record->num_args = num_args;
+    record->args[0]  = a;
+    record->args[1]  = b;
+    record->args[2]  = c;
+    record->args[3]  = d;
+    record->args[4]  = e;
+    __atomic_store_n(&record->sequence,position+1,__ATOMIC_RELEASE);
+}
+
+//Copy up to max finished records out of the ring in order, returning how many were copied. Records that
+//were overwritten before we got to them are counted in trace_dropped. A record that's still being written
+//stops the drain, it'll be picked up next time
+uint32_t trace_drain(trace_record_t *out, uint32_t max) {
+    uint32_t count = 0;
+    uint64_t head  = __atomic_load_n(&trace_head,__ATOMIC_ACQUIRE);
+
+    if(head - trace_tail > TRACE_RING_SIZE) {
+        //The writers have lapped us, so skip straight to the oldest record that can still be there
+        trace_lost += head - TRACE_RING_SIZE - trace_tail;
+        trace_tail  = head - TRACE_RING_SIZE;
+    }
+
+    while(count < max && trace_tail < head) {
+        trace_record_t *record = &trace_ring[trace_tail&TRACE_RING_MASK];
+        uint64_t sequence = __atomic_load_n(&record->sequence,__ATOMIC_ACQUIRE);
+
+        if(sequence != trace_tail + 1) {
+            if(sequence > trace_tail + 1) {
+                //overwritten by a later lap
+                trace_lost++;
+                trace_tail++;
+                continue;
+            }
+            break;
+        }
+        out[count] = *record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&record->sequence,__ATOMIC_RELAXED) != sequence) {
+            //A writer came round while we were copying it
+            trace_lost++;
+            trace_tail++;
+            continue;
+        }
+        count++;
+        trace_tail++;
+    }
+    return count;
+}
+
+uint64_t trace_dropped(void) {
+    return trace_lost;
+}
+
+//Format a record the way printf would have done at the time. All the arguments were widened to 64 bits
+//when they were recorded, so we drop any length modifiers from the format and put our own in. Returns the
+//length of the string written to buffer, truncating like snprintf, or -1 on error
+int trace_format(const trace_record_t *record, char *buffer, size_t size) {
+    const char *fmt = record->fmt;
+    uint32_t arg    = 0;
+    size_t used     = 0;
+
+    if(NULL == buffer || 0 == size) {
+        return -1;
+    }
+    while(NULL != fmt && *fmt && used + 1 < size) {
+        char spec[32];
+        size_t len = 0;
+        uint64_t value;
+        char conversion;
+        int written;
+
+        if(*fmt != '%') {
+            buffer[used++] = *fmt++;
+            continue;
+        }
+        spec[len++] = *fmt++;
+        while(*fmt && strchr("-+ #0123456789.",*fmt) && len < sizeof(spec) - 4) {
+            spec[len++] = *fmt++;
+        }
+        while(*fmt && strchr("hlLqjzt",*fmt)) {
+            fmt++;
+        }
+        conversion = *fmt;
+        if(conversion) {
+            fmt++;
+        }
+        value = arg < record->num_args ? record->args[arg] : 0;
+
+        switch(conversion) {
+        case '%':
+            written = snprintf(buffer+used,size-used,"%%");
+            break;
+        case 'd':
+        case 'i':
+            spec[len++] = 'l';
+            spec[len++] = 'l';
+            spec[len++] = conversion;
+            spec[len]   = 0;
+            written = snprintf(buffer+used,size-used,spec,(long long)value);
+            arg++;
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            spec[len++] = 'l';
+            spec[len++] = 'l';
+            spec[len++] = conversion;
+            spec[len]   = 0;
+            written = snprintf(buffer+used,size-used,spec,(unsigned long long)value);
+            arg++;
+            break;
+        case 'c':
+            spec[len++] = conversion;
+            spec[len]   = 0;
+            written = snprintf(buffer+used,size-used,spec,(int)value);
+            arg++;
+            break;
+        case 'p':
+            spec[len++] = conversion;
+            spec[len]   = 0;
+            written = snprintf(buffer+used,size-used,spec,(void*)(uintptr_t)value);
+            arg++;
+            break;
+        case 's':
+            spec[len++] = conversion;
+            spec[len]   = 0;
+            written = snprintf(buffer+used,size-used,spec,value ? (const char*)(uintptr_t)value : "(null)");
+            arg++;
+            break;
+        default:
+            //Not something we know how to format, so just print it as it was
+            spec[len] = 0;
+            written = snprintf(buffer+used,size-used,"%s%c",spec,conversion ? conversion : ' ');
+            break;
+        }
+        if(written < 0) {
+            return -1;
+        }
+        used += written;
+        if(used >= size) {
+            used = size - 1;
+        }
+    }
+    buffer[used] = 0;
+    return (int)used;
+}
+
+//Drain everything that's in the ring and write it out as text
+void trace_dump(FILE *f) {
+    trace_record_t records[64];
+    char line[256];
+    uint64_t lost = trace_lost;
+    uint32_t count;
+
+    while((count = trace_drain(records,sizeof(records)/sizeof(records[0]))) > 0) {
+        if(trace_lost != lost) {
+            fprintf(f,"[%llu trace records lost]\n",(unsigned long long)(trace_lost - lost));
+            lost = trace_lost;
+        }
+        for(uint32_t i=0;i<count;i++) {
+            if(trace_format(&records[i],line,sizeof(line)) >= 0) {
+                fputs(line,f);
+            }
+        }
+    }
+    fflush(f);
+}